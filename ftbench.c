@@ -0,0 +1,886 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftbench.c
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Benchmark and load generator for ftserve.c.
+ *      Build and run with "make bench".  Creates a data set
+ *      (files of 1 KB to 10 GB and directories of 10 to
+ *      100000 entries) in a directory that is kept between
+ *      runs, starts ftserve in it on a port of its own and
+ *      runs a matrix of GET, LIST and CD cases at several
+ *      levels of concurrency.  Each client is a process of
+ *      its own that speaks the protocol directly (in passive
+ *      mode), so the clients cost as little as possible.
+ *      One line of comma-separated results is printed per
+ *      case; with "-c <file>" the results of an earlier run
+ *      are compared against.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include "ftbench.h"
+
+//Static Variables:
+const char * data_dir = BENCH_DIR;
+unsigned short port = BENCH_PORT;
+double duration = BENCH_SECONDS;
+off_t max_size = BENCH_MAX_SIZE;
+pid_t server_pid = -1;
+off_t bench_sizes[] = {1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 256 * 1024 * 1024,
+    1024LL * 1024 * 1024, 10LL * 1024 * 1024 * 1024};
+long bench_counts[] = {10, 1000, 100000};
+int bench_levels[BENCH_MAX_LEVELS] = {1, 8, 64};
+int level_count = 3;
+const char * commands = "get,list,cd";
+struct bench_baseline * baseline;
+int baseline_count;
+
+int main(int argc, char * argv[]) {
+    char server[PATH_MAX];
+    const char * server_path = "./ftserve", * engine = NULL, * workers = NULL, * baseline_path = NULL;
+    int opt;
+
+    //Parse options:
+    while((opt = getopt(argc, argv, "d:p:t:m:j:o:e:w:s:c:")) != -1) {
+        if(opt == 'd') {
+            data_dir = optarg;
+        }
+        else if(opt == 'p' && atoi(optarg) > 0 && atoi(optarg) <= 65535) {
+            port = atoi(optarg);
+        }
+        else if(opt == 't' && (duration = atof(optarg)) > 0) {
+            continue;
+        }
+        else if(opt == 'm' && (max_size = parse_size(optarg)) > 0) {
+            continue;
+        }
+        else if(opt == 'j' && parse_levels(optarg) == 0) {
+            continue;
+        }
+        else if(opt == 'o') {
+            commands = optarg;
+        }
+        else if(opt == 'e') {
+            engine = optarg;
+        }
+        else if(opt == 'w') {
+            workers = optarg;
+        }
+        else if(opt == 's') {
+            server_path = optarg;
+        }
+        else if(opt == 'c') {
+            baseline_path = optarg;
+        }
+        else {
+            printf("Usage:\n\t%s [-d <dir>] [-p <port>] [-t <seconds>] [-m <max size>] [-j <clients>,...]\n"
+                "\t\t[-o get,list,cd] [-e epoll|uring] [-w <workers>] [-s <ftserve>] [-c <baseline>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    //The server runs in the data directory, so find it from here first:
+    if(realpath(server_path, server) == NULL) {
+        perror("Error finding ftserve");
+        exit(EXIT_FAILURE);
+    }
+    if(baseline_path != NULL) {
+        load_baseline(baseline_path);
+    }
+
+    //A client whose server goes away should see an error, not a signal:
+    signal(SIGPIPE, SIG_IGN);
+
+    prepare_data();
+    start_server(server, engine, workers);
+    run_matrix();
+    stop_server();
+
+    return EXIT_SUCCESS;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Parses a size with an optional K, M or G suffix (e.g. "256M")
+ * Param:   const char * text -  The size
+ * Return:  off_t -  Number of bytes, or -1 if it is not a size
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+off_t parse_size(const char * text) {
+    char * end;
+    long long size = strtoll(text, &end, 10);
+
+    if(end == text || size < 0) {
+        return -1;
+    }
+    if(*end == 'K' || *end == 'k') {
+        size <<= 10;
+        end++;
+    }
+    else if(*end == 'M' || *end == 'm') {
+        size <<= 20;
+        end++;
+    }
+    else if(*end == 'G' || *end == 'g') {
+        size <<= 30;
+        end++;
+    }
+
+    return *end == '\0' ? size : -1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Parses the levels of concurrency to run each case at (e.g. "1,8,64")
+ * Param:   const char * text -  Comma-separated numbers of clients
+ * Return:  int -  0 on success, -1 if the list is not valid
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int parse_levels(const char * text) {
+    char * end;
+    long clients;
+
+    level_count = 0;
+    while(*text != '\0' && level_count < BENCH_MAX_LEVELS) {
+        clients = strtol(text, &end, 10);
+        if(end == text || clients < 1 || clients > BENCH_MAX_CLIENTS || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        bench_levels[level_count++] = clients;
+        text = *end == ',' ? end + 1 : end;
+    }
+
+    return level_count > 0 && *text == '\0' ? 0 : -1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Creates whatever part of the data set is missing: "file-<size>" for each
+ *      size up to the largest asked for (as long as it fits on the disk) and
+ *      "list-<count>" directories of empty files.  What is already there from
+ *      an earlier run is kept.
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void prepare_data(void) {
+    char path[PATH_MAX];
+    struct statvfs fs;
+    size_t i;
+
+    if(mkdir(data_dir, 0755) == -1 && errno != EEXIST) {
+        perror("Error creating data directory");
+        exit(EXIT_FAILURE);
+    }
+
+    for(i=0; i<sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+        if(bench_sizes[i] > max_size || have_file(bench_sizes[i])) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/file-%lld", data_dir, (long long) bench_sizes[i]);
+        unlink(path);
+        if(statvfs(data_dir, &fs) == 0 && (off_t) fs.f_bavail * (off_t) fs.f_frsize < bench_sizes[i] + BENCH_FREE_MARGIN) {
+            fprintf(stderr, "Skipping %lld-byte files: not enough free space in %s\n", (long long) bench_sizes[i], data_dir);
+            continue;
+        }
+        make_file(path, bench_sizes[i]);
+    }
+
+    for(i=0; i<sizeof(bench_counts) / sizeof(bench_counts[0]); i++) {
+        snprintf(path, sizeof(path), "%s/list-%ld", data_dir, bench_counts[i]);
+        make_directory(path, bench_counts[i]);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Checks whether the data set has a complete file of the given size
+ * Param:   off_t size -  Size of the file
+ * Return:  int -  1 if it does, 0 if not
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int have_file(off_t size) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/file-%lld", data_dir, (long long) size);
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == size;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Creates a file of pseudo-random bytes (which neither compress nor share
+ *      blocks, so nothing along the way can shortcut them)
+ * Param:   const char * path -  Name of the file
+ * Param:   off_t size -  Its size
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void make_file(const char * path, off_t size) {
+    uint64_t state = 0x9e3779b97f4a7c15ull ^ (uint64_t) size, * words;
+    char * buffer;
+    off_t written = 0;
+    size_t i, length;
+    int fd;
+
+    fprintf(stderr, "Creating %s (%lld bytes)\n", path, (long long) size);
+    if((buffer = malloc(XFER_CHUNK)) == NULL) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+    if((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) == -1) {
+        perror("Error creating file");
+        exit(EXIT_FAILURE);
+    }
+
+    words = (uint64_t *) buffer;
+    while(written < size) {
+        for(i=0; i<XFER_CHUNK / sizeof(uint64_t); i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            words[i] = state;
+        }
+        length = size - written < XFER_CHUNK ? size - written : XFER_CHUNK;
+        if(write_all(fd, buffer, length) == -1) {
+            perror("Error writing file");
+            unlink(path);
+            exit(EXIT_FAILURE);
+        }
+        written += length;
+    }
+
+    close(fd);
+    free(buffer);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Creates a directory of empty files, "f000000" onwards, unless an earlier
+ *      run already has
+ * Param:   const char * path -  Name of the directory
+ * Param:   long count -  Number of files in it
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void make_directory(const char * path, long count) {
+    char name[PATH_MAX];
+    struct stat st;
+    long i;
+    int fd;
+
+    snprintf(name, sizeof(name), "%s/f%06ld", path, count - 1);
+    if(stat(name, &st) == 0) {
+        return;
+    }
+
+    fprintf(stderr, "Creating %s (%ld files)\n", path, count);
+    if(mkdir(path, 0755) == -1 && errno != EEXIST) {
+        perror("Error creating directory");
+        exit(EXIT_FAILURE);
+    }
+    for(i=0; i<count; i++) {
+        snprintf(name, sizeof(name), "%s/f%06ld", path, i);
+        if((fd = open(name, O_CREAT | O_WRONLY, 0644)) == -1) {
+            perror("Error creating file");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Starts ftserve in the data directory on the benchmark's port and waits
+ *      until it accepts connections
+ * Param:   const char * path -  Where ftserve is
+ * Param:   const char * engine -  Its event loop ("-e"), or NULL for the default
+ * Param:   const char * workers -  Its number of workers ("-w"), or NULL for one process
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void start_server(const char * path, const char * engine, const char * workers) {
+    char port_arg[16];
+    char * args[8];
+    int i, n = 0, fd, status;
+
+    snprintf(port_arg, sizeof(port_arg), "%u", port);
+    args[n++] = (char *) path;
+    args[n++] = "-p";
+    args[n++] = port_arg;
+    if(engine != NULL) {
+        args[n++] = "-e";
+        args[n++] = (char *) engine;
+    }
+    if(workers != NULL) {
+        args[n++] = "-w";
+        args[n++] = (char *) workers;
+    }
+    args[n] = NULL;
+
+    if((server_pid = fork()) == -1) {
+        perror("Error starting server");
+        exit(EXIT_FAILURE);
+    }
+
+    //The server's own output would get in the way of the results:
+    if(server_pid == 0) {
+        if((fd = open("/dev/null", O_WRONLY)) != -1) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        if(chdir(data_dir) == 0) {
+            execv(path, args);
+        }
+        _exit(127);
+    }
+
+    for(i=0; i<BENCH_START_TIMEOUT / 10; i++) {
+        if((fd = client_dial(port)) != -1) {
+            close(fd);
+            fprintf(stderr, "Server started on port %u\n", port);
+            return;
+        }
+        if(waitpid(server_pid, &status, WNOHANG) == server_pid) {
+            fprintf(stderr, "Error: the server exited (is port %u in use?)\n", port);
+            exit(EXIT_FAILURE);
+        }
+        usleep(10000);
+    }
+
+    fprintf(stderr, "Error: the server did not start listening on port %u\n", port);
+    stop_server();
+    exit(EXIT_FAILURE);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Shuts the server down and waits for it to exit
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void stop_server(void) {
+
+    if(server_pid > 0) {
+        kill(server_pid, SIGINT);
+        waitpid(server_pid, NULL, 0);
+        server_pid = -1;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the CPU time used by the server so far, counting its workers
+ * Param:   void
+ * Return:  long long -  Nanoseconds of CPU time
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+long long server_cpu_ns(void) {
+    char path[64], buffer[4096], * p, * end;
+    long long total = process_cpu_ns(server_pid);
+    ssize_t length;
+    long pid;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int) server_pid, (int) server_pid);
+    if((fd = open(path, O_RDONLY)) == -1) {
+        return total;
+    }
+    length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    buffer[length > 0 ? length : 0] = '\0';
+
+    for(p = buffer; (pid = strtol(p, &end, 10)) > 0; p = end) {
+        total += process_cpu_ns(pid);
+    }
+    return total;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the CPU time (user and system) a process has used, from /proc
+ * Param:   pid_t pid -  The process
+ * Return:  long long -  Nanoseconds of CPU time, or 0 if it can't be read
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+long long process_cpu_ns(pid_t pid) {
+    char path[64], buffer[1024], * fields;
+    unsigned long long user, system;
+    ssize_t length;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    if((fd = open(path, O_RDONLY)) == -1) {
+        return 0;
+    }
+    length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    buffer[length > 0 ? length : 0] = '\0';
+
+    //The command name may hold anything, so start after its closing parenthesis:
+    if((fields = strrchr(buffer, ')')) == NULL ||
+        sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &user, &system) != 2) {
+        return 0;
+    }
+    return (long long) ((user + system) * (1e9 / sysconf(_SC_CLK_TCK)));
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Runs every case of the matrix (for the commands chosen with "-o"),
+ *      printing the results as it goes.  GETs of
+ *      files so large that all of the clients together would move more than
+ *      BENCH_CASE_BYTES are only run with a single client.
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void run_matrix(void) {
+    struct bench_case b;
+    size_t i;
+    int j;
+
+    printf("command,size,files,clients,seconds,ops,errors,bytes,mb_s,files_s,p50_ms,p99_ms,"
+        "server_ns_per_byte,client_ns_per_byte,server_us_per_op%s\n", baseline_count > 0 ? ",mb_s_change,p99_change" : "");
+    fflush(stdout);
+
+    for(j=0; j<level_count && strstr(commands, "get") != NULL; j++) {
+        for(i=0; i<sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+            b.command = GET;
+            b.size = bench_sizes[i];
+            b.files = 1;
+            b.clients = bench_levels[j];
+            if(bench_sizes[i] <= max_size && have_file(b.size) && (b.clients == 1 || b.size * b.clients <= BENCH_CASE_BYTES)) {
+                run_case(&b);
+            }
+        }
+    }
+
+    for(j=0; j<level_count && strstr(commands, "list") != NULL; j++) {
+        for(i=0; i<sizeof(bench_counts) / sizeof(bench_counts[0]); i++) {
+            b.command = LIST;
+            b.size = 0;
+            b.files = bench_counts[i];
+            b.clients = bench_levels[j];
+            run_case(&b);
+        }
+    }
+
+    for(j=0; j<level_count && strstr(commands, "cd") != NULL; j++) {
+        b.command = CD;
+        b.size = 0;
+        b.files = 0;
+        b.clients = bench_levels[j];
+        run_case(&b);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Runs one case: starts a process per client, lets them all connect, starts
+ *      them at once, and times them until the last has finished.  Clients
+ *      start operations for the case's duration and finish the one they are
+ *      in, so every case runs at least one operation per client.
+ * Param:   struct bench_case * b -  The case
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void run_case(struct bench_case * b) {
+    struct bench_result * results;
+    struct rusage before, after;
+    size_t length = sizeof(*results) * b->clients;
+    long long start, server_ns;
+    int i, ready[2], go[2];
+    pid_t * pids;
+    char byte;
+
+    results = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(results == MAP_FAILED || (pids = malloc(b->clients * sizeof(*pids))) == NULL || pipe(ready) == -1 || pipe(go) == -1) {
+        perror("Error setting up clients");
+        stop_server();
+        exit(EXIT_FAILURE);
+    }
+    getrusage(RUSAGE_CHILDREN, &before);
+
+    for(i=0; i<b->clients; i++) {
+        if((pids[i] = fork()) == -1) {
+            perror("Error starting client");
+            stop_server();
+            exit(EXIT_FAILURE);
+        }
+        if(pids[i] == 0) {
+            close(ready[0]);
+            close(go[1]);
+            client_run(b, &results[i], ready[1], go[0]);
+            _exit(EXIT_SUCCESS);
+        }
+    }
+    close(ready[1]);
+    close(go[0]);
+
+    //Wait for every client to connect, then let them all go at once:
+    for(i=0; i<b->clients && read(ready[0], &byte, 1) == 1; i++);
+    close(ready[0]);
+    server_ns = server_cpu_ns();
+    start = xfer_clock_ns();
+    close(go[1]);
+
+    //(The server is a child too, so wait for the clients by name:)
+    for(i=0; i<b->clients; i++) {
+        while(waitpid(pids[i], NULL, 0) == -1 && errno == EINTR);
+    }
+    getrusage(RUSAGE_CHILDREN, &after);
+
+    report(b, results, xfer_clock_ns() - start, server_cpu_ns() - server_ns,
+        (after.ru_utime.tv_sec + after.ru_stime.tv_sec - before.ru_utime.tv_sec - before.ru_stime.tv_sec) * 1000000000LL +
+        (after.ru_utime.tv_usec + after.ru_stime.tv_usec - before.ru_utime.tv_usec - before.ru_stime.tv_usec) * 1000LL);
+    munmap(results, length);
+    free(pids);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Body of a client process: connects, reports that it is ready, waits for
+ *      the start and runs the case's operation until its time is up
+ * Param:   struct bench_case * b -  The case
+ * Param:   struct bench_result * r -  Where to record what it did
+ * Param:   int ready_fd -  Pipe to report readiness on
+ * Param:   int go_fd -  Pipe that is closed to start
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void client_run(struct bench_case * b, struct bench_result * r, int ready_fd, int go_fd) {
+    struct bench_client c;
+    long long deadline, start;
+    off_t moved;
+    char byte = 0;
+
+    if(client_connect(&c, b) == -1) {
+        r->errors++;
+        write(ready_fd, &byte, 1);
+        return;
+    }
+    write(ready_fd, &byte, 1);
+    read(go_fd, &byte, 1);
+
+    deadline = xfer_clock_ns() + (long long) (duration * 1e9);
+    while(c.ctrl_fd != -1 && (start = xfer_clock_ns()) < deadline) {
+        if((moved = client_op(&c, b, r->ops + r->errors)) == -1) {
+            r->errors++;
+            continue;
+        }
+        r->ops++;
+        r->bytes += moved;
+        if(r->samples < BENCH_SAMPLES) {
+            r->latency[r->samples++] = xfer_clock_ns() - start;
+        }
+    }
+
+    if(c.ctrl_fd != -1) {
+        close(c.ctrl_fd);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Opens a client's control connection: takes in the greeting, switches to
+ *      passive mode and, for a LIST case, moves into the directory it lists
+ * Param:   struct bench_client * c -  The client
+ * Param:   struct bench_case * b -  The case
+ * Return:  int -  0 on success, -1 on error
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int client_connect(struct bench_client * c, struct bench_case * b) {
+    char request[BUF_SIZE];
+
+    if((c->ctrl_fd = client_dial(port)) == -1 || (c->buffer = malloc(BENCH_BUF_SIZE)) == NULL) {
+        return -1;
+    }
+    ring_init(&c->ctrl, RING_SIZE, RING_SIZE);
+
+    snprintf(request, sizeof(request), "cd list-%ld\n", b->files);
+    if(client_command(c, NULL) == -1 || client_command(c, "passive\n") == -1 ||
+        (b->command == LIST && client_command(c, request) == -1)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Runs one operation of a case.  CD cases go into a directory and back out
+ *      in turn.
+ * Param:   struct bench_client * c -  The client
+ * Param:   struct bench_case * b -  The case
+ * Param:   long n -  Number of operations the client has run so far
+ * Return:  off_t -  Bytes received on the data connection, or -1 on error
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+off_t client_op(struct bench_client * c, struct bench_case * b, long n) {
+    char request[BUF_SIZE];
+
+    if(b->command == GET) {
+        snprintf(request, sizeof(request), "get file-%lld\n", (long long) b->size);
+        return client_transfer(c, request, b->size);
+    }
+    if(b->command == LIST) {
+        return client_transfer(c, "list\n", -1);
+    }
+
+    snprintf(request, sizeof(request), n % 2 == 0 ? "cd list-%ld\n" : "cd ..\n", bench_counts[0]);
+    return client_command(c, request);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sends a request that is answered over a data connection and reads the
+ *      whole answer: the data (from the port the server names in its "PASV"
+ *      reply), then the rest of the reply up to the prompt
+ * Param:   struct bench_client * c -  The client
+ * Param:   const char * request -  The request
+ * Param:   off_t expected -  Bytes that should arrive, or -1 if not known
+ * Return:  off_t -  Bytes received, or -1 on error (the control connection
+ *      is closed if it failed)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+off_t client_transfer(struct bench_client * c, const char * request, off_t expected) {
+    char line[BUF_SIZE];
+    unsigned int data_port;
+    off_t received = 0;
+    ssize_t num_read;
+    int result, data_fd, connected = 0, failed = 0;
+
+    if(write_all(c->ctrl_fd, request, strlen(request)) == -1) {
+        close(c->ctrl_fd);
+        c->ctrl_fd = -1;
+        return -1;
+    }
+
+    while((result = client_line(c, line, sizeof(line))) == 1) {
+        if(!connected && sscanf(line, "PASV %u", &data_port) == 1) {
+            connected = 1;
+            if((data_fd = client_dial(data_port)) == -1) {
+                failed = 1;
+                continue;
+            }
+            while((num_read = read(data_fd, c->buffer, BENCH_BUF_SIZE)) != 0) {
+                if(num_read == -1 && errno != EINTR) {
+                    failed = 1;
+                    break;
+                }
+                received += num_read > 0 ? num_read : 0;
+            }
+            close(data_fd);
+        }
+        else if(strncmp(line, "Error", 5) == 0 || strncmp(line, "Invalid", 7) == 0 || strcmp(line, "CRC32C -") == 0) {
+            failed = 1;
+        }
+    }
+
+    if(result == -1) {
+        close(c->ctrl_fd);
+        c->ctrl_fd = -1;
+        return -1;
+    }
+    if(failed || !connected || (expected >= 0 && received != expected)) {
+        return -1;
+    }
+    return received;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sends a request that is answered on the control connection alone and
+ *      reads the reply up to the prompt
+ * Param:   struct bench_client * c -  The client
+ * Param:   const char * request -  The request, or NULL to only read a reply
+ *      (e.g. the greeting)
+ * Return:  int -  0 on success, -1 if the server replied with an error or
+ *      the control connection failed (in which case it is closed)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int client_command(struct bench_client * c, const char * request) {
+    char line[BUF_SIZE];
+    int result, failed = 0;
+
+    if(request != NULL && write_all(c->ctrl_fd, request, strlen(request)) == -1) {
+        result = -1;
+    }
+    else {
+        while((result = client_line(c, line, sizeof(line))) == 1) {
+            if(strncmp(line, "Error", 5) == 0 || strncmp(line, "Invalid", 7) == 0) {
+                failed = 1;
+            }
+        }
+    }
+
+    if(result == -1) {
+        close(c->ctrl_fd);
+        c->ctrl_fd = -1;
+        return -1;
+    }
+    return failed ? -1 : 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the next line of a reply from the control connection
+ * Param:   struct bench_client * c -  The client
+ * Param:   char * line -  Buffer to store the null-terminated line
+ * Param:   size_t size -  Size of the buffer
+ * Return:  int -  1 for a line, 0 once the prompt that ends the reply has
+ *      been read, or -1 if the connection closed or failed
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int client_line(struct bench_client * c, char * line, size_t size) {
+    char prompt[sizeof(PROMPT)];
+    ssize_t num_read;
+    int length;
+
+    while(1) {
+        if(ring_find(&c->ctrl, PROMPT) == (ssize_t) strlen(PROMPT)) {
+            ring_read(&c->ctrl, prompt, strlen(PROMPT));
+            return 0;
+        }
+
+        //Blank and over-long lines are skipped:
+        if((length = ring_getline(&c->ctrl, line, size)) > 0) {
+            return 1;
+        }
+        if(length != RING_NO_LINE) {
+            continue;
+        }
+        if((num_read = ring_fill(&c->ctrl, c->ctrl_fd)) == 0 || (num_read == -1 && errno != EINTR)) {
+            return -1;
+        }
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Connects to a port of the server on this host
+ * Param:   unsigned short to_port -  The port
+ * Return:  int -  The connected socket, or -1 on error
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int client_dial(unsigned short to_port) {
+    struct sockaddr_in address;
+    int fd;
+
+    if((fd = socket(AF_INET, SOCK_STREAM, PROTOCOL)) == -1) {
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(to_port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Prints a case's results as one line of comma-separated values: the case,
+ *      its duration, operations, errors and bytes, the throughput in MB/s and
+ *      files (or listed entries) per second, the 50th and 99th percentile
+ *      latency of an operation, and the CPU time the server and the clients
+ *      spent per byte and the server per operation.  Against a baseline,
+ *      the change in throughput and in 99th percentile latency follows.
+ * Param:   struct bench_case * b -  The case
+ * Param:   struct bench_result * results -  What each client did
+ * Param:   long long elapsed_ns -  How long the case took
+ * Param:   long long server_ns -  CPU time the server used during it
+ * Param:   long long client_ns -  CPU time the clients used
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void report(struct bench_case * b, struct bench_result * results, long long elapsed_ns, long long server_ns, long long client_ns) {
+    struct bench_baseline * base;
+    long long * latency;
+    long ops = 0, errors = 0, samples = 0;
+    off_t bytes = 0;
+    double seconds = elapsed_ns / 1e9, mb_s, p50 = 0, p99 = 0;
+    char key[64];
+    int i;
+
+    for(i=0; i<b->clients; i++) {
+        ops += results[i].ops;
+        errors += results[i].errors;
+        bytes += results[i].bytes;
+        samples += results[i].samples;
+    }
+
+    //Percentiles of every latency recorded:
+    if(samples > 0 && (latency = malloc(samples * sizeof(*latency))) != NULL) {
+        for(samples = 0, i = 0; i<b->clients; i++) {
+            memcpy(latency + samples, results[i].latency, results[i].samples * sizeof(*latency));
+            samples += results[i].samples;
+        }
+        qsort(latency, samples, sizeof(*latency), compare_latency);
+        p50 = latency[(samples - 1) * 50 / 100] / 1e6;
+        p99 = latency[(samples - 1) * 99 / 100] / 1e6;
+        free(latency);
+    }
+
+    mb_s = seconds > 0 ? bytes / seconds / 1e6 : 0;
+    snprintf(key, sizeof(key), "%s,%lld,%ld,%d", b->command == GET ? "get" : b->command == LIST ? "list" : "cd",
+        (long long) b->size, b->files, b->clients);
+    printf("%s,%.3f,%ld,%ld,%lld,%.1f,%.1f,%.3f,%.3f,%.3f,%.3f,%.1f", key, seconds, ops, errors, (long long) bytes, mb_s,
+        seconds > 0 ? ops * (b->command == LIST ? b->files : 1) / seconds : 0, p50, p99,
+        bytes > 0 ? (double) server_ns / bytes : 0, bytes > 0 ? (double) client_ns / bytes : 0,
+        ops > 0 ? server_ns / 1e3 / ops : 0);
+
+    if(baseline_count > 0) {
+        if((base = find_baseline(key)) != NULL) {
+            printf(",%+.1f%%,%+.1f%%", base->mb_s > 0 ? (mb_s / base->mb_s - 1) * 100 : 0,
+                base->p99_ms > 0 ? (p99 / base->p99_ms - 1) * 100 : 0);
+        }
+        else {
+            printf(",,");
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Orders latencies for qsort()
+ * Param:   const void * a -  The first latency
+ * Param:   const void * b -  The second latency
+ * Return:  int -  Negative, zero or positive as a is less than, equal to or
+ *      greater than b
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int compare_latency(const void * a, const void * b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Loads the results of an earlier run (its output, as printed) to compare
+ *      each case against
+ * Param:   const char * path -  The earlier run's output
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void load_baseline(const char * path) {
+    char line[1024], * field, * next;
+    struct bench_baseline * base;
+    FILE * file;
+    int column;
+
+    if((file = fopen(path, "r")) == NULL || (baseline = calloc(BENCH_BASELINE_MAX, sizeof(*baseline))) == NULL) {
+        perror("Error reading baseline");
+        exit(EXIT_FAILURE);
+    }
+
+    while(baseline_count < BENCH_BASELINE_MAX && fgets(line, sizeof(line), file) != NULL) {
+        if(strncmp(line, "command,", 8) == 0) {
+            continue;
+        }
+        base = &baseline[baseline_count];
+
+        //The case is the first four columns; throughput and p99 are the 9th and 12th:
+        for(column = 0, field = line; field != NULL && column < 12; column++, field = next) {
+            if((next = strchr(field, ',')) != NULL) {
+                *next++ = '\0';
+            }
+            if(column < 4) {
+                snprintf(base->key + strlen(base->key), sizeof(base->key) - strlen(base->key), column > 0 ? ",%s" : "%s", field);
+            }
+            else if(column == 8) {
+                base->mb_s = atof(field);
+            }
+            else if(column == 11) {
+                base->p99_ms = atof(field);
+            }
+        }
+        if(column == 12) {
+            baseline_count++;
+        }
+        else {
+            memset(base, 0, sizeof(*base));
+        }
+    }
+
+    fclose(file);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Finds a case in the baseline
+ * Param:   const char * key -  The case ("command,size,files,clients")
+ * Return:  struct bench_baseline * -  Its results, or NULL if the baseline
+ *      did not run it
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct bench_baseline * find_baseline(const char * key) {
+    int i;
+
+    for(i=0; i<baseline_count; i++) {
+        if(strcmp(baseline[i].key, key) == 0) {
+            return &baseline[i];
+        }
+    }
+    return NULL;
+}
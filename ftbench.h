@@ -0,0 +1,100 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftbench.h
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Header file for ftbench.c
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ftutil.h"
+#include "ftxfer.h"
+
+//Constants:
+#define BENCH_PORT 30121
+#define BENCH_DIR "/tmp/ftbench"
+#define BENCH_SECONDS 2.0
+#define BENCH_MAX_SIZE (10LL * 1024 * 1024 * 1024)
+#define BENCH_CASE_BYTES (16LL * 1024 * 1024 * 1024)
+#define BENCH_FREE_MARGIN (256LL * 1024 * 1024)
+#define BENCH_MAX_LEVELS 16
+#define BENCH_MAX_CLIENTS 1024
+#define BENCH_SAMPLES 65536
+#define BENCH_BUF_SIZE (256 * 1024)
+#define BENCH_START_TIMEOUT 5000
+#define BENCH_BASELINE_MAX 1024
+
+//Types:
+
+//One case of the benchmark matrix: a command, what it works on (the size of
+//the file a GET fetches, the number of entries a LIST sends) and how many
+//clients run it at once
+struct bench_case {
+    int command;
+    off_t size;
+    long files;
+    int clients;
+};
+
+//What one client did during a case.  Each client process writes its own in
+//memory shared with the parent, which adds them up.
+struct bench_result {
+    long ops;
+    long errors;
+    off_t bytes;
+    long samples;
+    long long latency[BENCH_SAMPLES];
+};
+
+//A client's control connection
+struct bench_client {
+    int ctrl_fd;
+    struct ring ctrl;
+    char * buffer;
+};
+
+//A case from an earlier run to compare against
+struct bench_baseline {
+    char key[64];
+    double mb_s;
+    double p99_ms;
+};
+
+//Function Prototypes:
+off_t parse_size(const char * text);
+int parse_levels(const char * text);
+void prepare_data(void);
+int have_file(off_t size);
+void make_file(const char * path, off_t size);
+void make_directory(const char * path, long count);
+void start_server(const char * path, const char * engine, const char * workers);
+void stop_server(void);
+long long server_cpu_ns(void);
+long long process_cpu_ns(pid_t pid);
+void run_matrix(void);
+void run_case(struct bench_case * b);
+void client_run(struct bench_case * b, struct bench_result * r, int ready_fd, int go_fd);
+int client_connect(struct bench_client * c, struct bench_case * b);
+off_t client_op(struct bench_client * c, struct bench_case * b, long n);
+off_t client_transfer(struct bench_client * c, const char * request, off_t expected);
+int client_command(struct bench_client * c, const char * request);
+int client_line(struct bench_client * c, char * line, size_t size);
+int client_dial(unsigned short port);
+void report(struct bench_case * b, struct bench_result * results, long long elapsed_ns, long long server_ns, long long client_ns);
+int compare_latency(const void * a, const void * b);
+void load_baseline(const char * path);
+struct bench_baseline * find_baseline(const char * key);
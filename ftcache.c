@@ -0,0 +1,354 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftcache.c
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Cache of hot files for the server.  Files
+ *      that are fetched again and again are kept open, and
+ *      small ones are kept in memory, so a repeated get needs
+ *      no open(), stat() or read() at all.  An entry is
+ *      checked against the file (inode, size and modification
+ *      time) at most once every CACHE_VALID_MS, and replaced
+ *      when the file has changed.  The least recently used
+ *      entries are evicted to stay within CACHE_MAX_ENTRIES
+ *      files and CACHE_MAX_BYTES of memory.  Entries also
+ *      remember the file's checksum once it has been worked out.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include "ftcache.h"
+
+//Static Variables:
+static struct cache_entry * table[CACHE_BUCKETS];
+static struct cache_entry * lru_head;
+static struct cache_entry * lru_tail;
+static struct cache_stats stats;
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads a cheap monotonic clock (entries only need checking once a second)
+ * Param:   void
+ * Return:  long long -  Milliseconds since an arbitrary point
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static long long cache_now_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Hashes a file's key: the directory it was opened from and its name (FNV-1a)
+ * Param:   dev_t dir_dev -  Device of the directory
+ * Param:   ino_t dir_ino -  Inode of the directory
+ * Param:   const char * name -  Name of the file, relative to the directory
+ * Return:  unsigned int -  The hash
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static unsigned int cache_hash(dev_t dir_dev, ino_t dir_ino, const char * name) {
+    unsigned int hash = 2166136261u;
+
+    hash = (hash ^ (unsigned int) dir_dev) * 16777619u;
+    hash = (hash ^ (unsigned int) dir_ino) * 16777619u;
+    while(*name != '\0') {
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    }
+
+    return hash;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Frees an entry that is no longer in the cache or in use
+ * Param:   struct cache_entry * e -  The entry
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void cache_destroy(struct cache_entry * e) {
+
+    loop_buffer_free(e->buffer);
+    close(e->fd);
+    free(e->data);
+    free(e->name);
+    free(e);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Removes an entry from the cache.  Transfers still sending from it keep it
+ *      alive until they release it.
+ * Param:   struct cache_entry * e -  The entry
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void cache_unlink(struct cache_entry * e) {
+    struct cache_entry ** p;
+
+    for(p = &table[e->hash % CACHE_BUCKETS]; *p != e; p = &(*p)->hash_next);
+    *p = e->hash_next;
+
+    if(e->lru_prev != NULL) {
+        e->lru_prev->lru_next = e->lru_next;
+    }
+    else {
+        lru_head = e->lru_next;
+    }
+    if(e->lru_next != NULL) {
+        e->lru_next->lru_prev = e->lru_prev;
+    }
+    else {
+        lru_tail = e->lru_prev;
+    }
+
+    stats.entries--;
+    if(e->data != NULL) {
+        stats.bytes -= e->st.st_size;
+    }
+    e->linked = 0;
+    if(e->refs == 0) {
+        cache_destroy(e);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Makes an entry the most recently used one
+ * Param:   struct cache_entry * e -  The entry
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void cache_touch(struct cache_entry * e) {
+
+    if(e == lru_head) {
+        return;
+    }
+
+    //Take it out of the list (it is not the head, so it has a predecessor):
+    e->lru_prev->lru_next = e->lru_next;
+    if(e->lru_next != NULL) {
+        e->lru_next->lru_prev = e->lru_prev;
+    }
+    else {
+        lru_tail = e->lru_prev;
+    }
+
+    //And put it back at the front:
+    e->lru_prev = NULL;
+    e->lru_next = lru_head;
+    lru_head->lru_prev = e;
+    lru_head = e;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Looks up a file in the cache
+ * Param:   unsigned int hash -  Hash of the key (see cache_hash())
+ * Param:   dev_t dir_dev -  Device of the directory
+ * Param:   ino_t dir_ino -  Inode of the directory
+ * Param:   const char * name -  Name of the file, relative to the directory
+ * Return:  struct cache_entry * -  The entry, or NULL if the file is not cached
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static struct cache_entry * cache_find(unsigned int hash, dev_t dir_dev, ino_t dir_ino, const char * name) {
+    struct cache_entry * e;
+
+    for(e = table[hash % CACHE_BUCKETS]; e != NULL; e = e->hash_next) {
+        if(e->hash == hash && e->dir_ino == dir_ino && e->dir_dev == dir_dev && strcmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Checks that a cached file has not been replaced or modified.  The file is
+ *      only looked at again once the last check is CACHE_VALID_MS old.
+ * Param:   struct cache_entry * e -  The entry
+ * Param:   int dir_fd -  The directory the file was opened from
+ * Param:   long long now -  Current time (see cache_now_ms())
+ * Return:  int -  1 if the entry can still be used, 0 if it is stale
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static int cache_fresh(struct cache_entry * e, int dir_fd, long long now) {
+    struct stat st;
+
+    if(now - e->checked < CACHE_VALID_MS) {
+        return 1;
+    }
+    if(fstatat(dir_fd, e->name, &st, 0) == -1 || st.st_ino != e->st.st_ino || st.st_dev != e->st.st_dev ||
+        st.st_size != e->st.st_size || st.st_mtim.tv_sec != e->st.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != e->st.st_mtim.tv_nsec) {
+        return 0;
+    }
+
+    e->checked = now;
+    return 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Evicts the least recently used entries until there is room for another
+ * Param:   size_t bytes -  Memory the new entry will hold
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void cache_evict(size_t bytes) {
+
+    while(lru_tail != NULL && (stats.entries >= CACHE_MAX_ENTRIES || stats.bytes + bytes > CACHE_MAX_BYTES)) {
+        stats.evictions++;
+        cache_unlink(lru_tail);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Adds an open file to the cache, reading it into memory if it is small
+ * Param:   unsigned int hash -  Hash of the key (see cache_hash())
+ * Param:   dev_t dir_dev -  Device of the directory
+ * Param:   ino_t dir_ino -  Inode of the directory
+ * Param:   const char * name -  Name of the file, relative to the directory
+ * Param:   int fd -  The open file (owned by the entry on success)
+ * Param:   struct stat * st -  The file's status
+ * Param:   long long now -  Current time (see cache_now_ms())
+ * Return:  struct cache_entry * -  The new entry, or NULL if the file could not
+ *      be cached (it is left open either way)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static struct cache_entry * cache_insert(unsigned int hash, dev_t dir_dev, ino_t dir_ino, const char * name,
+    int fd, struct stat * st, long long now) {
+    struct cache_entry * e, ** bucket;
+    off_t done = 0;
+    ssize_t n;
+
+    if((e = calloc(1, sizeof(*e))) == NULL || (e->name = strdup(name)) == NULL) {
+        free(e);
+        return NULL;
+    }
+
+    //Keep small files in memory (a file that changes while it is being read
+    //is left uncached):
+    if(st->st_size <= CACHE_BUFFER_MAX) {
+        if((e->data = malloc(st->st_size > 0 ? st->st_size : 1)) == NULL) {
+            free(e->name);
+            free(e);
+            return NULL;
+        }
+        while(done < st->st_size && ((n = pread(fd, e->data + done, st->st_size - done, done)) > 0 ||
+            (n == -1 && errno == EINTR))) {
+            done += n > 0 ? n : 0;
+        }
+        if(done < st->st_size) {
+            free(e->data);
+            free(e->name);
+            free(e);
+            return NULL;
+        }
+    }
+
+    cache_evict(e->data != NULL ? st->st_size : 0);
+
+    e->dir_dev = dir_dev;
+    e->dir_ino = dir_ino;
+    e->hash = hash;
+    e->fd = fd;
+    e->st = *st;
+    e->buffer = e->data != NULL ? loop_buffer(e->data, st->st_size) : -1;
+    e->checked = now;
+    e->refs = 1;
+    e->linked = 1;
+
+    bucket = &table[hash % CACHE_BUCKETS];
+    e->hash_next = *bucket;
+    *bucket = e;
+
+    e->lru_next = lru_head;
+    if(lru_head != NULL) {
+        lru_head->lru_prev = e;
+    }
+    lru_head = e;
+    if(lru_tail == NULL) {
+        lru_tail = e;
+    }
+
+    stats.entries++;
+    if(e->data != NULL) {
+        stats.bytes += st->st_size;
+    }
+    return e;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Opens a file for sending, from the cache if it is there.  Regular files of
+ *      up to CACHE_FILE_MAX bytes are added to the cache when they are opened;
+ *      anything else is simply opened.  Pipes are opened without waiting for
+ *      a writer.
+ * Param:   int dir_fd -  The directory to open the file from
+ * Param:   dev_t dir_dev -  Device of that directory
+ * Param:   ino_t dir_ino -  Inode of that directory
+ * Param:   const char * name -  Name of the file, relative to the directory
+ * Param:   struct stat * st -  Filled in with the file's status
+ * Param:   struct cache_entry ** entry -  Set to the file's cache entry, which
+ *      owns the returned descriptor and must be given back with
+ *      cache_release(), or to NULL if the caller owns (and closes) it
+ * Return:  int -  Descriptor of the open file, or -1 on error (errno is set)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int cache_open(int dir_fd, dev_t dir_dev, ino_t dir_ino, const char * name, struct stat * st,
+    struct cache_entry ** entry) {
+    unsigned int hash = cache_hash(dir_dev, dir_ino, name);
+    long long now = cache_now_ms();
+    struct cache_entry * e;
+    int fd, error;
+
+    *entry = NULL;
+
+    //A hot file is served without touching the filesystem:
+    if((e = cache_find(hash, dir_dev, dir_ino, name)) != NULL) {
+        if(cache_fresh(e, dir_fd, now)) {
+            stats.hits++;
+            if(e->data != NULL) {
+                stats.bytes_saved += e->st.st_size;
+            }
+            cache_touch(e);
+            e->refs++;
+            *st = e->st;
+            *entry = e;
+            return e->fd;
+        }
+        stats.invalidations++;
+        cache_unlink(e);
+    }
+    stats.misses++;
+
+    if((fd = openat(dir_fd, name, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) == -1) {
+        return -1;
+    }
+    if(fcntl(fd, F_SETFL, 0) == -1 || fstat(fd, st) == -1) {
+        error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    if(S_ISREG(st->st_mode) && st->st_size <= CACHE_FILE_MAX) {
+        *entry = cache_insert(hash, dir_dev, dir_ino, name, fd, st, now);
+    }
+    return fd;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Gives back an entry returned by cache_open()
+ * Param:   struct cache_entry * e -  The entry
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void cache_release(struct cache_entry * e) {
+
+    if(--e->refs == 0 && !e->linked) {
+        cache_destroy(e);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the cache's counters
+ * Param:   struct cache_stats * out -  Filled in with the counters
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void cache_get_stats(struct cache_stats * out) {
+
+    *out = stats;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Describes the cache's counters in one line
+ * Param:   char * buf -  Buffer for the description
+ * Param:   size_t size -  Size of the buffer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void cache_summary(char * buf, size_t size) {
+
+    snprintf(buf, size, "%lld hits, %lld misses (%lld changed, %lld evicted), %lld bytes served from memory, "
+        "%zu files cached in %zu bytes", stats.hits, stats.misses, stats.invalidations, stats.evictions,
+        stats.bytes_saved, stats.entries, stats.bytes);
+}
@@ -0,0 +1,75 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftcache.h
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Header file for ftcache.c
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "ftloop.h"
+
+#ifndef FTCACHE_H
+#define FTCACHE_H
+
+//CONSTANTS:
+
+#define CACHE_BUCKETS 1024
+#define CACHE_MAX_ENTRIES 256
+#define CACHE_MAX_BYTES (64 * 1024 * 1024)
+#define CACHE_FILE_MAX (64 * 1024 * 1024)
+#define CACHE_BUFFER_MAX (1024 * 1024)
+#define CACHE_VALID_MS 1000
+
+
+//TYPES:
+
+//A cached file, open and (when small enough) read into memory.  Entries are
+//found by the directory they were opened from and the name they were opened
+//by, and are kept in least-recently-used order.  A copy in memory is
+//registered with the io_uring engine as buffer (-1 if it is not).
+struct cache_entry {
+    dev_t dir_dev;
+    ino_t dir_ino;
+    char * name;
+    unsigned int hash;
+    int fd;
+    char * data;
+    int buffer;
+    struct stat st;
+    long long checked;
+    int summed;
+    uint32_t sum;
+    int refs;
+    int linked;
+    struct cache_entry * hash_next;
+    struct cache_entry * lru_prev;
+    struct cache_entry * lru_next;
+};
+
+struct cache_stats {
+    long long hits;
+    long long misses;
+    long long invalidations;
+    long long evictions;
+    long long bytes_saved;
+    size_t entries;
+    size_t bytes;
+};
+
+
+//FUNCTION PROTOTYPES:
+
+int cache_open(int dir_fd, dev_t dir_dev, ino_t dir_ino, const char * name, struct stat * st, struct cache_entry ** entry);
+void cache_release(struct cache_entry * e);
+void cache_get_stats(struct cache_stats * out);
+void cache_summary(char * buf, size_t size);
+
+#endif
@@ -6,20 +6,114 @@
  *      Build with "make client" or simply "make".
  *      One command line argument is required: the hostname
  *      of the computer on which the server is running
- *      (ports are defined in ftutil.h).
+ *      (ports are defined in ftutil.h).  With "-p" the
+ *      client starts in passive mode and connects to the
+ *      server for data instead of listening on DATA_PORT.
+ *      With "-m" all transfers share one multiplexed data
+ *      connection, opened once at start-up.  With "-z"
+ *      transfers are compressed.  With "-d" very large
+ *      files are written with direct I/O, bypassing the
+ *      page cache.  Every transfer is followed by a line
+ *      of statistics, and large files show a progress
+ *      bar while they are sent.  With "-c <command>" (any
+ *      number of times) or "-b <script>" the client runs
+ *      the commands given instead of reading them from the
+ *      user, sending several ahead at a time, and exits
+ *      with a status that says whether they all succeeded.
+ *      "-o overwrite|skip|fail" says what to do with files
+ *      that are already there instead of asking.  With "-B"
+ *      the control connection switches to the binary
+ *      protocol (opcodes, length-prefixed arguments, and
+ *      replies framed with a status code).  Data
+ *      connections are tuned to the bandwidth-delay
+ *      product of the path (see fttune.c); "-r <rate>"
+ *      gives the path rate in bits/s (e.g. "-r 10G") instead
+ *      of measuring it.
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 #include "ftclient.h"
 
 //Static Variables:
 int control_fd;
+int passive_mode;
+int compress_mode;
+int direct_mode;
+int mux_fd = -1;
+struct ring ctrl_ring;
+struct xfer_stats stats;
+off_t progress_size;
+off_t progress_done;
+long long progress_ns;
+int progress_shown;
+int batch_mode;
+int exists_policy = -1;
+int stop_on_error;
+int request_failed;
+char ** batch_commands;
+int batch_count;
+int binary_mode;
+int binary_switch;
+struct ring reply_ring;
+size_t reply_left;
+int reply_ended;
+int reply_status;
+struct tuning tuning;
 
 int main(int argc, char * argv[]) {
     char request[BUF_SIZE];
+    int opt, mux = 0, binary = 0;
+    long long rate = 0;
 
-    //Ensure a hostname was specified:
-    if(argc != 2) {
-        printf("Usage:\n\t%s <server hostname>\n", argv[0]);
-        exit(EXIT_SUCCESS);
+    //Parse options:
+    while((opt = getopt(argc, argv, "pmzdBb:c:o:er:")) != -1) {
+        if(opt == 'p') {
+            passive_mode = 1;
+        }
+        else if(opt == 'm') {
+            mux = 1;
+        }
+        else if(opt == 'z') {
+            compress_mode = 1;
+        }
+        else if(opt == 'd') {
+            direct_mode = 1;
+        }
+        else if(opt == 'B') {
+            binary = 1;
+        }
+        else if(opt == 'b') {
+            read_batch_file(optarg);
+            batch_mode = 1;
+        }
+        else if(opt == 'c') {
+            add_batch_command(optarg);
+            batch_mode = 1;
+        }
+        else if(opt == 'o' && (strcmp(optarg, "overwrite") == 0 || strcmp(optarg, "skip") == 0 || strcmp(optarg, "fail") == 0)) {
+            exists_policy = strcmp(optarg, "overwrite") == 0 ? EXISTS_OVERWRITE : strcmp(optarg, "skip") == 0 ? EXISTS_SKIP : EXISTS_FAIL;
+        }
+        else if(opt == 'e') {
+            stop_on_error = 1;
+        }
+        else if(opt == 'r') {
+            if((rate = tune_parse_rate(optarg)) <= 0) {
+                argc = 0;
+            }
+        }
+        else {
+            argc = 0;
+        }
+    }
+
+    //Ensure a hostname was specified (scripts see a usage error as failing
+    //to start):
+    if(argc - optind != 1) {
+        printf("Usage:\n\t%s [-p] [-m] [-z] [-d] [-B] [-b <script>] [-c <command>]... [-o overwrite|skip|fail] [-e] [-r <rate>] <server hostname>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    //Without a user to ask, existing files are left alone and reported:
+    if(exists_policy == -1) {
+        exists_policy = batch_mode ? EXISTS_FAIL : EXISTS_ASK;
     }
 
     //Install signal handlers:
@@ -29,19 +123,73 @@ int main(int argc, char * argv[]) {
     control_fd = create_socket();
 
     //Open a control connection with host:
-    control_connect(control_fd, argv[1]);
+    control_connect(control_fd, argv[optind]);
+    tune_control(control_fd);
+    tune_measure(&tuning, control_fd, rate, TUNE_CONGESTION);
+    ring_init(&ctrl_ring, RING_SIZE, RING_SIZE);
+    ring_init(&reply_ring, RING_SIZE, REPLY_LIMIT);
 
-    do {
-        //Receive a message (often just the prompt):
+    //Ask for passive mode, compression and the binary protocol along with
+    //the greeting:
+    if(passive_mode) {
+        send_message(control_fd, "passive\n");
+    }
+    if(compress_mode) {
+        send_message(control_fd, "compress\n");
+    }
+    if(binary) {
+        send_message(control_fd, "binary\n");
+    }
+
+    //Receive the greeting (a batch has no use for it):
+    if(batch_mode) {
+        discard_message(control_fd);
+    }
+    else {
         receive_message(control_fd);
+    }
+    if(passive_mode) {
+        discard_message(control_fd);
+    }
+    if(compress_mode) {
+        discard_message(control_fd);
+    }
+    if(binary) {
+        binary_switch = 1;
+        discard_message(control_fd);
+    }
+
+    //Open the multiplexed data channel:
+    if(mux) {
+        make_request(control_fd, "mux\n");
+        discard_message(control_fd);
+    }
+
+    //Run a batch and say how it went:
+    if(batch_mode) {
+        opt = run_batch(control_fd);
+        close(control_fd);
+        return opt > 0 ? EXIT_COMMAND_FAILED : EXIT_SUCCESS;
+    }
 
+    while(1) {
         //Get user request/input:
         get_request(control_fd, request);
 
-        //Send the request to the server:
-        make_request(control_fd, request);
+        //Send the request to the server (if it can't be, no reply is coming):
+        if(make_request(control_fd, request) == -1) {
+            printf("%s", PROMPT);
+            fflush(stdout);
+            continue;
+        }
+
+        if(parse_command(request, NULL) == EXIT) {
+            break;
+        }
 
-    } while(parse_command(request, NULL) != EXIT);
+        //Receive a message (often just the prompt):
+        receive_message(control_fd);
+    }
 
     close(control_fd);
     printf("Connection closed\n");
@@ -89,253 +237,2412 @@ void control_connect(int ctrl_fd, char * host) {
  * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 void receive_message(int ctrl_fd) {
-    int i, num_read;
     char buffer[BUF_SIZE];
+    size_t hold = strlen(PROMPT) - 1, length;
+    ssize_t end, num_read;
+
+    //Binary replies are framed instead:
+    if(binary_mode) {
+        receive_reply(ctrl_fd, 1);
+        return;
+    }
+
+    //Read until a complete message (ending in the prompt) has arrived:
+    while((end = ring_find(&ctrl_ring, PROMPT)) == -1) {
 
-    for(i=0; i<BUF_SIZE-1; i++) {
+        //Display what has arrived, holding back what could be a partial prompt:
+        while(ring_used(&ctrl_ring) > hold) {
+            length = ring_used(&ctrl_ring) - hold;
+            length = ring_read(&ctrl_ring, buffer, length < BUF_SIZE ? length : BUF_SIZE);
+            fwrite(buffer, 1, length, stdout);
+            check_reply(buffer, length);
+        }
 
-        //Read in a character:
-        if((num_read = read(ctrl_fd, &buffer[i], 1)) == -1) {
+        //Read in as much as the server has sent:
+        if((num_read = ring_fill(&ctrl_ring, ctrl_fd)) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
             perror("Error reading from control socket");
             close(ctrl_fd);
             exit(EXIT_FAILURE);
         }
 
-        //No characters read in: socket has been closed by server
-        if(num_read == 0)
-            break;
-
-        //End of message:
-        if(strncmp(&buffer[i-(strlen(PROMPT)-1)], PROMPT, strlen(PROMPT)) == 0) {
-            buffer[i+1] = '\0';
-            break;
+        //No characters read in: socket has been closed by server,
+        //so display the rest and exit the program
+        if(num_read == 0) {
+            while((length = ring_read(&ctrl_ring, buffer, BUF_SIZE)) > 0) {
+                fwrite(buffer, 1, length, stdout);
+            }
+            fflush(stdout);
+            close(ctrl_fd);
+            exit(batch_mode ? EXIT_CONNECTION_LOST : EXIT_SUCCESS);
         }
     }
 
-    //Display the message:
-    printf("%s", buffer);
-
-    //If the connection was closed by
-    //the server, exit the program:
-    if(num_read == 0) {
-        close(ctrl_fd);
-        exit(EXIT_SUCCESS);
+    //Display the message (a batch shows each command in place of the prompt):
+    if(batch_mode) {
+        end -= strlen(PROMPT);
     }
+    while(end > 0) {
+        length = ring_read(&ctrl_ring, buffer, (size_t) end < BUF_SIZE ? (size_t) end : BUF_SIZE);
+        fwrite(buffer, 1, length, stdout);
+        check_reply(buffer, length);
+        end -= length;
+    }
+    if(batch_mode) {
+        ring_read(&ctrl_ring, buffer, strlen(PROMPT));
+    }
+    check_reply(NULL, 0);
+    fflush(stdout);
+    reply_done();
 }
 
-
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Sends a request to the server, and handles any client-side preparations
- *      (e.g. listening on a port for incoming data connections)
+ * Reads and drops a message (up to and including the prompt) from the server
  * Param:   int ctrl_fd -  File descriptor of the control connection
- * Param:   char * request -  The user's raw request
  * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-void make_request(int ctrl_fd, char * request) {
-    int data_fd, command;
-    char arg[BUF_SIZE];
+void discard_message(int ctrl_fd) {
+    char buffer[BUF_SIZE];
+    size_t hold = strlen(PROMPT) - 1, length;
+    ssize_t end, num_read;
+
+    if(binary_mode) {
+        receive_reply(ctrl_fd, 0);
+        return;
+    }
 
-    //Send the raw request to the server:
-    send_message(control_fd, request);
+    while((end = ring_find(&ctrl_ring, PROMPT)) == -1) {
 
-    //Parse the command:
-    command = parse_command(request, arg);
+        //Drop what has arrived, holding back what could be a partial prompt:
+        while(ring_used(&ctrl_ring) > hold) {
+            length = ring_used(&ctrl_ring) - hold;
+            ring_read(&ctrl_ring, buffer, length < BUF_SIZE ? length : BUF_SIZE);
+        }
 
-    //If it was a GET request, receive file:
-    if(command == GET) {
-        data_fd = open_data_connection(ctrl_fd);
-        receive_file(data_fd, arg);
-        close(data_fd);
+        if((num_read = ring_fill(&ctrl_ring, ctrl_fd)) <= 0) {
+            if(num_read == -1 && errno == EINTR) {
+                continue;
+            }
+            perror("Error reading from control socket");
+            close(ctrl_fd);
+            exit(batch_mode ? EXIT_CONNECTION_LOST : EXIT_FAILURE);
+        }
     }
 
-    //If it was a LIST request, receive directory listing:
-    else if(command == LIST) {
-        data_fd = open_data_connection(ctrl_fd);
-        receive_listing(data_fd);
-        close(data_fd);
+    while(end > 0) {
+        end -= ring_read(&ctrl_ring, buffer, (size_t) end < BUF_SIZE ? (size_t) end : BUF_SIZE);
     }
+    reply_done();
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads a binary reply: FRAME_DATA frames with its text, up to the FRAME_END
+ *      frame that carries its status code
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   int show -  Whether to display the reply (and count a failure)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void receive_reply(int ctrl_fd, int show) {
+    char buffer[BUF_SIZE];
+    size_t length;
+
+    while(1) {
+        while((length = ring_read(&reply_ring, buffer, BUF_SIZE)) > 0) {
+            if(show) {
+                fwrite(buffer, 1, length, stdout);
+            }
+        }
+        if(reply_ended) {
+            break;
+        }
+        reply_step(ctrl_fd);
+    }
+    reply_ended = 0;
+
+    //The status says how the command went, without reading its text:
+    if(show && reply_status != STATUS_OK) {
+        request_failed = 1;
+    }
+    if(show && !batch_mode) {
+        printf("%s", PROMPT);
+    }
+    fflush(stdout);
+    reply_done();
+}
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Reads user input into the response buffer
+ * Takes in more of a binary reply: moves the text of the frame being read
+ *      into reply_ring, or reads the next frame's header (noting the status
+ *      if it ends the reply), reading from the server when more is needed
  * Param:   int ctrl_fd -  File descriptor of the control connection
- * Param:   char * response -  The buffer to store the user input
  * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-void get_request(int ctrl_fd, char * response) {
-    
-    if(fgets(response, BUF_SIZE, stdin) == NULL) {
-        perror("Error reading user input");
-        close(ctrl_fd);
-        exit(EXIT_FAILURE);
+void reply_step(int ctrl_fd) {
+    char buffer[BUF_SIZE];
+    struct frame_header header;
+    size_t length;
+
+    if(reply_left > 0 && ring_used(&ctrl_ring) > 0) {
+        length = ring_read(&ctrl_ring, buffer, reply_left < BUF_SIZE ? reply_left : BUF_SIZE);
+        if(ring_write(&reply_ring, buffer, length) == -1) {
+            printf("Error: reply too long\n");
+            close(ctrl_fd);
+            exit(EXIT_FAILURE);
+        }
+        reply_left -= length;
+    }
+    else if(reply_left == 0 && ring_used(&ctrl_ring) >= FRAME_HEADER_SIZE) {
+        ring_read(&ctrl_ring, buffer, FRAME_HEADER_SIZE);
+        frame_unpack(buffer, &header);
+        if(header.type == FRAME_END) {
+            reply_ended = 1;
+            reply_status = header.status;
+        }
+        else {
+            reply_left = header.length;
+        }
+    }
+    else {
+        control_fill(ctrl_fd);
     }
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Finishes taking in a reply: a switch of protocols takes effect once the
+ *      reply to it (in the old one) is in
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void reply_done(void) {
+
+    if(binary_switch) {
+        binary_mode = !binary_mode;
+        binary_switch = 0;
+    }
+}
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Creates a passive socket and waits for the server to connect,
- *      thereby initiating the data connection
+ * Reads whatever the server has sent on the control connection, exiting if
+ *      it has closed it
  * Param:   int ctrl_fd -  File descriptor of the control connection
- * Return:  int -  File descriptor of the data connection
+ * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-int open_data_connection(int ctrl_fd) {
-    struct sockaddr_in ctrl_address, data_address;
-    int passive_fd, data_fd;
-    unsigned int length;
+void control_fill(int ctrl_fd) {
+    ssize_t num_read;
 
-    //Get peer's address from control socket:
-    length = sizeof(ctrl_address);
-    if(getpeername(ctrl_fd, (struct sockaddr *) &ctrl_address, &length) == -1) {
-        perror("Error getting peer's address");
+    while((num_read = ring_fill(&ctrl_ring, ctrl_fd)) == -1 && errno == EINTR);
+
+    if(num_read == -1) {
+        perror("Error reading from control socket");
         close(ctrl_fd);
         exit(EXIT_FAILURE);
     }
 
-    //Open a passive socket:
-    passive_fd = create_socket();
-    bind_socket(passive_fd, DATA_PORT);
-    listen_socket(passive_fd);
+    //Connection closed by server:
+    if(num_read == 0) {
+        printf("Connection closed by server\n");
+        close(ctrl_fd);
+        exit(batch_mode ? EXIT_CONNECTION_LOST : EXIT_SUCCESS);
+    }
+}
 
-    while(1) {
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads a single line from the server (e.g. a "PASV <port>" reply)
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   char * line -  Buffer to store the null-terminated line
+ * Param:   size_t size -  Size of the buffer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void receive_line(int ctrl_fd, char * line, size_t size) {
+    int length;
 
-        //Accept an incoming connection:
-        length = sizeof(data_address);
-        if((data_fd = accept(passive_fd, (struct sockaddr *) &data_address, &length)) == -1) {
-            perror("Error accepting incoming data connection");
-            close(ctrl_fd);
-            close(passive_fd);
-            exit(EXIT_FAILURE);
+    //In binary mode the lines come out of the reply's frames (an empty line
+    //is returned if the reply ends first):
+    if(binary_mode) {
+        while((length = ring_getline(&reply_ring, line, size)) == RING_NO_LINE && !reply_ended) {
+            reply_step(ctrl_fd);
         }
-
-        //Check that it's originating from the expected address:
-        if(ctrl_address.sin_addr.s_addr == data_address.sin_addr.s_addr) {
-            break;
+    }
+    else {
+        while((length = ring_getline(&ctrl_ring, line, size)) == RING_NO_LINE) {
+            control_fill(ctrl_fd);
         }
-        
-        //If not, close the unknown connection and try again:
-        close(data_fd);
     }
 
-    //Close the passive socket and
-    //return  the data connection socket:
-    close(passive_fd);
-    return data_fd;
+    if(length == RING_LONG_LINE || length == RING_NO_LINE) {
+        line[0] = '\0';
+    }
 }
 
-
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Reads and displays a directory listing from a data connection
- * Param:   int data_fd -  File descriptor of the data connection to read from
+ * Sends a command to the server, encoded for the binary protocol if the
+ *      session has switched to it (see request_encode())
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   char * request -  The command as typed
  * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-void receive_listing(int data_fd) {
-    char buffer[BUF_SIZE];
-    int num_read;
+void send_command(int ctrl_fd, char * request) {
+    char buffer[REQUEST_HEADER_SIZE + REQUEST_MAX];
+    size_t length;
+
+    if(!binary_mode) {
+        send_message(ctrl_fd, request);
+        return;
+    }
 
-    //Read and display data until the connection is closed:
-    while((num_read = read(data_fd, buffer, BUF_SIZE)) > 0) {
-        printf("%s", buffer);
+    //A command too long to encode is sent as an invalid one, so it is
+    //still answered:
+    if((length = request_encode(buffer, sizeof(buffer), request)) == 0) {
+        request_pack(buffer, REQUEST_INVALID, 0, 0);
+        length = REQUEST_HEADER_SIZE;
+    }
+    if(write_all(ctrl_fd, buffer, length) == -1) {
+        perror("Error writing message");
+        close(ctrl_fd);
+        exit(EXIT_FAILURE);
     }
 }
 
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Receives a file over a data connection, saving it in the client's current directory
- * Param:   int data_fd -  File descriptor of the data connection
- * Param:   char * filename -  Name of the file that is being received
- * Return:  void
+ * Sends a request to the server, and handles any client-side preparations
+ *      (e.g. listening on a port for incoming data connections) and the
+ *      data it brings
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   char * request -  The user's raw request
+ * Return:  int -  0 if the request was sent (so a reply is coming), or -1
+ *      if it failed before anything was sent
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-void receive_file(int data_fd, char * filename) {
-    int file_fd, num_read;
-    char buffer[FILE_BUF_SIZE];
+int make_request(int ctrl_fd, char * request) {
+    struct request r;
+    int sent;
 
-    //If data comes across the connection:
-    if((num_read=read(data_fd, buffer, FILE_BUF_SIZE)) > 0) {
+    if((sent = send_request(ctrl_fd, request, &r, -1)) == 0) {
+        finish_request(ctrl_fd, &r);
+    }
+    return sent == -1 ? -1 : 0;
+}
 
-        //Create a file:
-        if((file_fd = open(filename, O_CREAT | O_EXCL | O_WRONLY, 0660)) == -1) {
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Prepares a request and sends it to the server, leaving its data (if any)
+ *      to finish_request().  Uploads and striped gets are carried out in full.
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   char * request -  The user's raw request
+ * Param:   struct request * r -  Set to what finish_request() needs to know
+ * Param:   int listen_fd -  Passive socket the server's data connections
+ *      are accepted on (left open), or -1 to listen for this request alone
+ * Return:  int -  0 if the request was sent and must be finished, 1 if it
+ *      has been carried out (only the rest of its reply is left), or -1 if
+ *      it failed before anything was sent
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int send_request(int ctrl_fd, char * request, struct request * r, int listen_fd) {
+    struct stat st;
+    int count;
+    char * sigs = NULL;
 
-            //If file already exists, prompt for overwrite:
-            if(errno == EEXIST) {
+    //Parse the command:
+    memset(r, 0, sizeof(*r));
+    r->command = parse_command(request, r->arg);
+    r->offset = -1;
+    r->size = -1;
+    r->passive_fd = listen_fd;
+    r->shared_fd = listen_fd != -1;
 
-                //Overwrite: create new file
-                if(input_yn("File already exists. Overwrite? ")) {
-                    if((file_fd = open(filename, O_WRONLY, 0666)) == -1) {
-                        perror("Error creating file");
-                        close(data_fd);
-                        exit(EXIT_FAILURE);
-                    }
-                }
+    //Uploads send the file from here:
+    if(r->command == PUT) {
+        return put_file(ctrl_fd, r->arg) == -1 ? -1 : 1;
+    }
 
-                //Don't overwrite: close data connection and return
-                else {
-                    printf("File not received: %s\n", filename);
-                    close(data_fd);
-                    return;
-                }
-            }
-            
-            //Other error: exit program
-            else {
-                perror("Error creating file");
-                close(data_fd);
-                exit(EXIT_FAILURE);
-            }
-        }
+    //Striped gets use several data connections of their own:
+    if(r->command == GET && parse_stripes(request, &count, r->arg) == 1) {
+        get_striped(ctrl_fd, request, r->arg, count);
+        return 1;
+    }
 
-        //Write to the file:
-        do {
-            if(write(file_fd, buffer, num_read) == -1) {
-                perror("Error writing to file");
-                close(data_fd);
-                exit(EXIT_FAILURE);
-            }
-        } while((num_read = read(data_fd, buffer, FILE_BUF_SIZE)) > 0);
+    //Recursive gets are sent as a batch of files:
+    if(r->command == GET) {
+        r->recursive = parse_recursive(request, r->arg);
+    }
 
-        //Error reading from connection:
-        if(num_read == -1) {
-            perror("Error reading file from data connection");
-            close(data_fd);
-            exit(EXIT_FAILURE);
+    //Sync a local copy by sending the signatures of its blocks (with no local
+    //copy, the whole file is fetched):
+    if(r->command == SYNC && (sigs = sync_sign(r->arg, &r->y)) == NULL) {
+        snprintf(r->text, sizeof(r->text), "get %s\n", r->arg);
+        request = r->text;
+        r->command = GET;
+    }
+    else if(r->command == SYNC) {
+        snprintf(r->text, sizeof(r->text), "sync %s %zu %zu\n", r->arg, r->y.block, r->y.count);
+        request = r->text;
+    }
+
+    //Resume a partial download instead of starting over, if it matches the
+    //start of the server's copy (if not, all of it is fetched over it):
+    if(r->command == GET && r->recursive == 0 && (r->ranged = parse_range(request, &r->offset, &r->length)) == 0 &&
+        stat(r->arg, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (r->size = remote_size(ctrl_fd, r->arg)) > st.st_size) {
+        if(prefix_matches(ctrl_fd, r->arg, st.st_size)) {
+            printf("Resuming %s at byte %lld of %lld\n", r->arg, (long long) st.st_size, (long long) r->size);
+            r->offset = st.st_size;
+        }
+        else {
+            printf("Local copy of %s does not match the server's, getting all of it\n", r->arg);
+            r->offset = 0;
         }
-        printf("File received: %s\n", filename);
+        snprintf(r->text, sizeof(r->text), "get %s %lld\n", r->arg, (long long) r->offset);
+        request = r->text;
+        r->ranged = 1;
+    }
+    if(r->ranged != 1) {
+        r->offset = -1;
     }
 
-    //Error reading from connection:
-    if(num_read == -1) {
-        perror("Error reading file from data connection");
-        close(data_fd);
-        exit(EXIT_FAILURE);
+    //Transfers need a data connection, unless they are streams on the channel:
+    r->connect = (mux_fd == -1 && (r->command == GET || r->command == SYNC || r->command == MGET ||
+        r->command == LIST || r->command == MUX));
+
+    //Listen for the data connection before the server tries to open it:
+    if(!passive_mode && r->connect && listen_fd == -1) {
+        r->passive_fd = listen_data_port();
+    }
+
+    //Send the raw request to the server (and a sync's signatures after it):
+    if(r->command == LIST) {
+        snprintf(r->text, sizeof(r->text), "%s", request);
+    }
+    xfer_stats_start(&stats);
+    send_command(ctrl_fd, request);
+    if(sigs != NULL) {
+        if(write_all(ctrl_fd, sigs, r->y.count * DELTA_SIG_SIZE) == -1) {
+            perror("Error writing to socket");
+            close(ctrl_fd);
+            exit(EXIT_FAILURE);
+        }
+        free(sigs);
     }
+    return 0;
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * A signal handler for sigint and sigterm signals.  Cleans up and says goodbye.
- * Param:   int sig -  The signal received
+ * Takes in the data a request that has been sent brings: opens its data
+ *      connection (or finds its stream), receives the file, batch or listing
+ *      and checks it against the server's checksum.  Client-side modes
+ *      change here too, as the server has changed them by now.
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   struct request * r -  The request, from send_request()
  * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-void signal_handler(int sig) {
-    printf("\nClosing connection to server...\n");
-    send_message(control_fd, "exit\n");
+void finish_request(int ctrl_fd, struct request * r) {
+    struct data_stream data;
+    int data_fd = -1, format, received = -1;
+    char summary[BUF_SIZE];
+    off_t cursor;
+    uint32_t sum = 0;
+    long limit;
 
-    close(control_fd);
-    printf("Connection closed\n");
-    exit(EXIT_SUCCESS);
-}
+    //Open the data connection (or find out which stream the data arrives on):
+    if(r->connect) {
+        if(passive_mode) {
+            data_fd = connect_data_port(ctrl_fd);
+        }
+        else if(r->shared_fd) {
+            data_fd = accept_data_connection(ctrl_fd, r->passive_fd);
+        }
+        else {
+            data_fd = open_data_connection(ctrl_fd, r->passive_fd);
+        }
+        if(data_fd == -1) {
+            return;
+        }
+        stream_open(&data, data_fd, 0);
+    }
+    else if(r->command == GET || r->command == SYNC || r->command == MGET || r->command == LIST) {
+        if(open_stream(ctrl_fd, &data) == -1) {
+            return;
+        }
+    }
+
+    //A recursive GET arrives as a batch (only the summary is shown):
+    if(r->command == GET && r->recursive == 1) {
+        receive_batch(&data, 0);
+    }
 
+    //If it was a GET request, receive file (or write the range into it):
+    else if(r->command == GET) {
+        r->size = receive_size(ctrl_fd);
+        progress_start(r->size);
+        received = receive_file(&data, r->arg, r->offset, r->size, &sum);
+    }
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Installs the signal handlers for the sigint and sigterm signals
- * Param:   void
- * Return:  void
- * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-void install_signal_handlers(void) {
-    struct sigaction sig;
+    //If it was a SYNC request, put the new copy together next to the old one:
+    else if(r->command == SYNC) {
+        r->size = receive_size(ctrl_fd);
+        progress_start(r->size);
+        received = r->size >= 0 ? receive_delta(&data, r->arg, &r->y, r->size, &sum) : -1;
+    }
 
-    sig.sa_handler = signal_handler;
-    sigemptyset(&sig.sa_mask);
-    sig.sa_flags = 0;
+    //If it was an MGET request, receive every file in the batch:
+    else if(r->command == MGET) {
+        receive_batch(&data, 1);
+    }
 
-    sigaction(SIGINT, &sig, NULL);
-    sigaction(SIGTERM, &sig, NULL);
+    //If it was a LIST request, receive directory listing (and, for a page of
+    //it, where the next page starts):
+    else if(r->command == LIST) {
+        receive_listing(&data);
+        if(parse_list(r->text, &format, &limit, &cursor) == 0 && limit > 0) {
+            receive_cursor(ctrl_fd);
+        }
+    }
+
+    //If it was a MUX request, keep (or drop) the channel (which only exists
+    //if the server opened a data connection for it):
+    else if(r->command == MUX) {
+        if(mux_fd != -1) {
+            close(mux_fd);
+            mux_fd = -1;
+        }
+        else if(data_fd != -1) {
+            mux_fd = data_fd;
+        }
+        return;
+    }
+
+    //If it was a PASSIVE request, the server has switched modes too:
+    else if(r->command == PASSIVE) {
+        passive_mode = !passive_mode;
+        return;
+    }
+
+    //Likewise for a COMPRESS request:
+    else if(r->command == COMPRESS) {
+        compress_mode = !compress_mode;
+        return;
+    }
+
+    //A BINARY request switches protocols once its reply is in:
+    else if(r->command == BINARY) {
+        binary_switch = 1;
+        return;
+    }
+
+    //A STATS request shows how this end is tuned, ahead of the server's:
+    else if(r->command == STATS) {
+        tune_summary(&tuning, summary, sizeof(summary));
+        printf("Client tuning: %s\n", summary);
+        return;
+    }
+    else {
+        return;
+    }
+
+    //Show what compression saved:
+    if(data.codec.raw_bytes > 0) {
+        codec_summary(&data.codec, summary, sizeof(summary));
+        printf("Compressed transfer: %s\n", summary);
+    }
+    codec_free(&data.codec);
+
+    //Streams end at their END frame; connections are closed:
+    if(data.stream != 0) {
+        stream_drain(&data);
+    }
+    else {
+        close(data.fd);
+    }
+
+    //Show how the transfer went (listings speak for themselves, and a file
+    //that was not received has nothing to show):
+    if(r->command != LIST && (received == 0 || r->command == MGET || r->recursive == 1)) {
+        show_stats();
+    }
+
+    //A file of known size is followed by its checksum (a copy that does not
+    //match it is moved aside):
+    if(r->command == GET && r->recursive == 0 && r->size >= 0) {
+        if(verify_sum(ctrl_fd, r->arg, received == 0 ? &sum : NULL) == -1 && received == 0) {
+            set_aside(r->arg);
+        }
+    }
+    else if(r->command == SYNC && r->size >= 0) {
+        finish_sync(ctrl_fd, r->arg, &r->y, r->size, received == 0 ? &sum : NULL);
+    }
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Adds a command to the batch to be run
+ * Param:   const char * command -  The command, with or without its newline
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void add_batch_command(const char * command) {
+    size_t length = strlen(command);
+    char ** grown;
+
+    //Requests are single lines no longer than the server takes:
+    if(length > 0 && command[length - 1] == '\n') {
+        length--;
+    }
+    if(length == 0 || length >= BUF_SIZE - 1 || memchr(command, '\n', length) != NULL) {
+        printf("Invalid batch command: %.*s\n", (int) length, command);
+        exit(EXIT_FAILURE);
+    }
+
+    if((grown = realloc(batch_commands, (batch_count + 1) * sizeof(*grown))) == NULL ||
+        (grown[batch_count] = malloc(length + 2)) == NULL) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+    batch_commands = grown;
+    memcpy(batch_commands[batch_count], command, length);
+    batch_commands[batch_count][length] = '\n';
+    batch_commands[batch_count][length + 1] = '\0';
+    batch_count++;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Adds the commands of a script to the batch: one per line, skipping blank
+ *      lines and lines that start with '#'
+ * Param:   const char * path -  The script, or "-" for standard input
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void read_batch_file(const char * path) {
+    char line[BATCH_LINE_SIZE];
+    FILE * script;
+    size_t start;
+
+    if(strcmp(path, "-") == 0) {
+        script = stdin;
+    }
+    else if((script = fopen(path, "r")) == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    while(fgets(line, sizeof(line), script) != NULL) {
+        if(strchr(line, '\n') == NULL && !feof(script)) {
+            printf("Invalid batch command (too long): %.40s...\n", line);
+            exit(EXIT_FAILURE);
+        }
+        start = strspn(line, " \t\r\n");
+        if(line[start] != '\0' && line[start] != '#') {
+            line[strcspn(line, "\r\n")] = '\0';
+            add_batch_command(line + start);
+        }
+    }
+    if(ferror(script)) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if(script != stdin) {
+        fclose(script);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Runs the batch.  Commands that can be are sent ahead in windows of up to
+ *      BATCH_WINDOW without waiting for each reply (the server takes them
+ *      in order), and their data and replies are then taken in one after
+ *      another.  A cd ends its window, so no command is sent before the
+ *      directory it runs in is known to be right.
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Return:  int -  Number of commands that failed
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int run_batch(int ctrl_fd) {
+    struct request * window;
+    int i = 0, j, n, listen_fd, failures = 0;
+
+    if((window = malloc(BATCH_WINDOW * sizeof(*window))) == NULL) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+
+    while(i < batch_count && (failures == 0 || !stop_on_error)) {
+        if(parse_command(batch_commands[i], NULL) == EXIT) {
+            break;
+        }
+
+        //Find the run of commands that can be sent ahead:
+        n = 0;
+        while(i + n < batch_count && n < BATCH_WINDOW && can_pipeline(batch_commands[i + n])) {
+            if(parse_command(batch_commands[i + n++], NULL) == CD) {
+                break;
+            }
+        }
+
+        //Anything else is run on its own:
+        if(n <= 1) {
+            request_failed = 0;
+            printf("%s %s", PROMPT, batch_commands[i]);
+            if(make_request(ctrl_fd, batch_commands[i]) == -1) {
+                request_failed = 1;
+            }
+            else {
+                receive_message(ctrl_fd);
+            }
+            failures += request_failed;
+            i++;
+            continue;
+        }
+
+        //Send the whole window, with one passive socket for its data connections:
+        listen_fd = !passive_mode && mux_fd == -1 ? listen_data_port() : -1;
+        for(j=0; j<n; j++) {
+            send_request(ctrl_fd, batch_commands[i + j], &window[j], listen_fd);
+        }
+
+        //Then take in each one's data and reply in turn (timing each from
+        //when it is taken in, as that is when the server gets to it):
+        for(j=0; j<n; j++) {
+            request_failed = 0;
+            printf("%s %s", PROMPT, batch_commands[i + j]);
+            xfer_stats_start(&stats);
+            finish_request(ctrl_fd, &window[j]);
+            receive_message(ctrl_fd);
+            failures += request_failed;
+        }
+        if(listen_fd != -1) {
+            close(listen_fd);
+        }
+        i += n;
+    }
+
+    //Say goodbye:
+    send_command(ctrl_fd, "exit\n");
+    free(window);
+    return failures;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Checks whether a command can be sent before the replies to the commands
+ *      ahead of it have arrived: it must not change the client's modes, ask
+ *      the server anything first, use data connections of its own or need
+ *      an answer from the user
+ * Param:   char * request -  The command
+ * Return:  int -  1 if it can be, 0 if not
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int can_pipeline(char * request) {
+    char arg[BUF_SIZE];
+    struct stat st;
+    off_t offset, length;
+    int count;
+
+    switch(parse_command(request, arg)) {
+        case LIST:
+        case CD:
+        case PWD:
+        case SIZE:
+        case SUM:
+        case MGET:
+        case STATS:
+            return 1;
+
+        //A file that is already here is resumed (which asks the server its
+        //size first) or may need to be confirmed:
+        case GET:
+            if(parse_stripes(request, &count, arg) == 1) {
+                return 0;
+            }
+            if(parse_recursive(request, arg) == 1) {
+                return 1;
+            }
+            return parse_range(request, &offset, &length) == 1 || stat(arg, &st) == -1;
+        default:
+            return 0;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Decides whether a file that is already there is overwritten, following
+ *      the policy given on the command line (or asking the user)
+ * Param:   char * filename -  The file
+ * Return:  int -  1 to overwrite it, 0 to leave it alone
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int confirm_overwrite(char * filename) {
+    if(exists_policy == EXISTS_ASK) {
+        return input_yn("File already exists. Overwrite? ");
+    }
+    if(exists_policy == EXISTS_FAIL) {
+        printf("Error: file already exists: %s\n", filename);
+        request_failed = 1;
+    }
+    return exists_policy == EXISTS_OVERWRITE;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Watches the server's replies as they are displayed, and notes the request
+ *      as failed if a line starts with "Error" or "Invalid"
+ * Param:   const char * text -  Part of a reply, or NULL at its end
+ * Param:   size_t length -  Length of text
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void check_reply(const char * text, size_t length) {
+    static char start[8];
+    static size_t column;
+    size_t i;
+
+    if(text == NULL) {
+        column = 0;
+        return;
+    }
+    for(i=0; i<length; i++) {
+        if(text[i] == '\n') {
+            start[column < sizeof(start) ? column : sizeof(start) - 1] = '\0';
+            if(strncmp(start, "Error", 5) == 0 || strncmp(start, "Invalid", 7) == 0) {
+                request_failed = 1;
+            }
+            column = 0;
+        }
+        else {
+            if(column < sizeof(start) - 1) {
+                start[column] = text[i];
+            }
+            column++;
+        }
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads user input into the response buffer
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   char * response -  The buffer to store the user input
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void get_request(int ctrl_fd, char * response) {
+    
+    if(fgets(response, BUF_SIZE, stdin) == NULL) {
+        perror("Error reading user input");
+        close(ctrl_fd);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Creates a passive socket on the data port for the server to connect to
+ * Param:   void
+ * Return:  int -  File descriptor of the passive socket
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int listen_data_port(void) {
+    int passive_fd;
+
+    //Connections accepted inherit the tuning:
+    passive_fd = create_socket();
+    tune_apply(&tuning, passive_fd);
+    bind_socket(passive_fd, DATA_PORT);
+    listen_socket(passive_fd);
+
+    return passive_fd;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Waits on a passive socket for the server to connect,
+ *      thereby initiating the data connection
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   int passive_fd -  Passive socket from listen_data_port()
+ * Return:  int -  File descriptor of the data connection
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int open_data_connection(int ctrl_fd, int passive_fd) {
+    int data_fd;
+
+    //Close the passive socket and
+    //return  the data connection socket:
+    data_fd = accept_data_connection(ctrl_fd, passive_fd);
+    close(passive_fd);
+    return data_fd;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Accepts the server's next data connection on a passive socket, ignoring
+ *      connections from any other address
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   int passive_fd -  Passive socket from listen_data_port() (left open)
+ * Return:  int -  File descriptor of the data connection
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int accept_data_connection(int ctrl_fd, int passive_fd) {
+    struct sockaddr_in ctrl_address, data_address;
+    int data_fd;
+    unsigned int length;
+
+    //Get peer's address from control socket:
+    length = sizeof(ctrl_address);
+    if(getpeername(ctrl_fd, (struct sockaddr *) &ctrl_address, &length) == -1) {
+        perror("Error getting peer's address");
+        close(ctrl_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    while(1) {
+
+        //Accept an incoming connection:
+        length = sizeof(data_address);
+        if((data_fd = accept(passive_fd, (struct sockaddr *) &data_address, &length)) == -1) {
+            perror("Error accepting incoming data connection");
+            close(ctrl_fd);
+            close(passive_fd);
+            exit(EXIT_FAILURE);
+        }
+
+        //Check that it's originating from the expected address:
+        if(ctrl_address.sin_addr.s_addr == data_address.sin_addr.s_addr) {
+            return data_fd;
+        }
+        
+        //If not, close the unknown connection and try again:
+        close(data_fd);
+    }
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Passive mode: reads the port the server is listening on from the control
+ *      connection, and connects to it, thereby initiating the data connection
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Return:  int -  File descriptor of the data connection, or -1 if the server
+ *      did not open a data port (its reply has been displayed)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int connect_data_port(int ctrl_fd) {
+    struct sockaddr_in address;
+    char line[BUF_SIZE];
+    unsigned int port, length;
+    int data_fd;
+
+    //Get the port from the server's reply:
+    receive_line(ctrl_fd, line, BUF_SIZE);
+    if(sscanf(line, "PASV %u", &port) != 1) {
+        printf("%s\n", line);
+        request_failed = 1;
+        return -1;
+    }
+
+    //Connect to that port on the server's address:
+    length = sizeof(address);
+    if(getpeername(ctrl_fd, (struct sockaddr *) &address, &length) == -1) {
+        perror("Error getting peer's address");
+        close(ctrl_fd);
+        exit(EXIT_FAILURE);
+    }
+    address.sin_port = htons(port);
+
+    data_fd = create_socket();
+    tune_apply(&tuning, data_fd);
+    if(connect(data_fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        perror("Error opening data connection");
+        close(ctrl_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    return data_fd;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Asks the server for the size of a file
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   char * filename -  Name of the file on the server
+ * Return:  off_t -  The file's size, or -1 if the server could not tell
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+off_t remote_size(int ctrl_fd, char * filename) {
+    char line[BUF_SIZE];
+    long long size;
+
+    snprintf(line, BUF_SIZE, "size %s\n", filename);
+    send_command(ctrl_fd, line);
+
+    receive_line(ctrl_fd, line, BUF_SIZE);
+    discard_message(ctrl_fd);
+
+    if(sscanf(line, "SIZE %lld", &size) != 1) {
+        return -1;
+    }
+    return size;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Checks that the start of a local file is the same as the start of the
+ *      server's copy, by comparing their CRC32C checksums
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   char * filename -  Name of the file, here and on the server
+ * Param:   off_t length -  Number of bytes to compare
+ * Return:  int -  1 if they match, 0 if not (or either could not be read)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int prefix_matches(int ctrl_fd, char * filename, off_t length) {
+    char line[BUF_SIZE];
+    unsigned int expected;
+    uint32_t sum = 0;
+    off_t summed = -1;
+    int file_fd;
+
+    if((file_fd = open(filename, O_RDONLY)) != -1) {
+        summed = sum_file(file_fd, 0, length, &sum);
+        close(file_fd);
+    }
+
+    snprintf(line, BUF_SIZE, "sum %s 0 %lld\n", filename, (long long) length);
+    send_command(ctrl_fd, line);
+
+    receive_line(ctrl_fd, line, BUF_SIZE);
+    discard_message(ctrl_fd);
+
+    return summed == length && sscanf(line, "CRC32C %x", &expected) == 1 && expected == sum;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads how many bytes of a file the server is about to send ("SIZE <n>").
+ *      Anything else it says instead (e.g. that the file could not be
+ *      opened) is displayed.
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Return:  off_t -  Number of bytes coming, or -1 if not known
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+off_t receive_size(int ctrl_fd) {
+    char line[BUF_SIZE];
+    long long size;
+
+    receive_line(ctrl_fd, line, BUF_SIZE);
+    if(sscanf(line, "SIZE %lld", &size) != 1) {
+        printf("%s\n", line);
+        request_failed = 1;
+        return -1;
+    }
+    return size;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the checksum the server sends after a file ("CRC32C <sum>", or
+ *      "CRC32C -" if it could not send all of it), and checks what was
+ *      received against it
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   char * filename -  Name of the file
+ * Param:   uint32_t * sum -  Checksum of what was received, or NULL if the
+ *      file was not received in full (the server's is still read)
+ * Return:  int -  0 if the checksums match, -1 if not (or either is missing;
+ *      a file received in full without a checksum to match has failed)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int verify_sum(int ctrl_fd, char * filename, uint32_t * sum) {
+    char line[BUF_SIZE];
+    unsigned int expected;
+
+    receive_line(ctrl_fd, line, BUF_SIZE);
+    if(sum == NULL) {
+        return -1;
+    }
+    if(sscanf(line, "CRC32C %x", &expected) != 1) {
+        request_failed = 1;
+        if(strncmp(line, "CRC32C", 6) != 0) {
+            printf("%s\n", line);
+        }
+        printf("Error: no checksum for %s\n", filename);
+        return -1;
+    }
+    if(expected != *sum) {
+        request_failed = 1;
+        printf("Checksum mismatch: %s (server %08x, received %08x)\n", filename, expected, (unsigned int) *sum);
+        return -1;
+    }
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Moves a file that failed its checksum out of the way, to
+ *      "<filename>.corrupt" (or removes it if it cannot be moved), so
+ *      nothing mistakes it for a good copy
+ * Param:   char * filename -  Name of the file
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void set_aside(char * filename) {
+    char path[PATH_MAX];
+
+    if(snprintf(path, sizeof(path), "%s.corrupt", filename) >= (int) sizeof(path) || rename(filename, path) == -1) {
+        unlink(filename);
+        printf("Removed: %s\n", filename);
+        return;
+    }
+    printf("Moved aside: %s\n", path);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Multiplexed mode: reads which stream the server will send on ("STREAM <id>")
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   struct data_stream * data -  The stream to set up
+ * Return:  int -  0 on success, or -1 if the server did not start a stream
+ *      (its reply has been displayed)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int open_stream(int ctrl_fd, struct data_stream * data) {
+    char line[BUF_SIZE];
+    unsigned int stream;
+
+    receive_line(ctrl_fd, line, BUF_SIZE);
+    if(sscanf(line, "STREAM %u", &stream) != 1 || stream == 0) {
+        printf("%s\n", line);
+        request_failed = 1;
+        return -1;
+    }
+
+    stream_open(data, mux_fd, stream);
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Prepares to read a transfer from a data connection or multiplexed channel
+ * Param:   struct data_stream * data -  The stream to set up
+ * Param:   int fd -  The data connection or channel
+ * Param:   unsigned int stream -  Stream id, or 0 for a plain data connection
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void stream_open(struct data_stream * data, int fd, unsigned int stream) {
+
+    data->fd = fd;
+    data->stream = stream;
+    data->frame_left = 0;
+    data->ended = 0;
+    data->status = FRAME_OK;
+    data->block_len = 0;
+    data->block_off = 0;
+    codec_init(&data->codec, compress_mode);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the next part of a transfer, decompressing it if compression is on
+ * Param:   struct data_stream * data -  The stream
+ * Param:   void * buffer -  Buffer to read into
+ * Param:   size_t size -  Size of the buffer
+ * Return:  ssize_t -  Bytes read, 0 at the end of the transfer, or -1 on error
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+ssize_t stream_read(struct data_stream * data, void * buffer, size_t size) {
+    ssize_t num_read;
+
+    if(!data->codec.enabled) {
+        return stream_read_wire(data, buffer, size);
+    }
+
+    //Decode the next block once this one has been read:
+    if(data->block_off == data->block_len && (num_read = stream_read_block(data)) <= 0) {
+        return num_read;
+    }
+
+    if(size > data->block_len - data->block_off) {
+        size = data->block_len - data->block_off;
+    }
+    memcpy(buffer, data->block + data->block_off, size);
+    data->block_off += size;
+    return size;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads and decodes the next block of a compressed transfer
+ * Param:   struct data_stream * data -  The stream
+ * Return:  ssize_t -  Length of the decoded block, 0 at the end of the
+ *      transfer, or -1 on error
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+ssize_t stream_read_block(struct data_stream * data) {
+    char header[BLOCK_HEADER_SIZE], packed[BLOCK_MAX];
+    uint32_t wire_length, raw_length;
+    ssize_t num_read;
+    char * body;
+
+    if((num_read = stream_fill(data, header, BLOCK_HEADER_SIZE)) <= 0) {
+        return num_read;
+    }
+    block_unpack(header, &wire_length, &raw_length);
+
+    //Stored blocks are read straight into place:
+    body = wire_length == raw_length ? data->block : packed;
+    if(num_read != BLOCK_HEADER_SIZE || raw_length == 0 || raw_length > BLOCK_MAX || wire_length > raw_length ||
+        (num_read = stream_fill(data, body, wire_length)) != wire_length ||
+        block_decode(&data->codec, data->block, raw_length, body, wire_length) == -1) {
+        if(num_read != -1) {
+            errno = EPROTO;
+        }
+        return -1;
+    }
+
+    data->block_len = raw_length;
+    data->block_off = 0;
+    return raw_length;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads exactly the given number of bytes from a transfer as sent (unless it
+ *      ends first), without decompressing them
+ * Param:   struct data_stream * data -  The stream
+ * Param:   void * buffer -  Buffer to read into
+ * Param:   size_t size -  Number of bytes to read
+ * Return:  ssize_t -  Bytes read (less than size only at the end of the
+ *      transfer), or -1 on error
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+ssize_t stream_fill(struct data_stream * data, void * buffer, size_t size) {
+    size_t total = 0;
+    ssize_t num_read;
+
+    while(total < size) {
+        if((num_read = stream_read_wire(data, (char *) buffer + total, size - total)) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if(num_read == 0) {
+            break;
+        }
+        total += num_read;
+    }
+
+    return total;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the next part of a transfer as sent.  A plain data connection ends
+ *      when the server closes it; a stream ends at its END frame.
+ * Param:   struct data_stream * data -  The stream
+ * Param:   void * buffer -  Buffer to read into
+ * Param:   size_t size -  Size of the buffer
+ * Return:  ssize_t -  Bytes read, 0 at the end of the transfer, or -1 on error
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+ssize_t stream_read_wire(struct data_stream * data, void * buffer, size_t size) {
+    struct frame_header header;
+    char raw[FRAME_HEADER_SIZE];
+    ssize_t num_read;
+
+    if(data->stream == 0) {
+        xfer_stats_count(&stats, num_read = read(data->fd, buffer, size));
+        return num_read;
+    }
+
+    //Move on to the next frame once this one has been read:
+    while(data->frame_left == 0) {
+        if(data->ended) {
+            return 0;
+        }
+        xfer_stats_count(&stats, num_read = read_all(data->fd, raw, FRAME_HEADER_SIZE));
+        if(num_read != FRAME_HEADER_SIZE) {
+            if(num_read != -1) {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        frame_unpack(raw, &header);
+        if(header.stream != data->stream || header.length > FRAME_MAX) {
+            errno = EPROTO;
+            return -1;
+        }
+        if(header.type == FRAME_END) {
+            data->ended = 1;
+            data->status = header.status;
+        }
+        data->frame_left = header.length;
+    }
+
+    if(size > data->frame_left) {
+        size = data->frame_left;
+    }
+    xfer_stats_count(&stats, num_read = read(data->fd, buffer, size));
+    if(num_read == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if(num_read > 0) {
+        data->frame_left -= num_read;
+    }
+    return num_read;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads exactly the given number of bytes from a transfer (unless it ends first)
+ * Param:   struct data_stream * data -  The stream
+ * Param:   void * buffer -  Buffer to read into
+ * Param:   size_t size -  Number of bytes to read
+ * Return:  ssize_t -  Bytes read (less than size only at the end of the
+ *      transfer), or -1 on error
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+ssize_t stream_read_all(struct data_stream * data, void * buffer, size_t size) {
+    size_t total = 0;
+    ssize_t num_read;
+
+    while(total < size) {
+        if((num_read = stream_read(data, (char *) buffer + total, size - total)) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if(num_read == 0) {
+            break;
+        }
+        total += num_read;
+    }
+
+    return total;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads and drops whatever is left of a stream (e.g. a file the user chose
+ *      not to overwrite), so the channel is ready for the next one
+ * Param:   struct data_stream * data -  The stream
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void stream_drain(struct data_stream * data) {
+    char buffer[FILE_BUF_SIZE];
+    ssize_t num_read;
+
+    while((num_read = stream_read_wire(data, buffer, FILE_BUF_SIZE)) != 0) {
+        if(num_read == -1 && errno != EINTR) {
+            perror("Error reading from data channel");
+            close(control_fd);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads and displays a directory listing from a data connection
+ * Param:   struct data_stream * data -  The data connection to read from
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void receive_listing(struct data_stream * data) {
+    char buffer[FILE_BUF_SIZE];
+    ssize_t num_read;
+
+    //Read and display data until the transfer ends:
+    while((num_read = stream_read(data, buffer, FILE_BUF_SIZE)) != 0) {
+        if(num_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if(num_read == -1) {
+            perror("Error reading listing from data connection");
+            close(data->fd);
+            exit(EXIT_FAILURE);
+        }
+        fwrite(buffer, 1, num_read, stdout);
+    }
+    fflush(stdout);
+
+    //The server could not read all of the directory:
+    if(data->status != FRAME_OK) {
+        printf("Listing incomplete\n");
+        request_failed = 1;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the reply that ends a page of a listing ("CURSOR <c>") and shows how
+ *      to get the next page, if there is one
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void receive_cursor(int ctrl_fd) {
+    char line[BUF_SIZE];
+    long long cursor;
+
+    receive_line(ctrl_fd, line, BUF_SIZE);
+
+    //Anything else is an error message:
+    if(sscanf(line, "CURSOR %lld", &cursor) != 1) {
+        printf("%s\n", line);
+        request_failed = 1;
+    }
+    else if(cursor > 0) {
+        printf("More entries follow: add --cursor %lld for the next page\n", cursor);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Receives a file over a data connection, saving it in the client's current directory
+ * Param:   struct data_stream * data -  The data connection (or stream) to read from
+ * Param:   char * filename -  Name of the file that is being received
+ * Param:   off_t offset -  Where the received range starts in the file, or -1
+ *      for a whole file (which prompts before overwriting an existing one)
+ * Param:   off_t size -  Number of bytes the server is sending, or -1 if not known
+ * Param:   uint32_t * sum -  Set to the CRC32C checksum of the bytes received
+ * Return:  int -  0 if all of it was received, -1 if not
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int receive_file(struct data_stream * data, char * filename, off_t offset, off_t size, uint32_t * sum) {
+    int file_fd;
+    ssize_t num_read;
+    char * buffer = receive_buffer();
+    off_t start = offset == -1 ? 0 : offset, position;
+
+    //If data comes across the connection:
+    if((num_read=stream_read(data, buffer, RECEIVE_BUF_SIZE)) > 0) {
+
+        //A range is written into the file as it is:
+        if(offset != -1) {
+            if((file_fd = open(filename, O_CREAT | O_RDWR, 0660)) == -1) {
+                perror("Error opening file");
+                close(data->fd);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        //Create a file:
+        else if((file_fd = open(filename, O_CREAT | O_EXCL | O_RDWR, 0660)) == -1) {
+
+            //If file already exists, prompt for overwrite:
+            if(errno == EEXIST) {
+
+                //Overwrite: create new file
+                if(confirm_overwrite(filename)) {
+                    if((file_fd = open(filename, O_RDWR | O_TRUNC, 0666)) == -1) {
+                        perror("Error creating file");
+                        close(data->fd);
+                        exit(EXIT_FAILURE);
+                    }
+                }
+
+                //Don't overwrite: the rest of the data is dropped
+                else {
+                    printf("File not received: %s\n", filename);
+                    return -1;
+                }
+            }
+            
+            //Other error: exit program
+            else {
+                perror("Error creating file");
+                close(data->fd);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        //Reserve the space up front so a large file is not fragmented (the
+        //file's size is left alone, so an interrupted download can be resumed)
+        //and a full disk is found out before any of it is written:
+        if(size > 0 && fallocate(file_fd, FALLOC_FL_KEEP_SIZE, start, size) == -1 && (errno == ENOSPC || errno == EFBIG)) {
+            printf("Error: not enough space for %s\n", filename);
+            request_failed = 1;
+            close(file_fd);
+            if(offset == -1) {
+                unlink(filename);
+            }
+            return -1;
+        }
+
+        //Error reading from connection (what has arrived is kept, so the
+        //download can be resumed):
+        *sum = 0;
+        position = receive_body(data, file_fd, buffer, num_read, start, size, sum);
+        progress_end();
+        if(position == -1) {
+            perror("Error reading file from data connection");
+            close(data->fd);
+            exit(EXIT_FAILURE);
+        }
+        close(file_fd);
+
+        //The server could not send all of it (e.g. the file shrank):
+        if(data->status != FRAME_OK || (size >= 0 && position - start != size)) {
+            printf("File incomplete: %s\n", filename);
+            request_failed = 1;
+            return -1;
+        }
+        if(offset > 0) {
+            printf("File received: %s (bytes %lld-%lld)\n", filename, (long long) offset, (long long) position - 1);
+        }
+        else {
+            printf("File received: %s\n", filename);
+        }
+        return 0;
+    }
+
+    //Error reading from connection:
+    if(num_read == -1) {
+        perror("Error reading file from data connection");
+        close(data->fd);
+        exit(EXIT_FAILURE);
+    }
+
+    return -1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Returns the buffer files are received into: RECEIVE_BUF_SIZE bytes, aligned
+ *      for direct I/O
+ * Param:   void
+ * Return:  char * -  The buffer
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+char * receive_buffer(void) {
+    static void * buffer;
+
+    if(buffer == NULL && (errno = posix_memalign(&buffer, DIRECT_ALIGN, RECEIVE_BUF_SIZE)) != 0) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+
+    return buffer;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Writes the rest of a file into place as it arrives.  Plain connections are
+ *      spliced from the socket to the file; anything else is gathered into
+ *      RECEIVE_BUF_SIZE writes.  With "-d", files of at least DIRECT_MIN_SIZE
+ *      bytes are written with O_DIRECT so they don't push everything else out
+ *      of the page cache.
+ * Param:   struct data_stream * data -  The data connection (or stream) to read from
+ * Param:   int file_fd -  The file
+ * Param:   char * buffer -  The receive buffer (see receive_buffer())
+ * Param:   size_t filled -  Bytes of the file already in the buffer
+ * Param:   off_t position -  Where the buffered bytes go in the file
+ * Param:   off_t size -  Number of bytes the server is sending, or -1 if not known
+ * Param:   uint32_t * sum -  CRC32C checksum of the bytes written, updated in place
+ * Return:  off_t -  Position after the last byte written, or -1 if reading
+ *      from the connection failed (errno is set)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+off_t receive_body(struct data_stream * data, int file_fd, char * buffer, size_t filled, off_t position, off_t size, uint32_t * sum) {
+    ssize_t num_read = 1;
+    int flags = 0, direct = 0, spliced;
+
+    //Direct I/O needs aligned offsets (so only whole files and aligned resumes):
+    if(direct_mode && size >= DIRECT_MIN_SIZE && position % DIRECT_ALIGN == 0 &&
+        (flags = fcntl(file_fd, F_GETFL)) != -1 && fcntl(file_fd, F_SETFL, flags | O_DIRECT) == 0) {
+        direct = 1;
+    }
+
+    //A plain connection goes from the socket to the file without a copy:
+    if(!direct && data->stream == 0 && !data->codec.enabled) {
+        *sum = sum_crc32c(*sum, buffer, filled);
+        if(pwrite_all(file_fd, buffer, filled, position) == -1) {
+            perror("Error writing to file");
+            close(data->fd);
+            exit(EXIT_FAILURE);
+        }
+        show_progress(filled);
+        position += filled;
+        filled = 0;
+        if((spliced = receive_splice(data->fd, file_fd, &position, sum)) != 1) {
+            return spliced == 0 ? position : -1;
+        }
+    }
+
+    while(num_read > 0) {
+
+        //Gather a full buffer before writing it:
+        while(filled < RECEIVE_BUF_SIZE && (num_read = stream_read(data, buffer + filled, RECEIVE_BUF_SIZE - filled)) != 0) {
+            if(num_read == -1 && errno != EINTR) {
+                return -1;
+            }
+            filled += num_read > 0 ? num_read : 0;
+        }
+
+        //Direct writes must be whole blocks: the end of the file goes through the page cache
+        if(direct && filled % DIRECT_ALIGN != 0) {
+            fcntl(file_fd, F_SETFL, flags);
+            direct = 0;
+        }
+
+        *sum = sum_crc32c(*sum, buffer, filled);
+        if(pwrite_all(file_fd, buffer, filled, position) == -1) {
+            perror("Error writing to file");
+            close(data->fd);
+            exit(EXIT_FAILURE);
+        }
+        show_progress(filled);
+        position += filled;
+        filled = 0;
+    }
+
+    return position;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Moves the rest of a plain data connection into a file through a pipe,
+ *      without copying it through user space (the checksum is taken from the
+ *      page cache as each part lands)
+ * Param:   int socket_fd -  The data connection
+ * Param:   int file_fd -  The file
+ * Param:   off_t * position -  Where the data goes in the file (advanced as it is written)
+ * Param:   uint32_t * sum -  CRC32C checksum of the bytes written, updated in place
+ * Return:  int -  0 once the connection has closed, -1 if reading from it
+ *      failed (errno is set), or 1 if splicing is not supported here and
+ *      nothing has been read
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int receive_splice(int socket_fd, int file_fd, off_t * position, uint32_t * sum) {
+    int pipe_fd[2], result = 0;
+    ssize_t num_read, written;
+    off_t start = *position;
+
+    if(pipe2(pipe_fd, O_CLOEXEC) == -1) {
+        return 1;
+    }
+    fcntl(pipe_fd[1], F_SETPIPE_SZ, RECEIVE_BUF_SIZE);
+
+    while(1) {
+        num_read = splice(socket_fd, NULL, pipe_fd[1], NULL, RECEIVE_BUF_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        xfer_stats_count(&stats, num_read);
+        if(num_read == 0) {
+            break;
+        }
+        if(num_read == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            result = errno == EINVAL && *position == start ? 1 : -1;
+            break;
+        }
+
+        //Empty the pipe into place:
+        while(num_read > 0) {
+            if((written = splice(pipe_fd[0], NULL, file_fd, position, num_read, SPLICE_F_MOVE)) == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                perror("Error writing to file");
+                close(socket_fd);
+                exit(EXIT_FAILURE);
+            }
+            num_read -= written;
+            sum_file(file_fd, *position - written, written, sum);
+            show_progress(written);
+        }
+    }
+
+    num_read = errno;
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    errno = num_read;
+    return result;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Signs each whole block of the local copy of a file for a sync: its rolling
+ *      checksum and its 64-bit hash (see sig_pack()).  Blocks are about the
+ *      square root of the file's size, as in rsync, so large files need few
+ *      signatures and small changes still cost little.
+ * Param:   char * filename -  Name of the file
+ * Param:   struct sync * y -  Set to the block size and number of blocks
+ * Return:  char * -  The signatures (to be freed), or NULL if there is no
+ *      local copy that can be synced (the reason has been displayed)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+char * sync_sign(char * filename, struct sync * y) {
+    char * buffer = receive_buffer(), * sigs;
+    struct stat st;
+    size_t chunk, i = 0, j;
+    ssize_t num_read;
+    int file_fd;
+
+    if((file_fd = open(filename, O_RDONLY)) == -1 || fstat(file_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        if(file_fd != -1) {
+            close(file_fd);
+        }
+        printf("No local copy of %s to sync: getting all of it\n", filename);
+        return NULL;
+    }
+
+    for(y->block = SYNC_BLOCK_MIN; y->block < SYNC_BLOCK_MAX && ((off_t) y->block * y->block < st.st_size ||
+        st.st_size / y->block > SYNC_MAX_BLOCKS); y->block *= 2);
+    y->count = st.st_size / y->block;
+    if(y->count > SYNC_MAX_BLOCKS) {
+        close(file_fd);
+        printf("%s is too large to sync: getting all of it\n", filename);
+        return NULL;
+    }
+
+    if((sigs = malloc(y->count * DELTA_SIG_SIZE + 1)) == NULL) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+
+    //Read as many whole blocks as fit in the buffer at a time:
+    chunk = RECEIVE_BUF_SIZE / y->block * y->block;
+    while(i < y->count) {
+        if((num_read = pread(file_fd, buffer, (y->count - i) * y->block < chunk ? (y->count - i) * y->block : chunk,
+            (off_t) i * y->block)) == -1 && errno == EINTR) {
+            continue;
+        }
+
+        //The file shrank: sign what there is
+        if(num_read <= 0) {
+            y->count = i;
+            break;
+        }
+        for(j=0; j + y->block <= (size_t) num_read; j += y->block, i++) {
+            sig_pack(sigs + i * DELTA_SIG_SIZE, delta_weak(buffer + j, y->block), sum_xxh64(buffer + j, y->block));
+        }
+    }
+    close(file_fd);
+
+    y->sent = y->count * DELTA_SIG_SIZE;
+    y->received = 0;
+    y->literal = 0;
+    y->reused = 0;
+    return sigs;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Puts the new copy of a synced file together from the server's delta: its
+ *      literal data, and runs of blocks copied from the local copy.  The new
+ *      copy is written next to the old one (as "<filename>.sync"), which is
+ *      left alone until the new one has been checked (see finish_sync()).
+ * Param:   struct data_stream * data -  The data connection (or stream) to read from
+ * Param:   char * filename -  Name of the local copy
+ * Param:   struct sync * y -  The sync (what was signed, and counts of what arrived)
+ * Param:   off_t size -  Size of the new copy
+ * Param:   uint32_t * sum -  Set to the CRC32C checksum of the new copy
+ * Return:  int -  0 if the whole delta was received, -1 if not
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int receive_delta(struct data_stream * data, char * filename, struct sync * y, off_t size, uint32_t * sum) {
+    char header[DELTA_HEADER_SIZE], * buffer = receive_buffer();
+    struct stat st;
+    uint32_t type, count;
+    off_t value, position = 0, length;
+    ssize_t num_read;
+    int old_fd, file_fd, result = -1;
+
+    snprintf(y->path, sizeof(y->path), "%s.sync", filename);
+    if((old_fd = open(filename, O_RDONLY)) == -1 || fstat(old_fd, &st) == -1 ||
+        (file_fd = open(y->path, O_CREAT | O_TRUNC | O_RDWR, 0600)) == -1) {
+        perror("Error opening file");
+        close(data->fd);
+        exit(EXIT_FAILURE);
+    }
+    if(size > 0 && fallocate(file_fd, FALLOC_FL_KEEP_SIZE, 0, size) == -1 && (errno == ENOSPC || errno == EFBIG)) {
+        printf("Error: not enough space for %s\n", y->path);
+        request_failed = 1;
+        close(file_fd);
+        close(old_fd);
+        return -1;
+    }
+    *sum = 0;
+
+    while(result == -1 && stream_read_all(data, header, DELTA_HEADER_SIZE) == DELTA_HEADER_SIZE) {
+        delta_unpack(header, &type, &count, &value);
+        y->received += DELTA_HEADER_SIZE;
+
+        //Data the local copy doesn't have:
+        if(type == DELTA_DATA && value >= 0) {
+            for(; value > 0; value -= num_read) {
+                length = value < RECEIVE_BUF_SIZE ? value : RECEIVE_BUF_SIZE;
+                if((num_read = stream_read_all(data, buffer, length)) != length) {
+                    break;
+                }
+                *sum = sum_crc32c(*sum, buffer, num_read);
+                if(pwrite_all(file_fd, buffer, num_read, position) == -1) {
+                    perror("Error writing to file");
+                    close(data->fd);
+                    exit(EXIT_FAILURE);
+                }
+                show_progress(num_read);
+                position += num_read;
+                y->received += num_read;
+                y->literal += num_read;
+            }
+            if(value > 0) {
+                break;
+            }
+        }
+
+        //A run of blocks the local copy already has (the checksum is taken
+        //from what lands in the new copy):
+        else if(type == DELTA_COPY && value >= 0 && (size_t) value + count <= y->count) {
+            length = (off_t) count * y->block;
+            if(copy_range(old_fd, value * y->block, file_fd, position, length) != length) {
+                perror("Error copying from the local copy");
+                break;
+            }
+            sum_file(file_fd, position, length, sum);
+            show_progress(length);
+            position += length;
+            y->reused += length;
+        }
+
+        //The end, and the size the new copy should be:
+        else if(type == DELTA_END && value == position) {
+            result = 0;
+        }
+        else {
+            break;
+        }
+    }
+
+    //The new copy gets the old one's permissions:
+    progress_end();
+    fchmod(file_fd, st.st_mode & 07777);
+    close(file_fd);
+    close(old_fd);
+
+    if(data->status != FRAME_OK) {
+        result = -1;
+    }
+    return result;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Checks the new copy of a synced file against the server's checksum and,
+ *      if it matches, puts it in place of the old one and shows how much the
+ *      sync saved over getting the whole file
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   char * filename -  Name of the file
+ * Param:   struct sync * y -  The sync
+ * Param:   off_t size -  Size of the new copy
+ * Param:   uint32_t * sum -  Checksum of the new copy, or NULL if the delta
+ *      was not received in full
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void finish_sync(int ctrl_fd, char * filename, struct sync * y, off_t size, uint32_t * sum) {
+    off_t sent = y->sent + y->received;
+
+    if(verify_sum(ctrl_fd, filename, sum) == -1) {
+        unlink(y->path);
+        printf("File not synced: %s (the local copy is unchanged)\n", filename);
+        request_failed = 1;
+        return;
+    }
+    if(rename(y->path, filename) == -1) {
+        perror("Error replacing file");
+        unlink(y->path);
+        return;
+    }
+
+    printf("File synced: %s (%lld bytes received, %lld bytes reused, %lld bytes of signatures sent)\n",
+           filename, (long long) y->received, (long long) y->reused, (long long) y->sent);
+    if(size > 0) {
+        printf("Sync sent %lld bytes in all, %.1f%% of the %lld a get would have sent\n",
+               (long long) sent, 100.0 * sent / size, (long long) size);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Receives a batch of files (mget, or a directory tree from "get -r"),
+ *      saving each under the client's current directory.  Files that already
+ *      exist are skipped (existing directories are merged into), as are
+ *      paths that would leave the current directory.  Each file is checked
+ *      against the checksum the server sends after it.
+ * Param:   struct data_stream * data -  The data connection (or stream) to read from
+ * Param:   int verbose -  Whether to show each file as it is received
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void receive_batch(struct data_stream * data, int verbose) {
+    char header[BATCH_HEADER_SIZE], name[PATH_MAX], buffer[BATCH_BUF_SIZE];
+    struct pending_mode * modes = NULL, * grown;
+    struct stat st;
+    uint32_t name_length, mode, sum, expected;
+    off_t size, left, bytes = 0;
+    ssize_t num_read;
+    size_t count = 0, capacity = 0;
+    int file_fd, files = 0, directories = 0, skipped = 0, corrupt = 0;
+
+    while(1) {
+
+        //Each file starts with a header and its name (an empty name ends the batch):
+        if(stream_read_all(data, header, BATCH_HEADER_SIZE) != BATCH_HEADER_SIZE) {
+            printf("Error: batch ended early\n");
+            request_failed = 1;
+            break;
+        }
+        batch_unpack(header, &name_length, &mode, &size);
+        if(name_length == 0) {
+            break;
+        }
+        if(name_length >= PATH_MAX || size < 0 || stream_read_all(data, name, name_length) != name_length) {
+            printf("Error: invalid batch header\n");
+            request_failed = 1;
+            break;
+        }
+        name[name_length] = '\0';
+
+        //Only relative paths below the current directory are accepted:
+        file_fd = -1;
+        if(strlen(name) != name_length || !safe_path(name)) {
+            printf("Skipped (unsafe name): %s\n", name);
+            skipped++;
+        }
+
+        //Directories are created writable, and given their own mode once
+        //everything in them has arrived:
+        else if(S_ISDIR(mode)) {
+            if(mkdir(name, (mode & 0777) | S_IRWXU) == 0) {
+                directories++;
+                if((mode & S_IRWXU) != S_IRWXU && count == capacity) {
+                    capacity = capacity ? capacity * 2 : 16;
+                    if((grown = realloc(modes, capacity * sizeof(*grown))) != NULL) {
+                        modes = grown;
+                    }
+                }
+                if((mode & S_IRWXU) != S_IRWXU && count < capacity && (modes[count].path = strdup(name)) != NULL) {
+                    modes[count++].mode = mode & 0777;
+                }
+            }
+            else if(errno != EEXIST || stat(name, &st) == -1 || !S_ISDIR(st.st_mode)) {
+                perror(name);
+                skipped++;
+            }
+        }
+        else if((file_fd = open(name, O_CREAT | O_EXCL | O_WRONLY, mode & 0777)) == -1 &&
+            (errno != EEXIST || exists_policy != EXISTS_OVERWRITE || (file_fd = open(name, O_WRONLY | O_TRUNC)) == -1)) {
+            if(errno == EEXIST) {
+                printf("Skipped (already exists): %s\n", name);
+                request_failed |= exists_policy == EXISTS_FAIL;
+            }
+            else {
+                perror(name);
+            }
+            skipped++;
+        }
+
+        //Reserve the space for large files up front (the body of one that
+        //does not fit is read past):
+        else if(size >= RECEIVE_BUF_SIZE && fallocate(file_fd, 0, 0, size) == -1 && (errno == ENOSPC || errno == EFBIG)) {
+            printf("Error: not enough space for %s\n", name);
+            request_failed = 1;
+            close(file_fd);
+            unlink(name);
+            file_fd = -1;
+            skipped++;
+        }
+
+        //Copy the body (or read past it), checksumming it:
+        sum = 0;
+        for(left = size; left > 0; left -= num_read) {
+            num_read = stream_read(data, buffer, left < BATCH_BUF_SIZE ? left : BATCH_BUF_SIZE);
+            if(num_read == -1 && errno == EINTR) {
+                num_read = 0;
+                continue;
+            }
+            if(num_read <= 0) {
+                perror("Error reading file from data connection");
+                close(data->fd);
+                exit(EXIT_FAILURE);
+            }
+            if(file_fd != -1 && write_all(file_fd, buffer, num_read) == -1) {
+                perror("Error writing to file");
+                close(data->fd);
+                exit(EXIT_FAILURE);
+            }
+            sum = sum_crc32c(sum, buffer, num_read);
+        }
+
+        //A file's body is followed by the server's checksum of it:
+        if(S_ISREG(mode)) {
+            if(stream_read_all(data, &expected, BATCH_SUM_SIZE) != BATCH_SUM_SIZE) {
+                printf("Error: batch ended early\n");
+                request_failed = 1;
+                if(file_fd != -1) {
+                    close(file_fd);
+                }
+                break;
+            }
+            if(file_fd != -1 && ntohl(expected) != sum) {
+                printf("Checksum mismatch: %s (server %08x, received %08x)\n", name, ntohl(expected), sum);
+                request_failed = 1;
+                close(file_fd);
+                set_aside(name);
+                file_fd = -1;
+                corrupt++;
+            }
+        }
+
+        if(file_fd != -1) {
+            close(file_fd);
+            if(verbose) {
+                printf("File received: %s\n", name);
+            }
+            files++;
+            bytes += size;
+        }
+    }
+
+    //Deepest directories first, so none is locked before its subdirectories:
+    while(count > 0) {
+        count--;
+        chmod(modes[count].path, modes[count].mode);
+        free(modes[count].path);
+    }
+    free(modes);
+
+    if(directories > 0) {
+        printf("Received %d files (%lld bytes) in %d new directories, skipped %d\n", files, (long long) bytes, directories, skipped);
+    }
+    else {
+        printf("Received %d files (%lld bytes), skipped %d\n", files, (long long) bytes, skipped);
+    }
+    if(corrupt > 0) {
+        printf("%d files did not match their checksums\n", corrupt);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Gets a file over several data connections at once ("get -j <n> <filename>")
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   char * request -  The user's raw request
+ * Param:   char * filename -  Name of the file
+ * Param:   int count -  Number of data connections asked for
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void get_striped(int ctrl_fd, char * request, char * filename, int count) {
+    int fds[MAX_STRIPES];
+    char line[BUF_SIZE];
+    long long size;
+    uint32_t sum;
+    int i, complete, passive_fd = -1;
+
+    //Listen for the data connections before the server tries to open them:
+    if(!passive_mode && mux_fd == -1) {
+        passive_fd = listen_data_port();
+    }
+
+    xfer_stats_start(&stats);
+    send_command(ctrl_fd, request);
+
+    //The server confirms the number of stripes and the file's size:
+    receive_line(ctrl_fd, line, BUF_SIZE);
+    if(sscanf(line, "STRIPES %d %lld", &count, &size) != 2 || count < 1 || count > MAX_STRIPES) {
+        printf("%s\n", line);
+        request_failed = 1;
+        if(passive_fd != -1) {
+            close(passive_fd);
+        }
+        return;
+    }
+
+    //Open every data connection:
+    for(i=0; i<count; i++) {
+        if(passive_mode) {
+            if((fds[i] = connect_data_port(ctrl_fd)) == -1) {
+                while(i-- > 0) {
+                    close(fds[i]);
+                }
+                return;
+            }
+        }
+        else if((fds[i] = accept_stripe_connection(ctrl_fd, passive_fd)) == -1) {
+            while(i-- > 0) {
+                close(fds[i]);
+            }
+            close(passive_fd);
+            return;
+        }
+    }
+    if(passive_fd != -1) {
+        close(passive_fd);
+    }
+
+    progress_start(size);
+    complete = receive_stripes(fds, count, filename, size, &sum);
+
+    for(i=0; i<count; i++) {
+        close(fds[i]);
+    }
+    show_stats();
+
+    //Once the stripes are put back together, the whole file is checked:
+    if(verify_sum(ctrl_fd, filename, complete == 0 ? &sum : NULL) == -1 && complete == 0) {
+        set_aside(filename);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Accepts the server's next stripe connection, unless it replies on the
+ *      control connection instead (it could not open them all)
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   int passive_fd -  Passive socket from listen_data_port() (left open)
+ * Return:  int -  File descriptor of the data connection, or -1 if the server
+ *      gave up on the get (its reply has been displayed)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int accept_stripe_connection(int ctrl_fd, int passive_fd) {
+    struct pollfd pfds[2];
+    char line[BUF_SIZE];
+    int buffered;
+
+    pfds[0].fd = passive_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = ctrl_fd;
+    pfds[1].events = POLLIN;
+
+    //Connections already made are taken before any reply (the server only
+    //ends a reply that went well once every stripe has been sent).  A reply
+    //may have been read in along with the announcement of the stripes.
+    buffered = ring_used(&ctrl_ring) > 0 || (binary_mode && (ring_used(&reply_ring) > 0 || reply_ended));
+    while(poll(pfds, buffered ? 1 : 2, buffered ? 0 : -1) == -1) {
+        if(errno != EINTR) {
+            perror("Error waiting for data connection");
+            close(ctrl_fd);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(pfds[0].revents & POLLIN) {
+        return accept_data_connection(ctrl_fd, passive_fd);
+    }
+
+    receive_line(ctrl_fd, line, BUF_SIZE);
+    printf("%s\n", line);
+    request_failed = 1;
+    return -1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Uploads a file ("put <filename>"), under its name without any directory.
+ *      The server is told the file's size and CRC32C checksum along with the
+ *      command, replies "UPLOAD <size>" and opens a data connection, and the
+ *      file is sent over it with sendfile().  The server replies once it has
+ *      stored the file (or why it didn't).
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Param:   char * filename -  Name of the local file
+ * Return:  int -  0 if the request was sent, or -1 if the file could not be
+ *      read (nothing was sent)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int put_file(int ctrl_fd, char * filename) {
+    struct xfer x;
+    struct stat st;
+    char request[2 * BUF_SIZE], line[BUF_SIZE], * name;
+    uint32_t sum = 0;
+    long long size;
+    ssize_t n;
+    int file_fd, data_fd, passive_fd = -1;
+
+    if((file_fd = open(filename, O_RDONLY)) == -1 || fstat(file_fd, &st) == -1) {
+        perror("Error opening file");
+        if(file_fd != -1) {
+            close(file_fd);
+        }
+        return -1;
+    }
+    if(!S_ISREG(st.st_mode)) {
+        printf("Error: only regular files can be uploaded\n");
+        close(file_fd);
+        return -1;
+    }
+
+    //The server checks what it receives against this before keeping it:
+    if(sum_file(file_fd, 0, st.st_size, &sum) != st.st_size) {
+        perror("Error reading file");
+        close(file_fd);
+        return -1;
+    }
+    name = strrchr(filename, '/') != NULL ? strrchr(filename, '/') + 1 : filename;
+
+    //Listen for the data connection before the server tries to open it:
+    if(!passive_mode && mux_fd == -1) {
+        passive_fd = listen_data_port();
+    }
+
+    snprintf(request, sizeof(request), "put %s %lld %08x\n", name, (long long) st.st_size, (unsigned int) sum);
+    xfer_stats_start(&stats);
+    send_command(ctrl_fd, request);
+
+    //The server is ready for the file (or says why not):
+    receive_line(ctrl_fd, line, BUF_SIZE);
+    if(sscanf(line, "UPLOAD %lld", &size) != 1) {
+        printf("%s\n", line);
+        request_failed = 1;
+        if(passive_fd != -1) {
+            close(passive_fd);
+        }
+        close(file_fd);
+        return 0;
+    }
+
+    if(passive_mode) {
+        data_fd = connect_data_port(ctrl_fd);
+    }
+    else {
+        data_fd = open_data_connection(ctrl_fd, passive_fd);
+    }
+    if(data_fd == -1) {
+        close(file_fd);
+        return 0;
+    }
+
+    //Send it straight from the page cache in full segments; closing the
+    //connection ends it (and sends what the cork held back):
+    tune_cork(data_fd, 1);
+    progress_start(st.st_size);
+    xfer_init(&x, data_fd, file_fd, 0, st.st_size);
+    while(!xfer_done(&x)) {
+        xfer_stats_count(&stats, n = xfer_step(&x));
+        if(n == -1 && errno != EINTR) {
+            perror("Error sending file");
+            break;
+        }
+        show_progress(n > 0 ? n : 0);
+    }
+    progress_end();
+    xfer_close(&x);
+    close(data_fd);
+    close(file_fd);
+
+    //The server has it once it says so:
+    receive_line(ctrl_fd, line, BUF_SIZE);
+    printf("%s\n", line);
+    if(strncmp(line, "File stored", 11) != 0) {
+        request_failed = 1;
+    }
+    show_stats();
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Receives the stripes of a file from their data connections in parallel,
+ *      writing each into place in a preallocated file
+ * Param:   int * fds -  The data connections
+ * Param:   int count -  Number of data connections
+ * Param:   char * filename -  Name of the file that is being received
+ * Param:   off_t size -  Size of the whole file
+ * Param:   uint32_t * sum -  Set to the checksum of the whole file, put
+ *      together from those of its stripes
+ * Return:  int -  0 if the whole file was received, or -1 if not
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int receive_stripes(int * fds, int count, char * filename, off_t size, uint32_t * sum) {
+    struct pollfd pfds[MAX_STRIPES];
+    struct stripe stripes[MAX_STRIPES];
+    struct stripe * order[MAX_STRIPES];
+    struct stripe * st;
+    char * buffer;
+    off_t total, received = 0;
+    ssize_t num_read;
+    int i, j, file_fd, open_count = count, complete = 1;
+
+    //Create the file (prompting before overwriting):
+    if((file_fd = open(filename, O_CREAT | O_EXCL | O_WRONLY, 0660)) == -1) {
+        if(errno != EEXIST) {
+            perror("Error creating file");
+            exit(EXIT_FAILURE);
+        }
+        if(!confirm_overwrite(filename)) {
+            printf("File not received: %s\n", filename);
+            return -1;
+        }
+        if((file_fd = open(filename, O_WRONLY | O_TRUNC, 0666)) == -1) {
+            perror("Error creating file");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    //Reserve the space up front so the stripes can land in any order:
+    if(size > 0 && fallocate(file_fd, 0, 0, size) == -1 && (errno == ENOSPC || errno == EFBIG)) {
+        printf("Error: not enough space for %s\n", filename);
+        request_failed = 1;
+        close(file_fd);
+        unlink(filename);
+        return -1;
+    }
+    if(size > 0 && ftruncate(file_fd, size) == -1) {
+        perror("Error allocating file");
+        exit(EXIT_FAILURE);
+    }
+
+    if((buffer = malloc(STRIPE_BUF_SIZE)) == NULL) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(stripes, 0, sizeof(stripes));
+    for(i=0; i<count; i++) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+    }
+
+    //Read from whichever connections have data until all have closed:
+    while(open_count > 0) {
+        if(poll(pfds, count, -1) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for data");
+            exit(EXIT_FAILURE);
+        }
+
+        for(i=0; i<count; i++) {
+            if(pfds[i].fd == -1 || pfds[i].revents == 0) {
+                continue;
+            }
+            st = &stripes[i];
+
+            //Each connection starts with the range it carries:
+            if(st->header_len < STRIPE_HEADER_SIZE) {
+                num_read = read(pfds[i].fd, st->header + st->header_len, STRIPE_HEADER_SIZE - st->header_len);
+                xfer_stats_count(&stats, num_read);
+                if(num_read > 0 && (st->header_len += num_read) == STRIPE_HEADER_SIZE) {
+                    stripe_unpack(st->header, &total, &st->offset, &st->length);
+                    if(total != size || st->offset < 0 || st->length < 0 || st->offset + st->length > size) {
+                        printf("Error: invalid stripe header\n");
+                        num_read = 0;
+                        complete = 0;
+                    }
+                }
+            }
+
+            //Then the data, which is written straight into place:
+            else {
+                num_read = read(pfds[i].fd, buffer, STRIPE_BUF_SIZE);
+                xfer_stats_count(&stats, num_read);
+                if(num_read > 0) {
+                    if(st->received + num_read > st->length) {
+                        printf("Error: stripe longer than announced\n");
+                        num_read = 0;
+                        complete = 0;
+                    }
+                    else if(pwrite(file_fd, buffer, num_read, st->offset + st->received) != num_read) {
+                        perror("Error writing to file");
+                        exit(EXIT_FAILURE);
+                    }
+                    else {
+                        st->sum = sum_crc32c(st->sum, buffer, num_read);
+                        st->received += num_read;
+                        received += num_read;
+                        show_progress(num_read);
+                    }
+                }
+            }
+
+            if(num_read == -1 && errno != EINTR) {
+                perror("Error reading file from data connection");
+                exit(EXIT_FAILURE);
+            }
+
+            //This stripe's connection is done:
+            if(num_read == 0) {
+                pfds[i].fd = -1;
+                open_count--;
+            }
+        }
+    }
+    progress_end();
+    free(buffer);
+    close(file_fd);
+
+    //Every stripe must have arrived in full:
+    for(i=0; i<count; i++) {
+        if(stripes[i].header_len < STRIPE_HEADER_SIZE || stripes[i].received != stripes[i].length) {
+            complete = 0;
+        }
+    }
+    if(!complete || received != size) {
+        printf("File incomplete: %s\n", filename);
+        request_failed = 1;
+        return -1;
+    }
+
+    //The stripes arrive on whichever connection, so put their checksums
+    //together in the order of their offsets:
+    for(i=0; i<count; i++) {
+        for(j=i; j>0 && order[j-1]->offset > stripes[i].offset; j--) {
+            order[j] = order[j-1];
+        }
+        order[j] = &stripes[i];
+    }
+    *sum = order[0]->sum;
+    for(i=1; i<count; i++) {
+        *sum = sum_combine(*sum, order[i]->sum, order[i]->length);
+    }
+
+    printf("File received: %s (%d connections)\n", filename, count);
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Shows how the last transfer went: the bytes on its data connection, how
+ *      long it took from the request to the end of the data, the throughput,
+ *      the time to its first byte and the system calls it took, and
+ *      measures the path's rate from it (see tune_observe())
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void show_stats(void) {
+    char summary[BUF_SIZE];
+
+    xfer_stats_end(&stats);
+    xfer_stats_summary(&stats, summary, sizeof(summary));
+    printf("Transfer: %s\n", summary);
+
+    //What the path carried sizes the data connections after it:
+    if(stats.first_ns > 0) {
+        tune_observe(&tuning, stats.bytes, stats.end_ns - stats.first_ns);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Starts a progress bar for a transfer, if the file is large enough to be
+ *      worth one and the client is talking to a terminal
+ * Param:   off_t size -  Number of bytes to be transferred
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void progress_start(off_t size) {
+
+    progress_size = size >= PROGRESS_MIN_SIZE && isatty(STDOUT_FILENO) ? size : 0;
+    progress_done = 0;
+    progress_ns = 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Counts bytes of a transfer that have reached their destination and
+ *      redraws the progress bar, at most every PROGRESS_INTERVAL nanoseconds
+ * Param:   off_t moved -  Number of bytes moved
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void show_progress(off_t moved) {
+    long long now;
+    double seconds;
+    int i, filled;
+
+    if(progress_size == 0) {
+        return;
+    }
+    progress_done += moved;
+    now = xfer_clock_ns();
+    if(now - progress_ns < PROGRESS_INTERVAL && progress_done < progress_size) {
+        return;
+    }
+    progress_ns = now;
+
+    filled = progress_done >= progress_size ? PROGRESS_WIDTH : (int) (progress_done * PROGRESS_WIDTH / progress_size);
+    seconds = (now - stats.start_ns) / 1e9;
+    printf("\r[");
+    for(i=0; i<PROGRESS_WIDTH; i++) {
+        putchar(i < filled ? '#' : '-');
+    }
+    printf("] %3d%% %lld/%lld MB %.1f MB/s", filled * 100 / PROGRESS_WIDTH, (long long) (progress_done >> 20),
+        (long long) (progress_size >> 20), seconds > 0 ? progress_done / seconds / 1e6 : 0.0);
+    fflush(stdout);
+    progress_shown = 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Ends a transfer's progress bar, clearing it from the terminal
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void progress_end(void) {
+
+    if(progress_shown) {
+        printf("\r\033[K");
+        fflush(stdout);
+    }
+    progress_size = 0;
+    progress_shown = 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * A signal handler for sigint and sigterm signals.  Cleans up and says goodbye.
+ * Param:   int sig -  The signal received
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void signal_handler(int sig) {
+    printf("\nClosing connection to server...\n");
+    send_command(control_fd, "exit\n");
+
+    close(control_fd);
+    printf("Connection closed\n");
+    exit(EXIT_SUCCESS);
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Installs the signal handlers for the sigint and sigterm signals
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void install_signal_handlers(void) {
+    struct sigaction sig;
+
+    sig.sa_handler = signal_handler;
+    sigemptyset(&sig.sa_mask);
+    sig.sa_flags = 0;
+
+    sigaction(SIGINT, &sig, NULL);
+    sigaction(SIGTERM, &sig, NULL);
+
+    //An upload the server gives up on is reported, not fatal:
+    sig.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sig, NULL);
 }
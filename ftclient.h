@@ -14,17 +14,159 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #include "ftutil.h"
+#include "ftxfer.h"
+#include "ftsum.h"
+#include "ftdelta.h"
+#include "fttune.h"
+
+//Constants:
+#define STRIPE_BUF_SIZE (256 * 1024)
+#define BATCH_BUF_SIZE (64 * 1024)
+#define RECEIVE_BUF_SIZE (1024 * 1024)
+#define DIRECT_MIN_SIZE (64 * 1024 * 1024)
+#define DIRECT_ALIGN 4096
+#define PROGRESS_MIN_SIZE (16 * 1024 * 1024)
+#define PROGRESS_INTERVAL 100000000
+#define PROGRESS_WIDTH 30
+#define BATCH_WINDOW 32
+#define BATCH_LINE_SIZE (BUF_SIZE + 2)
+#define REPLY_LIMIT (1024 * 1024)
+
+//Exit Codes (batch mode):
+#define EXIT_COMMAND_FAILED 2
+#define EXIT_CONNECTION_LOST 3
+
+//What to do with a file that is already there:
+#define EXISTS_ASK 0
+#define EXISTS_OVERWRITE 1
+#define EXISTS_SKIP 2
+#define EXISTS_FAIL 3
+
+//Types:
+
+//Where a transfer's data arrives: its own data connection (stream 0),
+//or one stream of the multiplexed data channel.  Compressed transfers are
+//decoded a block at a time.
+struct data_stream {
+    int fd;
+    unsigned int stream;
+    size_t frame_left;
+    int ended;
+    int status;
+    struct codec codec;
+    char block[BLOCK_MAX];
+    size_t block_len;
+    size_t block_off;
+};
+
+//A directory of a recursive get whose own mode is set once its contents
+//have arrived
+struct pending_mode {
+    char * path;
+    mode_t mode;
+};
+
+//Progress of one data connection of a striped get, and the checksum of what
+//it has received
+struct stripe {
+    char header[STRIPE_HEADER_SIZE];
+    size_t header_len;
+    off_t offset;
+    off_t length;
+    off_t received;
+    uint32_t sum;
+};
+
+//A sync of a local file: the blocks it was signed in, the file the new copy
+//is put together in, and where the new copy's bytes came from
+struct sync {
+    size_t block;
+    size_t count;
+    char path[BUF_SIZE + 8];
+    off_t sent;
+    off_t received;
+    off_t literal;
+    off_t reused;
+};
+
+//A request that has been sent to the server, and what is needed to take in
+//its data once the server gets to it (see send_request())
+struct request {
+    int command;
+    char arg[BUF_SIZE];
+    char text[2 * BUF_SIZE];
+    int connect;
+    int passive_fd;
+    int shared_fd;
+    int ranged;
+    int recursive;
+    off_t offset;
+    off_t length;
+    off_t size;
+    struct sync y;
+};
 
 //Function Prototypes:
 void control_connect(int ctrl_fd, char *host);
 void receive_message(int ctrl_fd);
-void make_request(int ctrl_fd, char *request);
+void discard_message(int ctrl_fd);
+void receive_line(int ctrl_fd, char *line, size_t size);
+void receive_reply(int ctrl_fd, int show);
+void reply_step(int ctrl_fd);
+void reply_done(void);
+void control_fill(int ctrl_fd);
+void send_command(int ctrl_fd, char *request);
+int make_request(int ctrl_fd, char *request);
+int send_request(int ctrl_fd, char *request, struct request *r, int listen_fd);
+void finish_request(int ctrl_fd, struct request *r);
+void add_batch_command(const char *command);
+void read_batch_file(const char *path);
+int run_batch(int ctrl_fd);
+int can_pipeline(char *request);
+int confirm_overwrite(char *filename);
+void check_reply(const char *text, size_t length);
 void get_request(int ctrl_fd, char *response);
-int open_data_connection(int ctrl_fd);
-void receive_listing(int data_fd);
-void receive_file(int data_fd, char *filename);
+int listen_data_port(void);
+int open_data_connection(int ctrl_fd, int passive_fd);
+int accept_data_connection(int ctrl_fd, int passive_fd);
+int connect_data_port(int ctrl_fd);
+off_t remote_size(int ctrl_fd, char *filename);
+int prefix_matches(int ctrl_fd, char *filename, off_t length);
+off_t receive_size(int ctrl_fd);
+int open_stream(int ctrl_fd, struct data_stream *data);
+void stream_open(struct data_stream *data, int fd, unsigned int stream);
+ssize_t stream_read(struct data_stream *data, void *buffer, size_t size);
+ssize_t stream_read_block(struct data_stream *data);
+ssize_t stream_fill(struct data_stream *data, void *buffer, size_t size);
+ssize_t stream_read_wire(struct data_stream *data, void *buffer, size_t size);
+ssize_t stream_read_all(struct data_stream *data, void *buffer, size_t size);
+void stream_drain(struct data_stream *data);
+void receive_listing(struct data_stream *data);
+void receive_cursor(int ctrl_fd);
+int receive_file(struct data_stream *data, char *filename, off_t offset, off_t size, uint32_t *sum);
+char *receive_buffer(void);
+off_t receive_body(struct data_stream *data, int file_fd, char *buffer, size_t filled, off_t position, off_t size, uint32_t *sum);
+int receive_splice(int socket_fd, int file_fd, off_t *position, uint32_t *sum);
+int verify_sum(int ctrl_fd, char *filename, uint32_t *sum);
+void set_aside(char *filename);
+char *sync_sign(char *filename, struct sync *y);
+int receive_delta(struct data_stream *data, char *filename, struct sync *y, off_t size, uint32_t *sum);
+void finish_sync(int ctrl_fd, char *filename, struct sync *y, off_t size, uint32_t *sum);
+void receive_batch(struct data_stream *data, int verbose);
+void get_striped(int ctrl_fd, char *request, char *filename, int count);
+int accept_stripe_connection(int ctrl_fd, int passive_fd);
+int put_file(int ctrl_fd, char *filename);
+int receive_stripes(int *fds, int count, char *filename, off_t size, uint32_t *sum);
+void show_stats(void);
+void progress_start(off_t size);
+void show_progress(off_t moved);
+void progress_end(void);
 void signal_handler(int sig);
 void install_signal_handlers(void);
 
@@ -0,0 +1,236 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftdelta.c
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Block matching for syncs, in the manner of
+ *      rsync.  The client signs each block of its copy of a
+ *      file with a rolling checksum and a 64-bit hash; the
+ *      server rolls the checksum over its own copy a byte at
+ *      a time, looks each value up in a hash table of the
+ *      client's signatures, and only hashes the block when
+ *      the checksum matches one.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include "ftdelta.h"
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Finds the bucket a rolling checksum belongs in (its low bits are poorly
+ *      spread, so it is mixed first)
+ * Param:   struct delta_index * d -  The index
+ * Param:   uint32_t weak -  The rolling checksum
+ * Return:  uint32_t -  The bucket
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint32_t delta_bucket(struct delta_index * d, uint32_t weak) {
+    return (weak * 2654435761u) >> (32 - d->bits);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Finds a rolling checksum's bit in the index's filter
+ * Param:   struct delta_index * d -  The index
+ * Param:   uint32_t weak -  The rolling checksum
+ * Return:  uint32_t -  The bit
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint32_t delta_filter_bit(struct delta_index * d, uint32_t weak) {
+    return (weak * 2654435761u) >> (32 - d->bits - DELTA_FILTER_SHIFT);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Allocates an index for the given number of signatures (filled in by the
+ *      caller, then indexed with delta_index_build())
+ * Param:   struct delta_index * d -  The index
+ * Param:   size_t block -  The block size the signatures were made with
+ * Param:   size_t count -  Number of signatures
+ * Return:  int -  0 on success, or -1 if out of memory
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int delta_index_init(struct delta_index * d, size_t block, size_t count) {
+
+    memset(d, 0, sizeof(*d));
+    d->block = block;
+    d->count = count;
+
+    //About two buckets per block:
+    for(d->bits = DELTA_HASH_MIN_BITS; ((size_t) 1 << d->bits) < 2 * count; d->bits++);
+
+    if((d->weak = malloc((count + 1) * sizeof(*d->weak))) == NULL ||
+        (d->strong = malloc((count + 1) * sizeof(*d->strong))) == NULL ||
+        (d->chain = malloc((count + 1) * sizeof(*d->chain))) == NULL ||
+        (d->heads = calloc((size_t) 1 << d->bits, sizeof(*d->heads))) == NULL ||
+        (d->filter = calloc((size_t) 1 << (d->bits + DELTA_FILTER_SHIFT - 6), sizeof(*d->filter))) == NULL) {
+        delta_index_free(d);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Indexes the signatures by rolling checksum.  Blocks identical to the last
+ *      one indexed in the same bucket (runs of zeros, say) are left out, so
+ *      chains stay short; any one of them serves as well as another.
+ * Param:   struct delta_index * d -  The index
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void delta_index_build(struct delta_index * d) {
+    uint32_t bucket, head, bit;
+    size_t i;
+
+    //Earlier blocks end up first in their chains:
+    for(i=d->count; i>0; i--) {
+        bit = delta_filter_bit(d, d->weak[i - 1]);
+        d->filter[bit >> 6] |= (uint64_t) 1 << (bit & 63);
+        bucket = delta_bucket(d, d->weak[i - 1]);
+        head = d->heads[bucket];
+        if(head != 0 && d->weak[head - 1] == d->weak[i - 1] && d->strong[head - 1] == d->strong[i - 1]) {
+            continue;
+        }
+        d->chain[i - 1] = head;
+        d->heads[bucket] = i;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Frees an index
+ * Param:   struct delta_index * d -  The index
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void delta_index_free(struct delta_index * d) {
+
+    free(d->weak);
+    free(d->strong);
+    free(d->chain);
+    free(d->heads);
+    free(d->filter);
+    d->weak = NULL;
+    d->strong = NULL;
+    d->chain = NULL;
+    d->heads = NULL;
+    d->filter = NULL;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Computes the rolling checksum of a block: the sum of its bytes in the low
+ *      16 bits and the sum of those sums in the high 16 (as in rsync)
+ * Param:   const char * buf -  The block
+ * Param:   size_t length -  Its length
+ * Return:  uint32_t -  The checksum
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+uint32_t delta_weak(const char * buf, size_t length) {
+    const unsigned char * p = (const unsigned char *) buf;
+    uint32_t a = 0, b = 0;
+    size_t i;
+
+    //(b is the sum of the running totals of a, taken 8 bytes at a time)
+    for(i=0; i + 8 <= length; i += 8) {
+        b += 8 * a + 8 * p[i] + 7 * p[i + 1] + 6 * p[i + 2] + 5 * p[i + 3] +
+             4 * p[i + 4] + 3 * p[i + 5] + 2 * p[i + 6] + p[i + 7];
+        a += p[i] + p[i + 1] + p[i + 2] + p[i + 3] + p[i + 4] + p[i + 5] + p[i + 6] + p[i + 7];
+    }
+    for(; i<length; i++) {
+        a += p[i];
+        b += a;
+    }
+
+    return (a & 0xffff) | (b << 16);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Looks a block up among the client's: the block after the last one
+ *      matched first (the usual case), then everything with the same rolling
+ *      checksum.  The block is hashed at most once, and only if the rolling
+ *      checksum matches.
+ * Param:   struct delta_index * d -  The index
+ * Param:   uint32_t weak -  The block's rolling checksum
+ * Param:   const char * buf -  The block (d->block bytes)
+ * Param:   long expected -  The block after the last one matched, or -1
+ * Return:  long -  The client's matching block, or -1 if it has none
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static long delta_lookup(struct delta_index * d, uint32_t weak, const char * buf, long expected) {
+    uint64_t strong = 0;
+    int hashed = 0;
+    uint32_t i = delta_filter_bit(d, weak);
+
+    if(expected >= 0 && (size_t) expected < d->count && d->weak[expected] == weak) {
+        strong = sum_xxh64(buf, d->block);
+        hashed = 1;
+        if(d->strong[expected] == strong) {
+            return expected;
+        }
+    }
+
+    //Most checksums are not the client's at all:
+    if(!(d->filter[i >> 6] & ((uint64_t) 1 << (i & 63)))) {
+        return -1;
+    }
+
+    for(i = d->heads[delta_bucket(d, weak)]; i != 0; i = d->chain[i - 1]) {
+        if(d->weak[i - 1] != weak) {
+            continue;
+        }
+        if(!hashed) {
+            strong = sum_xxh64(buf, d->block);
+            hashed = 1;
+        }
+        if(d->strong[i - 1] == strong) {
+            return i - 1;
+        }
+    }
+
+    return -1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Rolls through a buffer from *pos looking for a block the client has
+ * Param:   struct delta_index * d -  The client's signatures
+ * Param:   const char * buf -  The server's data
+ * Param:   size_t length -  Length of the data
+ * Param:   size_t * pos -  Where to start; set to where the block found
+ *      starts, or to the first position not tried (the last d->block - 1
+ *      bytes of the buffer can't start a whole block)
+ * Param:   long expected -  The block after the last one matched, or -1
+ * Return:  long -  The client's block that was found, or -1 if none was
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+long delta_scan(struct delta_index * d, const char * buf, size_t length, size_t * pos, long expected) {
+    const unsigned char * p = (const unsigned char *) buf;
+    size_t i = *pos, block = d->block;
+    uint32_t weak, a, b;
+    long index;
+
+    if(i + block > length) {
+        return -1;
+    }
+
+    weak = delta_weak(buf + i, block);
+    a = weak & 0xffff;
+    b = weak >> 16;
+
+    for(;;) {
+        if((index = delta_lookup(d, (a & 0xffff) | (b << 16), buf + i, expected)) != -1) {
+            *pos = i;
+            return index;
+        }
+        if(i + block >= length) {
+            break;
+        }
+
+        //Roll on by a byte:
+        a += p[i + block] - p[i];
+        b += a - (uint32_t) block * p[i];
+        i++;
+    }
+
+    *pos = i + 1;
+    return -1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Checks whether a block is the same as one of the client's in particular
+ *      (to extend a run of matching blocks without a lookup)
+ * Param:   struct delta_index * d -  The client's signatures
+ * Param:   const char * buf -  The block (d->block bytes)
+ * Param:   size_t index -  The client's block
+ * Return:  int -  1 if they match, 0 if not
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int delta_match(struct delta_index * d, const char * buf, size_t index) {
+
+    return index < d->count && d->weak[index] == delta_weak(buf, d->block) &&
+           d->strong[index] == sum_xxh64(buf, d->block);
+}
@@ -0,0 +1,52 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftdelta.h
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Header file for ftdelta.c
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include "ftsum.h"
+
+#ifndef FTDELTA_H
+#define FTDELTA_H
+
+//CONSTANTS:
+
+#define DELTA_WINDOW (1024 * 1024)
+#define DELTA_HASH_MIN_BITS 10
+#define DELTA_FILTER_SHIFT 3
+
+
+//TYPES:
+
+//The signatures of the client's blocks (a rolling checksum and a hash of
+//each), indexed by rolling checksum.  heads holds the first block (plus
+//one, so 0 means none) in each bucket, and chain the next in the same one.
+//filter has a bit set for each rolling checksum present, in a table 8 times
+//larger than heads, so most positions are turned away with a single test.
+struct delta_index {
+    size_t block;
+    size_t count;
+    uint32_t * weak;
+    uint64_t * strong;
+    uint32_t * heads;
+    uint32_t * chain;
+    uint64_t * filter;
+    unsigned int bits;
+};
+
+
+//FUNCTION PROTOTYPES:
+
+int delta_index_init(struct delta_index * d, size_t block, size_t count);
+void delta_index_build(struct delta_index * d);
+void delta_index_free(struct delta_index * d);
+uint32_t delta_weak(const char * buf, size_t length);
+long delta_scan(struct delta_index * d, const char * buf, size_t length, size_t * pos, long expected);
+int delta_match(struct delta_index * d, const char * buf, size_t index);
+
+#endif
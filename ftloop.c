@@ -0,0 +1,1025 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftloop.c
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: A small event loop.  File descriptors are
+ *      registered together with a handler, which is called
+ *      whenever the descriptor is ready.  The loop runs on
+ *      epoll, or on io_uring where the kernel supports it:
+ *      there, every descriptor is watched with a one-shot
+ *      poll request that is re-armed after its handler runs,
+ *      and all of the requests queued while handling events
+ *      are submitted together with the wait for the next
+ *      ones, in a single system call.  Listening sockets
+ *      accept through a multishot request, so connections
+ *      arrive already accepted.  The io_uring engine also
+ *      makes the sends and splices of a transfer itself
+ *      (see loop_send() and loop_splice()), from sockets and
+ *      buffers registered with the kernel, and calls back
+ *      once they have completed.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include "ftloop.h"
+
+//Static Variables:
+static int engine = LOOP_EPOLL;
+static int epoll_fd = -1;
+static void ** garbage;
+static size_t garbage_len, garbage_cap;
+static int tick_interval = -1;
+static tick_handler tick;
+static long long next_tick;
+
+//The io_uring engine's rings (shared with the kernel) and watch table:
+static int ring_fd = -1;
+static int enter_fd;
+static unsigned int enter_flags;
+static unsigned int * sq_head, * sq_tail, sq_mask, sq_entries, sq_pending;
+static struct io_uring_sqe * sqes;
+static unsigned int * cq_head, * cq_tail, cq_mask;
+static struct io_uring_cqe * cqes;
+static struct loop_slot * slots;
+static int slots_len, slots_cap, free_slot = -1;
+static int can_send, can_splice, can_zerocopy;
+static int files_registered, buffers_registered;
+static char buffer_used[RING_BUFFERS];
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Asks the kernel which of the requests the loop makes for transfers it
+ *      supports: sends and splices (5.7), and zero-copy sends (6.0)
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void uring_probe(void) {
+    struct io_uring_probe * probe;
+    size_t size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+
+    if((probe = calloc(1, size)) == NULL) {
+        return;
+    }
+    if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        can_send = probe->ops_len > IORING_OP_SEND && (probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED);
+        can_splice = probe->ops_len > IORING_OP_SPLICE && (probe->ops[IORING_OP_SPLICE].flags & IO_URING_OP_SUPPORTED);
+        can_zerocopy = probe->ops_len > IORING_OP_SEND_ZC && (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sets up an io_uring instance for the loop
+ * Param:   void
+ * Return:  int -  0 on success, or -1 if io_uring is not available (errno is set)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static int uring_init(void) {
+    static const unsigned int setups[] = {
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN, IORING_SETUP_COOP_TASKRUN, 0
+    };
+    struct io_uring_params p;
+    struct io_uring_rsrc_update reg;
+    struct io_uring_rsrc_register table;
+    unsigned int i, * array;
+    size_t sq_size, cq_size;
+    char * sq_ring;
+
+    //Use the cheapest task handling the kernel knows about:
+    for(i=0; i<sizeof(setups) / sizeof(*setups); i++) {
+        memset(&p, 0, sizeof(p));
+        p.flags = setups[i];
+        if((ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p)) != -1 || errno != EINVAL) {
+            break;
+        }
+    }
+    if(ring_fd == -1) {
+        return -1;
+    }
+
+    //Waiting with a timeout needs EXT_ARG (5.11), which implies the rest:
+    if(!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring_fd);
+        ring_fd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+
+    //Map the submission and completion rings (one mapping) and the requests:
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sq_ring = mmap(NULL, sq_size > cq_size ? sq_size : cq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if(sq_ring == MAP_FAILED) {
+        close(ring_fd);
+        ring_fd = -1;
+        return -1;
+    }
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        close(ring_fd);
+        ring_fd = -1;
+        return -1;
+    }
+
+    sq_head = (unsigned int *) (sq_ring + p.sq_off.head);
+    sq_tail = (unsigned int *) (sq_ring + p.sq_off.tail);
+    sq_mask = *(unsigned int *) (sq_ring + p.sq_off.ring_mask);
+    sq_entries = p.sq_entries;
+    cq_head = (unsigned int *) (sq_ring + p.cq_off.head);
+    cq_tail = (unsigned int *) (sq_ring + p.cq_off.tail);
+    cq_mask = *(unsigned int *) (sq_ring + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (sq_ring + p.cq_off.cqes);
+
+    //Requests are always queued in order, so each ring slot uses its own entry:
+    array = (unsigned int *) (sq_ring + p.sq_off.array);
+    for(i=0; i<sq_entries; i++) {
+        array[i] = i;
+    }
+
+    //Register the ring itself, so entering it skips the descriptor lookup (5.18):
+    enter_fd = ring_fd;
+    enter_flags = 0;
+    memset(&reg, 0, sizeof(reg));
+    reg.offset = -1U;
+    reg.data = ring_fd;
+    if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_RING_FDS, &reg, 1) == 1) {
+        enter_fd = reg.offset;
+        enter_flags = IORING_ENTER_REGISTERED_RING;
+    }
+
+    //Find out which transfer requests the kernel can make, and register
+    //(empty) tables for the sockets and buffers they are made with (5.19):
+    uring_probe();
+    memset(&table, 0, sizeof(table));
+    table.flags = IORING_RSRC_REGISTER_SPARSE;
+    table.nr = RING_FILES;
+    files_registered = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES2, &table, sizeof(table)) == 0;
+    table.nr = RING_BUFFERS;
+    buffers_registered = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS2, &table, sizeof(table)) == 0;
+
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Submits the queued requests and optionally waits for a completion
+ * Param:   int wait -  Nonzero to wait for at least one completion
+ * Param:   int timeout_ms -  Longest wait in milliseconds, or -1 for no limit
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void uring_enter(int wait, int timeout_ms) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int flags = enter_flags | IORING_ENTER_EXT_ARG;
+    int n;
+
+    memset(&arg, 0, sizeof(arg));
+    if(wait) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if(timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+            arg.ts = (unsigned long long) &ts;
+        }
+    }
+
+    n = syscall(__NR_io_uring_enter, enter_fd, sq_pending, wait ? 1 : 0, flags, &arg, sizeof(arg));
+    if(n >= 0) {
+        sq_pending -= n;
+    }
+
+    //Timeouts, signals and a full completion ring just mean: handle what is there
+    else if(errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+        perror("Error waiting for events");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Makes room in the submission queue, handing the queued requests to the
+ *      kernel if there is not enough
+ * Param:   unsigned int count -  Number of requests about to be queued
+ *      (linked requests must be submitted together)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void uring_room(unsigned int count) {
+
+    while(*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + count > sq_entries) {
+        uring_enter(0, 0);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Queues a new request (submitted with the next wait)
+ * Param:   void
+ * Return:  struct io_uring_sqe * -  The request, zeroed
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static struct io_uring_sqe * uring_sqe(void) {
+    struct io_uring_sqe * sqe;
+    unsigned int tail;
+
+    uring_room(1);
+    tail = *sq_tail;
+    sqe = &sqes[tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    sq_pending++;
+
+    return sqe;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Gives a watch a slot in the io_uring engine's table
+ * Param:   struct watch * w -  The watch
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void slot_alloc(struct watch * w) {
+    struct loop_slot * grown;
+
+    if(free_slot == -1) {
+        if(slots_len == slots_cap) {
+            slots_cap = slots_cap ? slots_cap * 2 : 256;
+            if((grown = realloc(slots, slots_cap * sizeof(*slots))) == NULL) {
+                perror("Error allocating memory");
+                exit(EXIT_FAILURE);
+            }
+            slots = grown;
+        }
+        slots[slots_len].gen = 0;
+        slots[slots_len].next_free = -1;
+        free_slot = slots_len++;
+    }
+
+    w->slot = free_slot;
+    free_slot = slots[w->slot].next_free;
+    slots[w->slot].w = w;
+    w->armed = 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Gives a watch's slot back, taking its socket out of the file table
+ * Param:   struct watch * w -  The watch
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void slot_free(struct watch * w) {
+    struct io_uring_files_update update;
+    int none = -1;
+
+    //(The table holds its own reference, which would keep the socket open)
+    if(w->fixed != -1) {
+        memset(&update, 0, sizeof(update));
+        update.offset = w->fixed;
+        update.fds = (unsigned long long) &none;
+        syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+        w->fixed = -1;
+    }
+
+    slots[w->slot].gen++;
+    slots[w->slot].w = NULL;
+    slots[w->slot].next_free = free_slot;
+    free_slot = w->slot;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Identifies a watch's current request in completions and cancellations
+ * Param:   struct watch * w -  The watch
+ * Return:  unsigned long long -  The request's user data (never 0)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static unsigned long long slot_key(struct watch * w) {
+
+    return ((unsigned long long) (w->slot + 1) << 32) | slots[w->slot].gen;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Asks the kernel to watch a descriptor: a poll for the events the watch
+ *      wants, or an accept for a listening socket
+ * Param:   struct watch * w -  The watch
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void uring_arm(struct watch * w) {
+    struct io_uring_sqe * sqe;
+
+    if(w->armed || w->busy > 0 || w->fd == -1 || (w->events == 0 && !w->multishot)) {
+        return;
+    }
+
+    //A new generation, so anything still in flight from before is ignored:
+    slots[w->slot].gen++;
+    sqe = uring_sqe();
+    sqe->fd = w->fd;
+    sqe->user_data = slot_key(w);
+    if(w->multishot) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+    else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = w->events;
+    }
+    w->armed = 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Cancels a watch's outstanding request, if it has one
+ * Param:   struct watch * w -  The watch
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void uring_disarm(struct watch * w) {
+    struct io_uring_sqe * sqe;
+
+    if(!w->armed) {
+        return;
+    }
+
+    sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = slot_key(w);
+    slots[w->slot].gen++;
+    w->armed = 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Takes a watch out of the io_uring engine.  A transfer request still in
+ *      flight is cancelled, and the watch keeps its slot until the request
+ *      has completed and the kernel is done with its data (see
+ *      uring_complete()).
+ * Param:   struct watch * w -  The watch
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void uring_forget(struct watch * w) {
+    static const unsigned long long parts[] = { KEY_OP | KEY_FILL, KEY_OP | KEY_POLL, KEY_OP, 0 };
+    struct io_uring_sqe * sqe;
+    int i;
+
+    if(w->busy == 0 && w->pinned == 0) {
+        uring_disarm(w);
+        slot_free(w);
+        return;
+    }
+
+    //Cancel the requests and any poll, keeping the generation they carry:
+    for(i=0; i<4; i++) {
+        sqe = uring_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = slot_key(w) | parts[i];
+    }
+    w->armed = 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Readies a watch for a transfer request, which takes the place of its poll
+ *      until it completes.  The socket is put in the file table the first
+ *      time, so the kernel need not look it up for every request.
+ * Param:   struct watch * w -  The watch
+ * Param:   op_handler done -  Called when the request has completed
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void uring_request(struct watch * w, op_handler done) {
+    struct io_uring_files_update update;
+
+    uring_disarm(w);
+
+    if(w->fixed == -1 && files_registered && w->slot < RING_FILES) {
+        memset(&update, 0, sizeof(update));
+        update.offset = w->slot;
+        update.fds = (unsigned long long) &w->fd;
+        if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1) {
+            w->fixed = w->slot;
+        }
+    }
+
+    w->done = done;
+    w->filled = 0;
+    w->sent = 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Points a request at a watch's socket, through the file table if it is there
+ * Param:   struct watch * w -  The watch
+ * Param:   struct io_uring_sqe * sqe -  The request
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void uring_target(struct watch * w, struct io_uring_sqe * sqe) {
+
+    if(w->fixed != -1) {
+        sqe->fd = w->fixed;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    else {
+        sqe->fd = w->fd;
+    }
+    sqe->user_data = slot_key(w) | KEY_OP;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Event handler for a listening socket watched for readiness: accepts every
+ *      pending connection
+ * Param:   struct watch * w -  The listening socket's watch
+ * Param:   unsigned int events -  Events that occurred
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void accept_ready(struct watch * w, unsigned int events) {
+    int fd;
+
+    while(w->fd != -1) {
+        if((fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+            w->accepted(w, fd);
+        }
+
+        //Nothing pending, or a problem with just this connection:
+        else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        else if(errno != EINTR && errno != ECONNABORTED) {
+            w->accepted(w, -1);
+            return;
+        }
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Finds the watch a completion is for
+ * Param:   struct io_uring_cqe * cqe -  The completion
+ * Return:  struct watch * -  The watch, or NULL for a cancellation or a
+ *      completion of a request that has since been replaced
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static struct watch * uring_watch(struct io_uring_cqe * cqe) {
+    unsigned long long key = cqe->user_data;
+    int slot = (int) ((key & ~(KEY_OP | KEY_FILL | KEY_POLL)) >> 32) - 1;
+    struct watch * w;
+
+    if(slot < 0 || slot >= slots_len || (w = slots[slot].w) == NULL || slots[slot].gen != (unsigned int) key) {
+        return NULL;
+    }
+
+    //(Transfer requests complete even after their watch has been closed)
+    if(key & KEY_OP) {
+        return w->busy > 0 || w->pinned > 0 ? w : NULL;
+    }
+    if(!w->armed || w->fd == -1) {
+        return NULL;
+    }
+    return w;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Collects a completion of a watch's transfer request, and calls its handler
+ *      once the last one is in
+ * Param:   struct watch * w -  The watch
+ * Param:   struct io_uring_cqe * cqe -  The completion
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void uring_complete(struct watch * w, struct io_uring_cqe * cqe) {
+    int slot = w->slot;
+
+    //A zero-copy send's notification, that the kernel is done with its data,
+    //follows the send's result (and can take until the data has been
+    //acknowledged).  Only a watch that was closed is waiting for it.
+    if(cqe->flags & IORING_CQE_F_NOTIF) {
+        if(--w->pinned > 0 || w->busy > 0 || w->fd != -1) {
+            return;
+        }
+    }
+
+    //A splice into the socket is cancelled when a request linked before it
+    //failed (the fill came up short), having moved nothing.  The poll linked
+    //before it carries no result.
+    else {
+        if(cqe->user_data & KEY_FILL) {
+            w->filled = cqe->res;
+        }
+        else if(!(cqe->user_data & KEY_POLL)) {
+            w->sent = cqe->res == -ECANCELED ? 0 : cqe->res;
+        }
+        if(cqe->flags & IORING_CQE_F_MORE) {
+            w->pinned++;
+        }
+        if(--w->busy > 0) {
+            return;
+        }
+    }
+
+    //A watch closed while the request was in flight goes now:
+    if(w->fd == -1) {
+        if(w->pinned > 0) {
+            return;
+        }
+        slot_free(w);
+        w->done(w, w->filled, w->sent);
+        return;
+    }
+
+    //Watch again (unless the handler closed the watch or made another request):
+    w->done(w, w->filled, w->sent);
+    if(slots[slot].w == w) {
+        uring_arm(w);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Passes a completion from the io_uring engine to its watch's handler
+ * Param:   struct io_uring_cqe * cqe -  The completion
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void uring_dispatch(struct io_uring_cqe * cqe) {
+    struct watch * w;
+    int slot;
+
+    //Drop cancellations, and completions for requests that were replaced:
+    if((w = uring_watch(cqe)) == NULL) {
+        return;
+    }
+    slot = w->slot;
+
+    if(cqe->user_data & KEY_OP) {
+        uring_complete(w, cqe);
+        return;
+    }
+
+    if(w->multishot) {
+
+        //Multishot accepts need 5.19: watch for readiness and accept by hand
+        if(cqe->res == -EINVAL) {
+            w->multishot = 0;
+            w->armed = 0;
+        }
+        else {
+            w->armed = (cqe->flags & IORING_CQE_F_MORE) != 0;
+            if(cqe->res < 0) {
+                errno = -cqe->res;
+                if(errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                    w->accepted(w, -1);
+                }
+            }
+            else {
+                w->accepted(w, cqe->res);
+            }
+        }
+    }
+    else {
+        w->armed = 0;
+        w->handler(w, cqe->res < 0 ? EPOLLERR : (unsigned int) cqe->res);
+    }
+
+    //Watch again (the handler may have closed it, or re-armed it already):
+    if(slots[slot].w == w) {
+        uring_arm(w);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Creates the event loop.  Must be called before any other loop function.
+ * Param:   int wanted -  LOOP_URING to run on io_uring if the kernel supports
+ *      it, or LOOP_EPOLL
+ * Return:  int -  The engine in use
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int loop_init(int wanted) {
+
+    if(wanted == LOOP_URING) {
+        if(uring_init() == 0) {
+            engine = LOOP_URING;
+            return engine;
+        }
+        perror("io_uring is not available, using epoll");
+    }
+
+    if((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("Error creating event loop");
+        exit(EXIT_FAILURE);
+    }
+    engine = LOOP_EPOLL;
+    return engine;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Registers a file descriptor with the event loop
+ * Param:   struct watch * w -  Watch to register (must outlive the registration)
+ * Param:   int fd -  File descriptor to watch
+ * Param:   unsigned int events -  WATCH_READ and/or WATCH_WRITE
+ * Param:   watch_handler handler -  Called when the descriptor is ready
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void loop_add(struct watch * w, int fd, unsigned int events, watch_handler handler) {
+    struct epoll_event event;
+
+    w->fd = fd;
+    w->events = events;
+    w->handler = handler;
+    w->multishot = 0;
+    w->busy = 0;
+    w->pinned = 0;
+    w->fixed = -1;
+
+    if(engine == LOOP_URING) {
+        slot_alloc(w);
+        uring_arm(w);
+        return;
+    }
+
+    event.events = events;
+    event.data.ptr = w;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("Error adding descriptor to event loop");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Registers a listening socket with the event loop
+ * Param:   struct watch * w -  Watch to register (must outlive the registration)
+ * Param:   int fd -  The listening socket (non-blocking)
+ * Param:   accept_handler handler -  Called with each accepted connection
+ *      (non-blocking and close-on-exec), or with -1 if accepting failed (errno
+ *      is set)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void loop_listen(struct watch * w, int fd, accept_handler handler) {
+
+    w->accepted = handler;
+    loop_add(w, fd, WATCH_READ, accept_ready);
+
+    if(engine == LOOP_URING) {
+        uring_disarm(w);
+        w->multishot = 1;
+        uring_arm(w);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Changes the events a registered descriptor is watched for
+ * Param:   struct watch * w -  A registered watch
+ * Param:   unsigned int events -  WATCH_READ and/or WATCH_WRITE
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void loop_modify(struct watch * w, unsigned int events) {
+    struct epoll_event event;
+
+    if(w->fd == -1 || w->events == events) {
+        return;
+    }
+
+    w->events = events;
+    if(engine == LOOP_URING) {
+        uring_disarm(w);
+        uring_arm(w);
+        return;
+    }
+
+    event.events = events;
+    event.data.ptr = w;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, w->fd, &event) == -1) {
+        perror("Error modifying descriptor in event loop");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Unregisters a descriptor and closes it.  Events already
+ *      collected for it in the current iteration are dropped.
+ * Param:   struct watch * w -  A registered watch
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void loop_close(struct watch * w) {
+    int fd;
+
+    if((fd = loop_remove(w)) != -1) {
+        close(fd);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Unregisters a descriptor without closing it, so it can be handed to another watch
+ * Param:   struct watch * w -  A registered watch
+ * Return:  int -  The descriptor that was being watched
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int loop_remove(struct watch * w) {
+    int fd = w->fd;
+
+    if(fd != -1 && engine == LOOP_URING) {
+        uring_forget(w);
+        w->fd = -1;
+    }
+    else if(fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        w->fd = -1;
+    }
+
+    return fd;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Says whether the loop makes transfer requests itself (see loop_send() and
+ *      loop_splice()), which only the io_uring engine does
+ * Param:   void
+ * Return:  int -  1 if it does, 0 if transfers must write to their sockets
+ *      themselves when they are ready
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int loop_async(void) {
+
+    return engine == LOOP_URING && can_send && can_splice;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Says whether a watch has a transfer request in flight, or data the kernel
+ *      still holds from a zero-copy send.  A watch closed meanwhile has its
+ *      handler called once neither is the case, and must be kept until
+ *      then, along with anything the requests read from.
+ * Param:   struct watch * w -  The watch
+ * Return:  int -  1 if it has, 0 if not
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int loop_busy(struct watch * w) {
+
+    return w->busy > 0 || w->pinned > 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sends data over a watch's socket with an io_uring request (see
+ *      loop_async()).  The watch is not polled until it has completed.
+ *      Large sends are made without copying where the kernel can (6.0),
+ *      so the data must be kept for as long as loop_busy() says.
+ * Param:   struct watch * w -  The watch
+ * Param:   const void * data -  Data to send
+ * Param:   size_t length -  Number of bytes to send
+ * Param:   int buffer -  The registered buffer (see loop_buffer()) the
+ *      data lies in, or -1
+ * Param:   op_handler done -  Called with the bytes sent (as sent; filled
+ *      is 0), or with -errno if the send failed
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void loop_send(struct watch * w, const void * data, size_t length, int buffer, op_handler done) {
+    struct io_uring_sqe * sqe;
+
+    uring_request(w, done);
+
+    sqe = uring_sqe();
+    uring_target(w, sqe);
+    sqe->addr = (unsigned long long) data;
+    sqe->len = length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    if(can_zerocopy && length >= RING_ZEROCOPY_MIN) {
+        sqe->opcode = IORING_OP_SEND_ZC;
+        if(buffer != -1) {
+            sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+            sqe->buf_index = buffer;
+        }
+    }
+    else {
+        sqe->opcode = IORING_OP_SEND;
+    }
+    w->busy = 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Moves part of a file to a watch's socket through a pipe with io_uring
+ *      requests (see loop_async()): a splice that fills the pipe from the
+ *      file, then a poll until the socket has room (a splice into a
+ *      non-blocking socket does not wait for it), then a splice that
+ *      empties the pipe into the socket, each linked to the next.  The
+ *      watch is not polled for its own events until they have completed.
+ * Param:   struct watch * w -  The watch
+ * Param:   int in_fd -  The file
+ * Param:   off_t offset -  Where to read the file from, or -1 for its
+ *      current position
+ * Param:   int pipe_fd[2] -  The pipe
+ * Param:   size_t fill -  Bytes to move from the file into the pipe (0 to
+ *      only empty it)
+ * Param:   size_t drain -  Bytes already in the pipe
+ * Param:   op_handler done -  Called with the bytes moved into the pipe and
+ *      the bytes sent from it (or -errno if either splice failed)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void loop_splice(struct watch * w, int in_fd, off_t offset, int pipe_fd[2], size_t fill, size_t drain, op_handler done) {
+    struct io_uring_sqe * sqe;
+
+    uring_request(w, done);
+    uring_room(3);
+
+    //(A fill that comes up short breaks the links, and is sent next time)
+    if(fill > 0) {
+        sqe = uring_sqe();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = pipe_fd[1];
+        sqe->off = -1;
+        sqe->splice_fd_in = in_fd;
+        sqe->splice_off_in = offset;
+        sqe->len = fill;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->user_data = slot_key(w) | KEY_OP | KEY_FILL;
+        w->busy++;
+    }
+
+    sqe = uring_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    uring_target(w, sqe);
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe->poll32_events = WATCH_WRITE;
+    sqe->user_data |= KEY_POLL;
+    w->busy++;
+
+    sqe = uring_sqe();
+    sqe->opcode = IORING_OP_SPLICE;
+    uring_target(w, sqe);
+    sqe->off = -1;
+    sqe->splice_fd_in = pipe_fd[0];
+    sqe->splice_off_in = -1;
+    sqe->len = fill + drain;
+    sqe->splice_flags = SPLICE_F_MOVE | SPLICE_F_MORE;
+    w->busy++;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Registers a buffer that will be sent from again and again with the
+ *      io_uring engine, so the kernel need not map it for every send
+ * Param:   const void * data -  The buffer
+ * Param:   size_t length -  Its size
+ * Return:  int -  Its index (for loop_send()), or -1 if it could not be
+ *      registered (e.g. on epoll, or over the locked memory limit)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int loop_buffer(const void * data, size_t length) {
+    struct io_uring_rsrc_update2 update;
+    struct iovec iov;
+    int i;
+
+    if(engine != LOOP_URING || !buffers_registered || length == 0) {
+        return -1;
+    }
+    for(i=0; i<RING_BUFFERS && buffer_used[i]; i++);
+    if(i == RING_BUFFERS) {
+        return -1;
+    }
+
+    iov.iov_base = (void *) data;
+    iov.iov_len = length;
+    memset(&update, 0, sizeof(update));
+    update.offset = i;
+    update.data = (unsigned long long) &iov;
+    update.nr = 1;
+    if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) != 1) {
+        return -1;
+    }
+
+    buffer_used[i] = 1;
+    return i;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Unregisters a buffer (sends already made from it are unaffected)
+ * Param:   int buffer -  Its index, or -1
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void loop_buffer_free(int buffer) {
+    struct io_uring_rsrc_update2 update;
+    struct iovec iov;
+
+    if(buffer == -1) {
+        return;
+    }
+
+    memset(&iov, 0, sizeof(iov));
+    memset(&update, 0, sizeof(update));
+    update.offset = buffer;
+    update.data = (unsigned long long) &iov;
+    update.nr = 1;
+    syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update));
+    buffer_used[buffer] = 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Frees memory once the current iteration's events have been dispatched,
+ *      so that pending events never refer to a freed watch
+ * Param:   void * ptr -  Memory to free
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void loop_free_later(void * ptr) {
+    void ** grown;
+
+    if(garbage_len == garbage_cap) {
+        garbage_cap = garbage_cap ? garbage_cap * 2 : 16;
+        if((grown = realloc(garbage, garbage_cap * sizeof(*garbage))) == NULL) {
+            perror("Error allocating memory");
+            exit(EXIT_FAILURE);
+        }
+        garbage = grown;
+    }
+    garbage[garbage_len++] = ptr;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sets a handler to be called periodically from the loop
+ * Param:   int interval_ms -  Milliseconds between calls
+ * Param:   tick_handler handler -  Function to call
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void loop_set_tick(int interval_ms, tick_handler handler) {
+
+    tick_interval = interval_ms;
+    tick = handler;
+    next_tick = loop_now_ms() + interval_ms;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the monotonic clock
+ * Param:   void
+ * Return:  long long -  Milliseconds since an arbitrary fixed point
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+long long loop_now_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Works out how long the loop may sleep before the next tick is due
+ * Param:   void
+ * Return:  int -  Milliseconds, or -1 for no limit
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static int loop_timeout(void) {
+    long long now;
+
+    if(tick == NULL) {
+        return -1;
+    }
+    now = loop_now_ms();
+    return next_tick > now ? (int) (next_tick - now) : 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Runs the periodic handler when it is due, and releases anything freed
+ *      while the last batch of events was dispatched
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void loop_after_dispatch(void) {
+
+    if(tick != NULL && loop_now_ms() >= next_tick) {
+        next_tick = loop_now_ms() + tick_interval;
+        tick();
+    }
+
+    while(garbage_len > 0) {
+        free(garbage[--garbage_len]);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Waits for events and dispatches them to their handlers, forever
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void loop_run(void) {
+    struct epoll_event events[MAX_EVENTS];
+    struct io_uring_cqe batch[MAX_EVENTS];
+    struct watch * w;
+    unsigned int head;
+    int i, count, priority;
+
+    while(engine == LOOP_URING) {
+
+        //Submit everything queued since the last wait, and wait:
+        uring_enter(1, loop_timeout());
+
+        //Take (copies of) a batch of completions, freeing their places first,
+        //and dispatch the priority ones before the rest:
+        head = *cq_head;
+        while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            for(count=0; count<MAX_EVENTS && head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); count++) {
+                batch[count] = cqes[head & cq_mask];
+                __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            }
+            for(priority=1; priority>=0; priority--) {
+                for(i=0; i<count; i++) {
+                    if((w = uring_watch(&batch[i])) != NULL && w->priority == priority) {
+                        uring_dispatch(&batch[i]);
+                    }
+                }
+            }
+        }
+
+        loop_after_dispatch();
+    }
+
+    while(1) {
+        if((count = epoll_wait(epoll_fd, events, MAX_EVENTS, loop_timeout())) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("Error waiting for events");
+            exit(EXIT_FAILURE);
+        }
+
+        //Dispatch priority watches first (skipping watches closed earlier in
+        //this batch):
+        for(priority=1; priority>=0; priority--) {
+            for(i=0; i<count; i++) {
+                w = events[i].data.ptr;
+                if(w->fd != -1 && w->priority == priority) {
+                    w->handler(w, events[i].events);
+                }
+            }
+        }
+
+        loop_after_dispatch();
+    }
+}
@@ -0,0 +1,109 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftloop.h
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Header file for ftloop.c
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#ifndef FTLOOP_H
+#define FTLOOP_H
+
+//CONSTANTS:
+
+#define MAX_EVENTS 256
+#define WATCH_READ EPOLLIN
+#define WATCH_WRITE EPOLLOUT
+#define RING_ENTRIES 4096
+#define RING_FILES 4096
+#define RING_BUFFERS 1024
+#define RING_ZEROCOPY_MIN (16 * 1024)
+
+//Transfer requests (see loop_send() and loop_splice()) are told apart from a
+//watch's poll by these bits of their user data:
+#define KEY_OP (1ULL << 63)
+#define KEY_FILL (1ULL << 62)
+#define KEY_POLL (1ULL << 61)
+
+
+//ENGINES:
+
+#define LOOP_EPOLL 0
+#define LOOP_URING 1
+
+
+//TYPES:
+
+struct watch;
+typedef void (*watch_handler)(struct watch * w, unsigned int events);
+typedef void (*accept_handler)(struct watch * w, int fd);
+typedef void (*tick_handler)(void);
+typedef void (*op_handler)(struct watch * w, int filled, int sent);
+
+//A file descriptor registered with the event loop.  Embed it as the
+//first member of a larger structure to recover that structure in the handler.
+//Watches with priority set are handled before the others that became ready
+//at the same time.  The rest is only used by the io_uring engine: busy counts
+//the completions a transfer request still owes (the watch is not polled
+//meanwhile), filled and sent collect its results for done, pinned counts
+//zero-copy sends whose data the kernel still holds, and fixed is the
+//descriptor's place in the registered file table (or -1).
+struct watch {
+    int fd;
+    unsigned int events;
+    watch_handler handler;
+    accept_handler accepted;
+    int priority;
+    int slot;
+    int armed;
+    int multishot;
+    int busy;
+    int pinned;
+    int fixed;
+    int filled;
+    int sent;
+    op_handler done;
+};
+
+//A watch's place in the io_uring engine's table.  Requests carry the slot
+//and generation, so completions for a request that was since cancelled (or
+//for a watch that has gone) are recognised and dropped.
+struct loop_slot {
+    struct watch * w;
+    unsigned int gen;
+    int next_free;
+};
+
+
+//FUNCTION PROTOTYPES:
+
+int loop_init(int engine);
+void loop_add(struct watch * w, int fd, unsigned int events, watch_handler handler);
+void loop_listen(struct watch * w, int fd, accept_handler handler);
+void loop_modify(struct watch * w, unsigned int events);
+void loop_close(struct watch * w);
+int loop_remove(struct watch * w);
+void loop_free_later(void * ptr);
+void loop_set_tick(int interval_ms, tick_handler handler);
+long long loop_now_ms(void);
+int loop_async(void);
+int loop_busy(struct watch * w);
+void loop_send(struct watch * w, const void * data, size_t length, int buffer, op_handler done);
+void loop_splice(struct watch * w, int in_fd, off_t offset, int pipe_fd[2], size_t fill, size_t drain, op_handler done);
+int loop_buffer(const void * data, size_t length);
+void loop_buffer_free(int buffer);
+void loop_run(void);
+
+#endif
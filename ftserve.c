@@ -6,320 +6,3443 @@
  *      Build with "make server" or simply "make".
  *      No command line options are required.  Simply
  *      run the program (ports are defined in ftutil.h).
+ *      Optionally pass "-w <workers>" to run that many
+ *      worker processes sharing the control port through
+ *      SO_REUSEPORT ("-w 0" starts one per online CPU).
+ *      "-e uring" runs the event loop on io_uring instead
+ *      of epoll, where the kernel supports it, and has it
+ *      send files itself (see transfer_submit()).
+ *      "-f data" flushes uploads to disk before they
+ *      replace the old file, and "-f all" flushes the
+ *      directory entry too (by default neither is).
+ *      "-p <port>" listens for control connections on
+ *      another port (e.g. to run beside another server).
+ *      Data connections are tuned to each session's
+ *      bandwidth-delay product (see fttune.c): "-r <rate>"
+ *      gives the path rate in bits/s (e.g. "-r 10G") instead
+ *      of measuring it, and "-C <name>"
+ *      picks the congestion control (bbr by default).
+ *      "-l <file>" limits the bandwidth of clients by
+ *      address, and of the whole server (see ftshape.c);
+ *      the file is read again on sighup.
  *      Close the server with ctrl-c or ctrl-d (sigint/sigterm).
+ *      All sessions are served concurrently from a single
+ *      event loop (see ftloop.c); each session keeps its own
+ *      working directory as a directory file descriptor.
+ *      Files that are fetched again and again are served
+ *      from a cache (see ftcache.c), whose counters are
+ *      printed every minute while it is in use.
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 #include "ftserve.h"
 
 //Static Variables:
-int server_fd, control_fd;
+struct watch listener;
+struct session * sessions;
+int root_fd;
+int heartbeat_fd = -1;
+int engine = LOOP_EPOLL;
+int flush_policy = FLUSH_NONE;
+int control_port = CONTROL_PORT;
+long long link_rate = 0;
+char * congestion = TUNE_CONGESTION;
+int worker_count = 1;
+char * limits_path;
+struct shape_rules limits;
+struct bucket total_bucket;
+struct transfer * waiting;
+struct transfer * waiting_tail;
+volatile sig_atomic_t reload_pending;
 
 int main(int argc, char * argv[]) {
+    int opt, workers = 1;
+
+    //Parse options:
+    while((opt = getopt(argc, argv, "w:e:f:p:r:C:l:")) != -1) {
+        if(opt == 'w' && (workers = atoi(optarg)) >= 0) {
+            continue;
+        }
+        if(opt == 'e' && (strcmp(optarg, "epoll") == 0 || strcmp(optarg, "uring") == 0)) {
+            engine = strcmp(optarg, "uring") == 0 ? LOOP_URING : LOOP_EPOLL;
+            continue;
+        }
+        if(opt == 'f' && (strcmp(optarg, "none") == 0 || strcmp(optarg, "data") == 0 || strcmp(optarg, "all") == 0)) {
+            flush_policy = strcmp(optarg, "all") == 0 ? FLUSH_ALL : strcmp(optarg, "data") == 0 ? FLUSH_DATA : FLUSH_NONE;
+            continue;
+        }
+        if(opt == 'p' && (control_port = atoi(optarg)) > 0 && control_port <= 65535) {
+            continue;
+        }
+        if(opt == 'r' && (link_rate = tune_parse_rate(optarg)) > 0) {
+            continue;
+        }
+        if(opt == 'C' && strlen(optarg) < TUNE_NAME_SIZE) {
+            congestion = optarg;
+            continue;
+        }
+        if(opt == 'l') {
+            limits_path = optarg;
+            continue;
+        }
+        printf("Usage:\n\t%s [-w <workers>] [-e epoll|uring] [-f none|data|all] [-p <port>] [-r <rate>] [-C <congestion>] [-l <limits file>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if(workers == 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    worker_count = workers > 1 ? workers : 1;
+
+    //Read the rate limits (before forking, so a bad file stops the server):
+    if(limits_path != NULL && shape_load(limits_path, &limits) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    //Allow as many concurrent sessions as descriptors permit:
+    raise_fd_limit();
+
+    //Every session starts in the server's working directory:
+    if((root_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        perror("Error opening working directory");
+        exit(EXIT_FAILURE);
+    }
+
+    //Serve from this process, or from supervised workers:
+    if(workers <= 1) {
+        serve(-1);
+    }
+    else {
+        run_supervisor(workers, serve);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Runs the server's event loop.  Used directly, or as the body of each worker.
+ * Param:   int beat_fd -  Descriptor to send heartbeats to the supervisor over,
+ *      or -1 when running without a supervisor
+ * Return:  void (never returns)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void serve(int beat_fd) {
 
     //Install signal handlers:
     install_sigint_handler();
 
-    //Start the server:
-    server_fd = start_server();
+    //Start the server (workers share the port):
+    heartbeat_fd = beat_fd;
+    if(loop_init(engine) == LOOP_URING && heartbeat_fd == -1) {
+        printf("Using io_uring\n");
+    }
+    loop_listen(&listener, start_server(heartbeat_fd != -1), accept_session);
+    loop_set_tick(HEARTBEAT_INTERVAL, server_tick);
+    apply_limits();
+
+    //Handle connections as they become ready:
+    loop_run();
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Periodic handler: gives transfers waiting under a rate limit their turns
+ *      (it runs every SHAPE_INTERVAL ms while any are waiting), reloads the
+ *      limits after a sighup, reports to the supervisor (when there is one),
+ *      and prints the file cache's counters if it has been used since they
+ *      were last printed
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void server_tick(void) {
+    static long long reported_at, reported_lookups, beat_at;
+    struct cache_stats stats;
+    char summary[BUF_SIZE];
+
+    if(waiting != NULL) {
+        dispatch_waiting();
+    }
+    if(reload_pending) {
+        reload_pending = 0;
+        reload_limits();
+    }
+
+    if(heartbeat_fd != -1 && loop_now_ms() - beat_at >= HEARTBEAT_INTERVAL / 2) {
+        send_heartbeat(heartbeat_fd);
+        beat_at = loop_now_ms();
+    }
+
+    cache_get_stats(&stats);
+    if(loop_now_ms() - reported_at >= CACHE_REPORT_INTERVAL && stats.hits + stats.misses != reported_lookups) {
+        cache_summary(summary, sizeof(summary));
+        printf("File cache: %s\n", summary);
+        reported_at = loop_now_ms();
+        reported_lookups = stats.hits + stats.misses;
+    }
+}
+
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Creates a passive, non-blocking socket that listens on the control port
+ *      (CONTROL_PORT unless "-p" says otherwise)
+ * Param:   int shared -  Nonzero to share the port with other workers, letting
+ *      the kernel spread incoming connections across them (SO_REUSEPORT)
+ * Return:  int -  File descriptor of the passive socket
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int start_server(int shared) {
+    int fd, reuse = 1;
+
+    fd = create_socket();
+    if(shared && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1) {
+        perror("Error sharing the control port");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    bind_socket(fd, control_port);
+    listen_socket(fd);
+    set_nonblocking(fd);
+
+    if(!shared) {
+        printf("Server started\n");
+        printf("Listening for incoming connections...\n");
+    }
+
+    return fd;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Raises the open file limit as far as the hard limit allows
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void raise_fd_limit(void) {
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Handler for the listening socket.  Starts a session for every accepted connection.
+ * Param:   struct watch * w -  The listening socket's watch
+ * Param:   int fd -  The new (non-blocking) control connection, or -1 if a
+ *      connection could not be accepted (errno is set)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void accept_session(struct watch * w, int fd) {
+
+    if(fd != -1) {
+        session_open(fd);
+        return;
+    }
+
+    //Out of resources: keep serving the sessions we have
+    perror("Error accepting incoming connection");
+    if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+        return;
+    }
+
+    close(w->fd);
+    exit(EXIT_FAILURE);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Starts a new client session on an accepted control connection
+ * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Return:  struct session * -  The new session, or NULL if it could not be created
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct session * session_open(int ctrl_fd) {
+    struct session * s;
+    char address[INET_ADDRSTRLEN], summary[BUF_SIZE];
+    struct stat st;
+    socklen_t length;
+
+    if((s = calloc(1, sizeof(*s))) == NULL || (s->dir_fd = dup(root_fd)) == -1 || fstat(s->dir_fd, &st) == -1) {
+        perror("Error creating session");
+        if(s != NULL && s->dir_fd > 0) {
+            close(s->dir_fd);
+        }
+        free(s);
+        close(ctrl_fd);
+        return NULL;
+    }
+    s->dir_dev = st.st_dev;
+    s->dir_ino = st.st_ino;
+    s->state = SESSION_COMMAND;
+    s->status = STATUS_OK;
+    s->channel.fd = -1;
+    s->opened_ns = xfer_clock_ns();
+    length = sizeof(s->peer);
+    getpeername(ctrl_fd, (struct sockaddr *) &s->peer, &length);
+    inet_ntop(AF_INET, &s->peer.sin_addr, address, sizeof(address));
+    printf("Connection accepted: %s\n", address);
+
+    //Replies are already gathered into one write each (see session_flush()),
+    //so don't let Nagle's algorithm hold them back waiting for an ack:
+    tune_control(ctrl_fd);
+
+    //Size the session's data connections to its path:
+    tune_measure(&s->tuning, ctrl_fd, link_rate, congestion);
+    tune_summary(&s->tuning, summary, sizeof(summary));
+    printf("Tuning: %s\n", summary);
+
+    //Find its rate limit, if there is one:
+    session_limit(s);
+    if(limits_path != NULL) {
+        shape_summary(s->bucket.rate, s->weight, summary, sizeof(summary));
+        printf("Rate limit: %s\n", summary);
+    }
+    ring_init(&s->in, RING_SIZE, RING_SIZE);
+    ring_init(&s->out, RING_SIZE, SESSION_OUT_LIMIT);
+
+    //Add to the list of sessions:
+    s->next = sessions;
+    if(sessions != NULL) {
+        sessions->prev = s;
+    }
+    sessions = s;
+
+    //Commands and replies go ahead of data that became ready at the same time:
+    s->ctrl.priority = 1;
+    loop_add(&s->ctrl, ctrl_fd, WATCH_READ, session_ready);
+
+    //Display greeting and instructions:
+    session_send(s, "Welcome to Nathan's File Transfer Program\nCommands:\n\t");
+    session_send(s, "exit\t- end the ftp session\n\t");
+    session_send(s, "pwd\t- print working directory\n\t");
+    session_send(s, "list [-l|-m] [--limit <n>] [--cursor <c>]\t- view files in current directory (-l: details, -m: machine-readable)\n\t");
+    session_send(s, "cd <directory>\t- change directory\n\t");
+    session_send(s, "get <filename> [<offset> [<length>]]\t- get the specified file (or part of it)\n\t");
+    session_send(s, "get -j <n> <filename>\t- get a file over n parallel data connections\n\t");
+    session_send(s, "get -r <directory>\t- get a directory and everything in it\n\t");
+    session_send(s, "mget <pattern>\t- get every file matching a pattern (e.g. *.txt)\n\t");
+    session_send(s, "put <filename>\t- upload a file\n\t");
+    session_send(s, "size <filename>\t- show the size of a file\n\t");
+    session_send(s, "sum <filename> [<offset> [<length>]]\t- show the CRC32C checksum of a file (or part of it)\n\t");
+    session_send(s, "sync <filename>\t- update a local copy of a file, sending only what changed\n\t");
+    session_send(s, "stats\t- show this session's transfer statistics\n\t");
+    session_send(s, "passive\t- toggle passive mode (client connects for data)\n\t");
+    session_send(s, "mux\t- toggle a multiplexed data channel shared by all transfers\n\t");
+    session_send(s, "compress\t- toggle compression of transfers\n\t");
+    session_send(s, "binary\t- toggle the binary control protocol (for programs)\n");
+    session_prompt(s);
+    session_flush(s);
+
+    return s;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Event handler for a session's control connection
+ * Param:   struct watch * w -  The control connection's watch
+ * Param:   unsigned int events -  Events that occurred
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void session_ready(struct watch * w, unsigned int events) {
+    struct session * s = (struct session *) w;
+
+    if(events & EPOLLERR) {
+        session_close(s);
+        return;
+    }
+
+    if(events & WATCH_WRITE) {
+        session_flush(s);
+    }
+
+    if(s->state != SESSION_CLOSED && (events & (WATCH_READ | EPOLLHUP))) {
+        session_read(s);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads whatever the client has sent and handles any complete commands
+ * Param:   struct session * s -  The session
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void session_read(struct session * s) {
+    ssize_t num_read;
+
+    //Pull in as much as the kernel has (stops while the ring is full):
+    while(ring_space(&s->in) > 0) {
+        if((num_read = ring_fill(&s->in, s->ctrl.fd)) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("Error reading from socket");
+            session_close(s);
+            return;
+        }
+
+        //Connection closed by client:
+        if(num_read == 0) {
+            session_close(s);
+            printf("Connection closed by client\n");
+            return;
+        }
+    }
+
+    handle_request(s);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Queues a message for the client.  Queued messages are sent together by
+ *      session_flush(), so a multi-part reply costs a single write.  In
+ *      binary mode each message goes out as a FRAME_DATA frame.
+ * Param:   struct session * s -  The session
+ * Param:   char * message -  Message to send
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void session_send(struct session * s, char * message) {
+    char header[FRAME_HEADER_SIZE];
+    size_t length = strlen(message);
+
+    if(s->state == SESSION_CLOSED) {
+        return;
+    }
+
+    if(s->binary) {
+        frame_pack(header, 0, FRAME_DATA, 0, length);
+    }
+    if((s->binary && ring_write(&s->out, header, FRAME_HEADER_SIZE) == -1) ||
+        ring_write(&s->out, message, length) == -1) {
+        printf("Closing session: too much unsent output\n");
+        session_close(s);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Queues an error message, and notes the status it gives the reply
+ * Param:   struct session * s -  The session
+ * Param:   int status -  The status (one of the STATUS_ codes)
+ * Param:   char * message -  Message to send
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void session_error(struct session * s, int status, char * message) {
+
+    session_status(s, status);
+    session_send(s, message);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Notes the status of the reply being sent (the first error sticks)
+ * Param:   struct session * s -  The session
+ * Param:   int status -  The status (one of the STATUS_ codes)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void session_status(struct session * s, int status) {
+
+    if(s->status == STATUS_OK) {
+        s->status = status;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Ends a reply: with the prompt in text mode, or with a FRAME_END frame
+ *      carrying its status in binary mode
+ * Param:   struct session * s -  The session
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void session_prompt(struct session * s) {
+    char header[FRAME_HEADER_SIZE];
+
+    if(s->binary && s->state != SESSION_CLOSED) {
+        frame_pack(header, 0, FRAME_END, s->status, 0);
+        if(ring_write(&s->out, header, FRAME_HEADER_SIZE) == -1) {
+            printf("Closing session: too much unsent output\n");
+            session_close(s);
+        }
+    }
+    else {
+        session_send(s, PROMPT);
+    }
+    s->status = STATUS_OK;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Writes queued output to the control connection without blocking
+ * Param:   struct session * s -  The session
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void session_flush(struct session * s) {
+
+    if(s->state == SESSION_CLOSED) {
+        return;
+    }
+
+    while(ring_used(&s->out) > 0) {
+        if(ring_flush(&s->out, s->ctrl.fd) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("Error writing message");
+            session_close(s);
+            return;
+        }
+    }
+
+    session_watch(s);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Updates which events the control connection is watched for: reading stops
+ *      while the input buffer is full (e.g. commands queued behind a transfer),
+ *      and writing is watched while output is waiting for the socket to drain
+ * Param:   struct session * s -  The session
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void session_watch(struct session * s) {
+
+    if(s->state != SESSION_CLOSED) {
+        loop_modify(&s->ctrl, (ring_space(&s->in) > 0 ? WATCH_READ : 0) | (ring_used(&s->out) > 0 ? WATCH_WRITE : 0));
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Ends a session, abandoning any transfer in progress
+ * Param:   struct session * s -  The session
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void session_close(struct session * s) {
+    struct transfer * t;
+
+    if(s->state == SESSION_CLOSED) {
+        return;
+    }
+    s->state = SESSION_CLOSED;
+
+    //Abandon the transfer and the multiplexed channel:
+    while((t = s->transfer) != NULL) {
+        s->transfer = t->next;
+        release_transfer(t);
+    }
+    loop_close(&s->channel);
+    sync_free(s->sync);
+    s->sync = NULL;
+
+    //Remove from the list of sessions:
+    if(s->prev != NULL) {
+        s->prev->next = s->next;
+    }
+    else {
+        sessions = s->next;
+    }
+    if(s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+
+    loop_close(&s->ctrl);
+    close(s->dir_fd);
+    ring_free(&s->in);
+    ring_free(&s->out);
+    loop_free_later(s);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Handles the client's buffered commands until one of them
+ *      starts a transfer or no complete command remains
+ * Param:   struct session * s -  The session
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void handle_request(struct session * s) {
+    int command;
+    char line[BUF_SIZE + 1], arg[BUF_SIZE];
+    off_t offset, length;
+    int stripes, count;
+
+    //Take in the rest of a sync's signatures first:
+    if(s->state == SESSION_SIGNATURES) {
+        read_signatures(s);
+        if(s->state == SESSION_COMMAND) {
+            session_prompt(s);
+        }
+    }
+
+    //Get user's command choice:
+    while(s->state == SESSION_COMMAND && (command = get_command(s, line, arg)) != NO_COMMAND) {
+        s->commands++;
+
+        //Perform appropriate response:
+        switch(command) {
+            case EXIT:
+                session_close(s);
+                printf("Connection closed by client\n");
+                return;
+
+            case INVALID:
+                session_error(s, STATUS_INVALID_COMMAND, "Invalid command\n");
+                break;
+
+            case LIST:
+                list_directories(s, line);
+                break;
+
+            case GET:
+                if(parse_recursive(line, arg) == 1) {
+                    send_tree(s, arg);
+                    break;
+                }
+                if((stripes = parse_stripes(line, &count, arg)) == 1) {
+                    send_stripes(s, arg, count);
+                    break;
+                }
+                if(stripes == -1 || parse_range(line, &offset, &length) == -1) {
+                    offset = -1;
+                }
+                send_file(s, arg, offset, length);
+                break;
+
+            case SIZE:
+                show_size(s, arg);
+                break;
+
+            case SUM:
+                if(parse_range(line, &offset, &length) == -1) {
+                    session_error(s, STATUS_INVALID_ARGUMENT, "Error: invalid arguments\n");
+                    break;
+                }
+                show_sum(s, arg, offset, length);
+                break;
+
+            case MGET:
+                send_batch(s, arg);
+                break;
+
+            case SYNC:
+                start_sync(s, line, arg);
+                break;
+
+            case PUT:
+                receive_upload(s, line, arg);
+                break;
+
+            case STATS:
+                show_stats(s);
+                break;
+
+            case CD:
+                change_directory(s, arg);
+                break;
+
+            case PWD:
+                show_cwd(s);
+                break;
+
+            case PASSIVE:
+                s->passive = !s->passive;
+                session_send(s, s->passive ? "Passive mode on\n" : "Passive mode off\n");
+                break;
+
+            case MUX:
+                toggle_channel(s);
+                break;
+
+            case COMPRESS:
+                s->compress = !s->compress;
+                session_send(s, s->compress ? "Compression on\n" : "Compression off\n");
+                break;
+
+            //The reply is sent in the protocol the command arrived in, and
+            //everything after it in the other one:
+            case BINARY:
+                session_send(s, s->binary ? "Binary control protocol off\n" : "Binary control protocol on\n");
+                session_prompt(s);
+                s->binary = !s->binary;
+                continue;
+
+        }
+
+        //Prompt for the next command (transfers prompt once they finish):
+        if(s->state == SESSION_COMMAND) {
+            session_prompt(s);
+        }
+    }
+
+    //Send all the replies together:
+    session_flush(s);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Takes a single user's command (or binary request) from the session's input buffer, and returns the command type
+ * Param:   struct session * s -  The session
+ * Param:   char * buffer -  Buffer of BUF_SIZE + 1 bytes to store the raw command
+ * Param:   char * arg -  Buffer to store any arguments sent with the command
+ * Return:  int -  Command type identifier, or NO_COMMAND if no complete command has arrived
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int get_command(struct session * s, char * buffer, char * arg) {
+    char header[REQUEST_HEADER_SIZE], payload[REQUEST_MAX];
+    unsigned int opcode, count, size;
+    int length;
+
+    //In binary mode, take the next whole request (see request_encode()):
+    if(s->binary) {
+        if(ring_peek(&s->in, header, REQUEST_HEADER_SIZE) < REQUEST_HEADER_SIZE) {
+            return NO_COMMAND;
+        }
+        request_unpack(header, &opcode, &count, &size);
+        if(size > REQUEST_MAX) {
+            printf("Closing session: invalid request\n");
+            session_close(s);
+            return NO_COMMAND;
+        }
+        if(ring_used(&s->in) < REQUEST_HEADER_SIZE + size) {
+            return NO_COMMAND;
+        }
+        ring_read(&s->in, header, REQUEST_HEADER_SIZE);
+        ring_read(&s->in, payload, size);
+        return request_decode(opcode, count, payload, size, buffer, arg);
+    }
+
+    //Take the next non-blank line:
+    while((length = ring_getline(&s->in, buffer, BUF_SIZE - 1)) == 0);
+
+    if(length == RING_NO_LINE) {
+        return NO_COMMAND;
+    }
+    if(length == RING_LONG_LINE) {
+        buffer[0] = '\0';
+        return INVALID;
+    }
+
+    buffer[length] = '\n';
+    buffer[length + 1] = '\0';
+
+    return parse_command(buffer, arg);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sends a list of all files in the session's current directory over a data
+ *      connection (or stream).  The entries are read in bulk and formatted a
+ *      batch at a time as the connection drains (see batch_next_entries()),
+ *      so even huge directories are listed in bounded memory.
+ * Param:   struct session * s -  The session
+ * Param:   char * request -  The raw command: "list [-l|-m] [--limit <n>]
+ *      [--cursor <c>]" (-l gives type, size and modification time, -m gives
+ *      machine-readable facts, and --limit/--cursor list a page at a time)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void list_directories(struct session * s, char * request) {
+    struct transfer * t;
+    struct batch * b = NULL;
+    char * error = NULL;
+    int format, fd = -1, status = STATUS_OK;
+    long limit;
+    off_t cursor;
+
+    if(parse_list(request, &format, &limit, &cursor) == -1) {
+        error = "Error: invalid arguments\n";
+        status = STATUS_INVALID_ARGUMENT;
+    }
+
+    //Open the directory again so the listing has its own read position:
+    else if((fd = openat(s->dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+        (b = calloc(1, sizeof(*b))) == NULL) {
+        perror("Error opening directory");
+        error = "Error: could not open directory\n";
+        status = STATUS_FAILED;
+    }
+
+    //Pick up where the previous page stopped:
+    else if(cursor > 0 && lseek(fd, cursor, SEEK_SET) == -1) {
+        error = "Error: invalid cursor\n";
+        status = STATUS_INVALID_ARGUMENT;
+    }
+
+    //The client is waiting for a data connection (or stream) either way:
+    if((t = data_connect(s)) != NULL && error == NULL) {
+        b->next = batch_next_entries;
+        b->dir_fd = fd;
+        b->format = format;
+        b->limit = limit;
+        if(s->compress) {
+            transfer_compress(t);
+        }
+        else if(!t->stream) {
+            ring_init(&t->pending, RING_SIZE, PENDING_LIMIT);
+        }
+        t->batch = b;
+        return;
+    }
+
+    if(t != NULL) {
+        t->status = FRAME_ERROR;
+    }
+    if(fd != -1) {
+        close(fd);
+    }
+    free(b);
+    if(error != NULL) {
+        session_error(s, status, error);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Batch producer for listings: formats the directory's next entries (as
+ *      many as fit in one frame) and queues them.  A listing with a limit
+ *      ends by sending "CURSOR <c>" on the control connection, where c
+ *      resumes the listing after the last entry sent (0 once the whole
+ *      directory has been listed).
+ * Param:   struct transfer * t -  The listing's transfer
+ * Return:  int -  1 if more was queued, 0 once the whole listing has been sent
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int batch_next_entries(struct transfer * t) {
+    struct batch * b = t->batch;
+    struct dirent64 * entry;
+    char out[FRAME_READ_SIZE], message[BUF_SIZE];
+    size_t length = 0, formatted;
+    ssize_t n;
+    int done = 0;
+
+    if(b->entries == NULL && (b->entries = malloc(LIST_READ_SIZE)) == NULL) {
+        perror("Error allocating memory");
+        t->status = FRAME_ERROR;
+        return 0;
+    }
+
+    while(!b->finished && length + LIST_LINE_MAX <= sizeof(out)) {
+
+        //End of the page:
+        if(b->limit > 0 && b->sent == b->limit) {
+            done = 1;
+            break;
+        }
+
+        //Read the next batch of entries straight from the kernel:
+        if(b->entries_pos == b->entries_len) {
+            while((n = getdents64(b->dir_fd, b->entries, LIST_READ_SIZE)) == -1 && errno == EINTR);
+            if(n <= 0) {
+                if(n == -1) {
+                    perror("Error reading directory");
+                    t->status = FRAME_ERROR;
+                }
+                b->cursor = 0;
+                done = 1;
+                break;
+            }
+            b->entries_len = n;
+            b->entries_pos = 0;
+        }
+
+        entry = (struct dirent64 *) (b->entries + b->entries_pos);
+        b->entries_pos += entry->d_reclen;
+        if((formatted = format_entry(b->dir_fd, b->format, entry, out + length, sizeof(out) - length)) > 0) {
+            length += formatted;
+            b->sent++;
+            b->cursor = entry->d_off;
+        }
+    }
+
+    if(done) {
+        b->finished = 1;
+        if(b->format == LIST_NAMES) {
+            out[length++] = '\n';
+        }
+        if(b->limit > 0) {
+            snprintf(message, BUF_SIZE, "CURSOR %lld\n", (long long) b->cursor);
+            session_send(t->session, message);
+        }
+    }
+
+    if(length == 0) {
+        return 0;
+    }
+    transfer_data(t, out, length);
+    return 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Formats one directory entry for a listing.  Names alone are separated by
+ *      two spaces; the other formats give a line per entry, e.g.
+ *          -rw-r--r--        1234 2013-11-17 09:30 notes.txt
+ *          type=file;size=1234;modify=20131117173000;UNIX.mode=0644; notes.txt
+ * Param:   int dir_fd -  The directory being listed
+ * Param:   int format -  LIST_NAMES, LIST_LONG or LIST_MACHINE
+ * Param:   struct dirent64 * entry -  The entry
+ * Param:   char * buf -  Buffer to format it into
+ * Param:   size_t size -  Size of the buffer (at least LIST_LINE_MAX)
+ * Return:  size_t -  Length of the formatted entry (0 for "." and "..", and
+ *      for entries that have disappeared)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+size_t format_entry(int dir_fd, int format, struct dirent64 * entry, char * buf, size_t size) {
+    struct statx st;
+    struct tm when;
+    time_t seconds;
+    char date[32], mode[11], * type;
+    int i;
+
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        return 0;
+    }
+    if(format == LIST_NAMES) {
+        return snprintf(buf, size, "%s  ", entry->d_name);
+    }
+
+    //Only the details that are shown are asked for:
+    if(statx(dir_fd, entry->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+        STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME, &st) == -1) {
+        return 0;
+    }
+    seconds = st.stx_mtime.tv_sec;
+
+    //File type, as a fact and as the first letter of the mode:
+    switch(st.stx_mode & S_IFMT) {
+        case S_IFREG:
+            type = "file";
+            mode[0] = '-';
+            break;
+
+        case S_IFDIR:
+            type = "dir";
+            mode[0] = 'd';
+            break;
+
+        case S_IFLNK:
+            type = "OS.unix=symlink";
+            mode[0] = 'l';
+            break;
+
+        case S_IFIFO:
+            type = "OS.unix=fifo";
+            mode[0] = 'p';
+            break;
+
+        case S_IFSOCK:
+            type = "OS.unix=socket";
+            mode[0] = 's';
+            break;
+
+        case S_IFCHR:
+            type = "OS.unix=chr";
+            mode[0] = 'c';
+            break;
+
+        case S_IFBLK:
+            type = "OS.unix=blk";
+            mode[0] = 'b';
+            break;
+
+        default:
+            type = "OS.unix=unknown";
+            mode[0] = '?';
+            break;
+    }
+
+    //Modification times are local for people and UTC for programs:
+    if(format == LIST_LONG) {
+        for(i=0; i<9; i++) {
+            mode[i + 1] = (st.stx_mode & (0400 >> i)) ? "rwxrwxrwx"[i] : '-';
+        }
+        mode[10] = '\0';
+        localtime_r(&seconds, &when);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &when);
+        return snprintf(buf, size, "%s %12llu %s %s\n", mode, (unsigned long long) st.stx_size, date, entry->d_name);
+    }
+
+    gmtime_r(&seconds, &when);
+    strftime(date, sizeof(date), "%Y%m%d%H%M%S", &when);
+    return snprintf(buf, size, "type=%s;size=%llu;modify=%s;UNIX.mode=%04o; %s\n",
+        type, (unsigned long long) st.stx_size, date, st.stx_mode & 07777, entry->d_name);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Starts a transfer to the client.  With a multiplexed data channel open the
+ *      transfer becomes the channel's next stream; otherwise a non-blocking
+ *      data connection is opened with a listening client (or, in passive mode,
+ *      the server waits for the client to connect).  The session waits until
+ *      the transfer's payload (see transfer_body()) has been sent.
+ * Param:   struct session * s -  The session
+ * Return:  struct transfer * -  The new transfer, or NULL if the connection failed
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct transfer * data_connect(struct session * s) {
+    struct sockaddr_in address;
+    struct transfer * t;
+    int data_fd;
+
+    if(s->channel.fd != -1) {
+        return data_stream(s);
+    }
+    if(s->passive) {
+        return data_listen(s);
+    }
+
+    //Connect to the client's data port:
+    address = s->peer;
+    address.sin_port = htons(DATA_PORT);
+
+    //Create a new socket:
+    if((data_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, PROTOCOL)) == -1 ||
+        (t = calloc(1, sizeof(*t))) == NULL) {
+        perror("Error opening data connection");
+        session_error(s, STATUS_FAILED, "Error: could not open data connection\n");
+        if(data_fd != -1) {
+            close(data_fd);
+        }
+        return NULL;
+    }
+    tune_apply(&s->tuning, data_fd);
+
+    //Connect to peer via that socket (completes once it becomes writable):
+    if(connect(data_fd, (struct sockaddr *) &address, sizeof(address)) == -1 && errno != EINPROGRESS) {
+        perror("Error opening data connection");
+        session_error(s, STATUS_FAILED, "Error: could not open data connection\n");
+        close(data_fd);
+        free(t);
+        return NULL;
+    }
+
+    t->session = s;
+    t->file_fd = -1;
+    loop_add(&t->data, data_fd, WATCH_WRITE, transfer_ready);
+
+    transfer_attach(s, t);
+
+    return t;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Passive mode: listens on an ephemeral port and tells the client which port
+ *      to connect to ("PASV <port>").  The transfer starts once it connects.
+ * Param:   struct session * s -  The session
+ * Return:  struct transfer * -  The new transfer, or NULL if no port could be opened
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct transfer * data_listen(struct session * s) {
+    struct sockaddr_in address;
+    struct transfer * t = NULL;
+    char message[BUF_SIZE];
+    int passive_fd;
+    unsigned int length;
+
+    //Listen on the address the client reached us at, on any free port (the
+    //connection accepted inherits the session's tuning from the socket):
+    length = sizeof(address);
+    if((passive_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, PROTOCOL)) == -1 ||
+        getsockname(s->ctrl.fd, (struct sockaddr *) &address, &length) == -1 ||
+        (address.sin_port = 0, tune_apply(&s->tuning, passive_fd), bind(passive_fd, (struct sockaddr *) &address, sizeof(address))) == -1 ||
+        listen(passive_fd, 1) == -1 ||
+        getsockname(passive_fd, (struct sockaddr *) &address, &length) == -1 ||
+        (t = calloc(1, sizeof(*t))) == NULL) {
+        perror("Error opening passive data port");
+        session_error(s, STATUS_FAILED, "Error: could not open data connection\n");
+        if(passive_fd != -1) {
+            close(passive_fd);
+        }
+        return NULL;
+    }
+
+    t->session = s;
+    t->file_fd = -1;
+    t->listening = 1;
+    loop_add(&t->data, passive_fd, WATCH_READ, transfer_ready);
+
+    transfer_attach(s, t);
+
+    //Tell the client where to connect:
+    snprintf(message, BUF_SIZE, "PASV %u\n", ntohs(address.sin_port));
+    session_send(s, message);
+
+    return t;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Multiplexed mode: starts a new stream on the session's data channel and
+ *      tells the client its id ("STREAM <id>").  The channel is handed to the
+ *      transfer until the stream's END frame has been sent.
+ * Param:   struct session * s -  The session
+ * Return:  struct transfer * -  The new transfer, or NULL if out of memory
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct transfer * data_stream(struct session * s) {
+    struct transfer * t;
+    char message[BUF_SIZE];
+
+    if((t = calloc(1, sizeof(*t))) == NULL) {
+        perror("Error allocating memory");
+        session_error(s, STATUS_FAILED, "Error: could not open data connection\n");
+        return NULL;
+    }
+
+    //Stream ids start at 1 and skip 0, which means "not multiplexed":
+    if(++s->next_stream == 0) {
+        s->next_stream = 1;
+    }
+
+    t->session = s;
+    t->file_fd = -1;
+    t->connected = 1;
+    t->stream = s->next_stream;
+    ring_init(&t->pending, RING_SIZE, PENDING_LIMIT);
+    loop_add(&t->data, loop_remove(&s->channel), WATCH_WRITE, transfer_ready);
+
+    transfer_attach(s, t);
+
+    snprintf(message, BUF_SIZE, "STREAM %u\n", t->stream);
+    session_send(s, message);
+
+    return t;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Gives a transfer a file to send (replacing the previous one, if it has
+ *      been sent).  Over a multiplexed channel the file is
+ *      cut into DATA frames of at most FRAME_MAX bytes; files of unknown
+ *      length (pipes, devices) are read into memory a frame at a time.
+ *      Compressed transfers read every file a block at a time instead (see
+ *      transfer_read_block()).  A file the cache holds in memory (set
+ *      t->cached first) is sent from there.
+ * Param:   struct transfer * t -  The transfer
+ * Param:   int file_fd -  File to send (closed along with the transfer)
+ * Param:   off_t offset -  Offset of the first byte to send
+ * Param:   off_t length -  Number of bytes to send, or XFER_UNTIL_EOF if not known
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void transfer_body(struct transfer * t, int file_fd, off_t offset, off_t length) {
+    struct cache_entry * e = t->cached;
+
+    //A batch sends its files one after another (a sync sends several parts
+    //of the same one):
+    if(file_fd != t->file_fd) {
+        transfer_close_file(t);
+    }
+    else {
+        xfer_close(&t->x);
+    }
+
+    t->file_fd = file_fd;
+    if(t->stream && !t->codec.enabled) {
+        t->body_left = length;
+        length = 0;
+    }
+
+    if(e != NULL && e->data != NULL) {
+        xfer_init_memory(&t->x, t->data.fd, e->data, e->st.st_size, offset, length);
+    }
+    else {
+        xfer_init(&t->x, t->data.fd, file_fd, offset, length);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Closes the file a transfer has been sending (or gives it back to the cache)
+ * Param:   struct transfer * t -  The transfer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void transfer_close_file(struct transfer * t) {
+
+    if(t->file_fd == -1) {
+        return;
+    }
+
+    xfer_close(&t->x);
+    if(t->cached != NULL) {
+        cache_release(t->cached);
+        t->cached = NULL;
+    }
+    else {
+        close(t->file_fd);
+    }
+    t->file_fd = -1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Adds what has been sent of a file so far to the transfer's checksum.  The
+ *      data is read back from the page cache (or taken from the cache's copy)
+ *      after it has been sent, so sendfile() and splice() are left as they are.
+ * Param:   struct transfer * t -  The transfer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void transfer_sum(struct transfer * t) {
+    struct cache_entry * e = t->cached;
+    off_t sent, n;
+
+    //(A sync checksums the file as it reads it for the comparison)
+    if(!t->summing || t->file_fd == -1 || (t->batch != NULL && t->batch->sync != NULL)) {
+        return;
+    }
+
+    sent = t->x.offset < t->sum_end ? t->x.offset : t->sum_end;
+    if(t->summed >= sent) {
+        return;
+    }
+
+    if(e != NULL && e->data != NULL) {
+        t->sum = sum_crc32c(t->sum, e->data + t->summed, sent - t->summed);
+        t->summed = sent;
+    }
+    else if((n = sum_file(t->file_fd, t->summed, sent - t->summed, &t->sum)) > 0) {
+        t->summed += n;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads part of the file a transfer is sending, from the cache's copy of it
+ *      if there is one
+ * Param:   struct transfer * t -  The transfer
+ * Param:   char * buf -  Buffer to read into
+ * Param:   size_t count -  Most bytes to read
+ * Param:   off_t offset -  Where to read from (ignored for pipes)
+ * Return:  ssize_t -  Bytes read, 0 at the end of the file, or -1 on error
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+ssize_t transfer_pread(struct transfer * t, char * buf, size_t count, off_t offset) {
+    struct cache_entry * e = t->cached;
+    ssize_t n;
+
+    if(e != NULL && e->data != NULL) {
+        if(offset >= e->st.st_size) {
+            return 0;
+        }
+        if((off_t) count > e->st.st_size - offset) {
+            count = e->st.st_size - offset;
+        }
+        memcpy(buf, e->data + offset, count);
+        return count;
+    }
+
+    while((n = pread(t->file_fd, buf, count, offset)) == -1 && errno == EINTR);
+    if(n == -1 && errno == ESPIPE) {
+        while((n = read(t->file_fd, buf, count)) == -1 && errno == EINTR);
+    }
+    return n;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Event handler for a data connection.  Completes the connection, then sends
+ *      the file a burst at a time whenever the socket can take more.
+ * Param:   struct watch * w -  The data connection's watch
+ * Param:   unsigned int events -  Events that occurred
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void transfer_ready(struct watch * w, unsigned int events) {
+    struct transfer * t = (struct transfer *) w;
+    struct session * s = t->session;
+    struct sockaddr_in address;
+    int error, data_fd, one = 1;
+    socklen_t length;
+
+    //Accept the client's connection (passive mode):
+    if(t->listening) {
+        length = sizeof(address);
+        if((data_fd = accept4(w->fd, (struct sockaddr *) &address, &length, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+                return;
+            }
+            perror("Error accepting incoming data connection");
+            session_error(s, STATUS_FAILED, "Error: could not open data connection\n");
+            finish_transfer(t);
+            return;
+        }
+
+        //Check that it's originating from the expected address:
+        if(address.sin_addr.s_addr != s->peer.sin_addr.s_addr) {
+            close(data_fd);
+            return;
+        }
+
+        //Swap the passive socket for the data connection:
+        loop_close(w);
+        loop_add(w, data_fd, WATCH_WRITE, transfer_ready);
+        t->listening = 0;
+        t->connected = 1;
+        transfer_cork(t);
+    }
+
+    //Finish connecting:
+    if(!t->connected) {
+        length = sizeof(error);
+        if(getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+            errno = error;
+            perror("Error opening data connection");
+            session_error(s, STATUS_FAILED, "Error: could not open data connection\n");
+            finish_transfer(t);
+            return;
+        }
+        t->connected = 1;
+        transfer_cork(t);
+    }
+
+    //A new multiplexed channel: keep the connection for the session (frames
+    //are written whole, so there is nothing for Nagle's algorithm to coalesce)
+    if(t->channel_setup) {
+        setsockopt(w->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        loop_add(&s->channel, loop_remove(w), WATCH_READ, channel_ready);
+        session_send(s, "Multiplexed data channel open\n");
+        finish_transfer(t);
+        return;
+    }
+
+    //Send the next burst of the file (or take in the next of an upload):
+    switch(t->upload != NULL ? transfer_receive(t) : transfer_pump(t)) {
+        case 0:
+            return;
+
+        case -1:
+            t->failed = 1;
+            break;
+    }
+
+    finish_transfer(t);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Corks a transfer's new data connection, so the headers written ahead of
+ *      a file leave in full segments with its first bytes (the rest is sent
+ *      when the connection closes).  Multiplexed channels, which stay open
+ *      between transfers, and uploads, which only receive, are left alone.
+ * Param:   struct transfer * t -  The transfer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void transfer_cork(struct transfer * t) {
+
+    if(!t->channel_setup && t->upload == NULL) {
+        tune_cork(t->data.fd, 1);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sends as much of a transfer as the data connection will take, up to
+ *      TRANSFER_BURST steps so other sessions get a turn
+ * Param:   struct transfer * t -  The transfer
+ * Return:  int -  1 once everything has been sent, 0 if there is more to
+ *      send, or -1 if the data connection failed
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int transfer_pump(struct transfer * t) {
+    ssize_t n;
+    int i;
+
+    t->x.out_fd = t->data.fd;
+    transfer_tune(t);
+
+    for(i=0; i<TRANSFER_BURST; i++) {
+
+        //Under a rate limit, send no more than the transfer has credit for:
+        if(transfer_throttled(t)) {
+            return 0;
+        }
+        t->x.step = session_shaped(t->session) ? t->credit : 0;
+
+        //Frame headers and buffered payload go first:
+        if(ring_used(&t->pending) > 0) {
+            xfer_stats_count(&t->stats, n = ring_flush(&t->pending, t->data.fd));
+            transfer_charge(t, n);
+        }
+        else if(t->file_fd != -1 && !xfer_done(&t->x)) {
+            if(t->codec.enabled) {
+                n = transfer_read_block(t);
+            }
+
+            //On io_uring, the loop sends the file and calls transfer_sent():
+            else if(transfer_submit(t)) {
+                return 0;
+            }
+            else {
+                xfer_stats_count(&t->stats, n = xfer_step(&t->x));
+                transfer_charge(t, n);
+            }
+        }
+        else if(transfer_next(t)) {
+            return 1;
+        }
+        else {
+            continue;
+        }
+
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("Error sending file");
+            return -1;
+        }
+    }
+
+    transfer_sum(t);
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Hands the next step of a transfer's file to the io_uring engine: a cached
+ *      copy is sent from memory (from its registered buffer), and a file is
+ *      spliced to the socket through the transfer's pipe.  Pipes and the
+ *      read/write copy are left to xfer_step().
+ * Param:   struct transfer * t -  The transfer
+ * Return:  int -  1 if the step was handed over, 0 if the caller should
+ *      make it
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int transfer_submit(struct transfer * t) {
+    struct xfer * x = &t->x;
+    size_t count;
+    off_t offset;
+
+    if(!loop_async()) {
+        return 0;
+    }
+
+    if(x->method == XFER_MEMORY) {
+        count = xfer_count(x, XFER_CHUNK);
+        if(x->offset >= x->data_len) {
+            return 0;
+        }
+        if((off_t) count > x->data_len - x->offset) {
+            count = x->data_len - x->offset;
+        }
+        loop_send(&t->data, x->data + x->offset, count, t->cached->buffer, transfer_sent);
+        return 1;
+    }
+
+    if((x->method != XFER_SENDFILE && x->method != XFER_SPLICE_PIPE) || xfer_pipe(x) == -1 || x->pipe_size == 0) {
+        return 0;
+    }
+
+    //Fill the pipe once it has drained (a pipe that cannot seek is read
+    //from where it is):
+    count = 0;
+    if(x->in_pipe == 0) {
+        count = xfer_count(x, x->pipe_size);
+    }
+    offset = x->method == XFER_SENDFILE || lseek(x->in_fd, 0, SEEK_CUR) != -1 ? x->offset : -1;
+    loop_splice(&t->data, x->in_fd, offset, x->pipe_fd, count, x->in_pipe, transfer_sent);
+    return 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Completion handler for a step handed to the io_uring engine (see
+ *      transfer_submit()).  Records what it moved and carries on with the
+ *      transfer; a transfer that was released meanwhile is freed now.
+ * Param:   struct watch * w -  The data connection's watch
+ * Param:   int filled -  Bytes moved from the file into the pipe
+ * Param:   int sent -  Bytes sent, or -errno if the step failed
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void transfer_sent(struct watch * w, int filled, int sent) {
+    struct transfer * t = (struct transfer *) w;
+
+    if(w->fd == -1) {
+        transfer_close_file(t);
+        loop_free_later(t);
+        return;
+    }
+
+    xfer_moved(&t->x, filled, sent);
+    xfer_stats_count(&t->stats, sent);
+    transfer_charge(t, sent);
+
+    if(filled < 0 || sent < 0) {
+        errno = filled < 0 ? -filled : -sent;
+        perror("Error sending file");
+        t->failed = 1;
+        finish_transfer(t);
+        return;
+    }
+
+    transfer_ready(w, WATCH_WRITE);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Measures the session's path from one of its transfers, and retunes the
+ *      session when the path turns out faster than its data connections
+ *      were sized for.  Data being sent is measured every TUNE_SAMPLE_BYTES
+ *      (see tune_sample()), and its own connection is retuned as it goes;
+ *      an upload is measured once it has all arrived (see tune_observe()).
+ * Param:   struct transfer * t -  The transfer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void transfer_tune(struct transfer * t) {
+    struct session * s = t->session;
+    char summary[BUF_SIZE];
+
+    if(t->upload != NULL) {
+        if(t->stats.first_ns == 0 || !tune_observe(&s->tuning, t->stats.bytes, t->stats.end_ns - t->stats.first_ns)) {
+            return;
+        }
+    }
+    else {
+        if(t->stats.bytes - t->tuned < TUNE_SAMPLE_BYTES) {
+            return;
+        }
+        t->tuned = t->stats.bytes;
+        if(!tune_sample(&s->tuning, t->data.fd, t->stats.bytes, xfer_clock_ns() - t->stats.first_ns)) {
+            return;
+        }
+        tune_apply(&s->tuning, t->data.fd);
+    }
+
+    tune_summary(&s->tuning, summary, sizeof(summary));
+    printf("Tuning: %s\n", summary);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Takes in as much of an upload as has arrived, up to TRANSFER_BURST steps,
+ *      moving it from the socket to the file through a pipe with splice(),
+ *      so it is never copied through the server
+ * Param:   struct transfer * t -  The transfer
+ * Return:  int -  1 once the client has closed the connection, 0 if there
+ *      is more to come, or -1 if the connection or the file failed
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int transfer_receive(struct transfer * t) {
+    struct upload * u = t->upload;
+    ssize_t n, written;
+    size_t count;
+    int i;
+
+    //Connected: wait for data rather than for room to send
+    if(!u->reading) {
+        loop_modify(&t->data, WATCH_READ);
+        u->reading = 1;
+    }
+
+    for(i=0; i<TRANSFER_BURST; i++) {
+
+        //Under a rate limit, take in no more than the transfer has credit for
+        //(the client is held back by the TCP window meanwhile):
+        if(transfer_throttled(t)) {
+            break;
+        }
+        count = session_shaped(t->session) && t->credit < UPLOAD_PIPE_SIZE ? t->credit : UPLOAD_PIPE_SIZE;
+
+        n = splice(t->data.fd, NULL, u->pipe_fd[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        xfer_stats_count(&t->stats, n);
+        transfer_charge(t, n);
+        if(n == 0) {
+            return 1;
+        }
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("Error receiving file");
+            return -1;
+        }
+
+        //Empty the pipe into place:
+        while(n > 0) {
+            if((written = splice(u->pipe_fd[0], NULL, u->file_fd, &u->received, n, SPLICE_F_MOVE)) == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                perror("Error writing file");
+                return -1;
+            }
+            n -= written;
+        }
+    }
+
+    upload_sum(u);
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Queues the next part of a transfer once the previous one has been sent.
+ *      Over a multiplexed channel that is the next DATA frame while the file
+ *      lasts; then a batch moves on to its next file; finally a multiplexed
+ *      transfer sends a single END frame carrying its status.
+ * Param:   struct transfer * t -  The transfer
+ * Return:  int -  1 if the transfer is complete, 0 if more was queued
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int transfer_next(struct transfer * t) {
+    char frame[FRAME_HEADER_SIZE + FRAME_READ_SIZE];
+    size_t length;
+    ssize_t n;
+
+    if(t->ended) {
+        return 1;
+    }
+
+    //The file shrank mid-transfer: pad out the promised length and report it
+    if((t->stream || t->batch) && t->file_fd != -1 && t->x.eof && t->x.remaining > 0) {
+        memset(frame, 0, sizeof(frame));
+        length = t->x.remaining < FRAME_READ_SIZE ? (size_t) t->x.remaining : FRAME_READ_SIZE;
+        if(t->codec.enabled) {
+            transfer_data(t, frame, length);
+        }
+        else {
+            ring_write(&t->pending, frame, length);
+        }
+        t->x.remaining -= length;
+        t->status = FRAME_ERROR;
+        t->body_left = 0;
+        return 0;
+    }
+
+    //Read small files (and the tail of large ones) straight into a frame, so
+    //a whole small file and what follows it go out in a single write:
+    if(t->stream && t->file_fd != -1 && t->body_left > 0 && t->body_left <= FRAME_READ_SIZE) {
+        if((n = transfer_pread(t, frame + FRAME_HEADER_SIZE, t->body_left, t->x.offset)) == -1) {
+            perror("Error reading file");
+            n = 0;
+        }
+
+        //The file shrank: pad it out to the size that was promised
+        if(n < t->body_left) {
+            memset(frame + FRAME_HEADER_SIZE + n, 0, t->body_left - n);
+            t->status = FRAME_ERROR;
+        }
+        frame_pack(frame, t->stream, FRAME_DATA, FRAME_OK, t->body_left);
+        ring_write(&t->pending, frame, FRAME_HEADER_SIZE + t->body_left);
+        t->x.offset += t->body_left;
+        t->body_left = 0;
+    }
+
+    //Frame the next part of a large file, and let xfer_step() send it:
+    else if(t->stream && t->file_fd != -1 && t->body_left > 0) {
+        length = t->body_left < FRAME_MAX ? (size_t) t->body_left : FRAME_MAX;
+        frame_pack(frame, t->stream, FRAME_DATA, FRAME_OK, length);
+        ring_write(&t->pending, frame, FRAME_HEADER_SIZE);
+        t->x.remaining = length;
+        t->body_left -= length;
+        return 0;
+    }
+
+    //Read the next part of a file of unknown size into a frame:
+    else if(t->stream && t->file_fd != -1 && t->body_left == XFER_UNTIL_EOF) {
+        if((n = read(t->file_fd, frame + FRAME_HEADER_SIZE, FRAME_READ_SIZE)) > 0) {
+            frame_pack(frame, t->stream, FRAME_DATA, FRAME_OK, n);
+            ring_write(&t->pending, frame, FRAME_HEADER_SIZE + n);
+            return 0;
+        }
+        if(n == -1 && errno == EINTR) {
+            return 0;
+        }
+        if(n == -1) {
+            perror("Error reading file");
+            t->status = FRAME_ERROR;
+        }
+        t->body_left = 0;
+    }
+
+    //Move on to the batch's next file:
+    if(t->batch != NULL && t->batch->next(t)) {
+        return 0;
+    }
+
+    //Send whatever a compressed transfer has gathered but not sent yet:
+    if(t->stage_len > 0) {
+        transfer_seal(t);
+        return 0;
+    }
+
+    //Plain connections end by closing:
+    if(t->stream == 0) {
+        return 1;
+    }
+
+    //Nothing left to send: close the stream
+    frame_pack(frame, t->stream, FRAME_END, t->status, 0);
+    ring_write(&t->pending, frame, FRAME_HEADER_SIZE);
+    t->ended = 1;
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Queues a small piece of data (e.g. a header) to be sent before the rest of
+ *      a transfer, as a DATA frame of its own over a multiplexed channel
+ * Param:   struct transfer * t -  The transfer
+ * Param:   const char * data -  Data to send
+ * Param:   size_t length -  Length of the data
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void transfer_data(struct transfer * t, const char * data, size_t length) {
+    char frame[FRAME_HEADER_SIZE];
+    size_t count;
+
+    if(!t->codec.enabled) {
+        if(t->stream) {
+            frame_pack(frame, t->stream, FRAME_DATA, FRAME_OK, length);
+            ring_write(&t->pending, frame, FRAME_HEADER_SIZE);
+        }
+        ring_write(&t->pending, data, length);
+        return;
+    }
+
+    //Compressed transfers gather everything (e.g. many small files and
+    //their headers) into full blocks, sent one per frame:
+    while(length > 0) {
+        count = length < BLOCK_MAX - t->stage_len ? length : BLOCK_MAX - t->stage_len;
+        memcpy(t->stage + t->stage_len, data, count);
+        t->stage_len += count;
+        if(t->stage_len == BLOCK_MAX) {
+            transfer_seal(t);
+        }
+        data += count;
+        length -= count;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Compresses the data gathered for a compressed transfer into a block and
+ *      queues it
+ * Param:   struct transfer * t -  The transfer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void transfer_seal(struct transfer * t) {
+    char frame[FRAME_HEADER_SIZE + BLOCK_HEADER_SIZE + BLOCK_MAX];
+    size_t encoded;
+
+    if(t->stage_len == 0) {
+        return;
+    }
+
+    encoded = block_encode(&t->codec, frame + FRAME_HEADER_SIZE, t->stage, t->stage_len);
+    if(t->stream) {
+        frame_pack(frame, t->stream, FRAME_DATA, FRAME_OK, encoded);
+        ring_write(&t->pending, frame, FRAME_HEADER_SIZE + encoded);
+    }
+    else {
+        ring_write(&t->pending, frame + FRAME_HEADER_SIZE, encoded);
+    }
+    t->stage_len = 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Compresses everything sent over a transfer from now on.  The client
+ *      decodes it as long as it was told compression is on (see the
+ *      "compress" command).
+ * Param:   struct transfer * t -  The transfer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void transfer_compress(struct transfer * t) {
+
+    if((t->stage = malloc(BLOCK_MAX)) == NULL) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+    codec_init(&t->codec, 1);
+    if(t->pending.data == NULL) {
+        ring_init(&t->pending, RING_SIZE, PENDING_LIMIT);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the next part of a compressed transfer's file into the block being
+ *      gathered
+ * Param:   struct transfer * t -  The transfer
+ * Return:  ssize_t -  Bytes read from the file, 0 at the end of it, or -1
+ *      if it could not be read (errno is set)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+ssize_t transfer_read_block(struct transfer * t) {
+    size_t count = BLOCK_MAX - t->stage_len;
+    ssize_t n;
+
+    if(t->x.remaining != XFER_UNTIL_EOF && t->x.remaining < (off_t) count) {
+        count = t->x.remaining;
+    }
+    if((n = transfer_pread(t, t->stage + t->stage_len, count, t->x.offset)) == -1) {
+        return -1;
+    }
+    if(n == 0) {
+        t->x.eof = 1;
+        return 0;
+    }
+
+    t->x.offset += n;
+    if(t->x.remaining != XFER_UNTIL_EOF) {
+        t->x.remaining -= n;
+    }
+    t->stage_len += n;
+    if(t->stage_len == BLOCK_MAX) {
+        transfer_seal(t);
+    }
+    return n;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Adds a transfer to its session, which stops handling commands until
+ *      all of its transfers have finished
+ * Param:   struct session * s -  The session
+ * Param:   struct transfer * t -  The new transfer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void transfer_attach(struct session * s, struct transfer * t) {
+
+    xfer_stats_start(&t->stats);
+    t->next = s->transfer;
+    s->transfer = t;
+    s->state = SESSION_TRANSFER;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Closes a finished data connection (or hands a multiplexed channel back to
+ *      its session) and, once the session has no transfers left, returns it
+ *      to handling commands
+ * Param:   struct transfer * t -  The transfer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void finish_transfer(struct transfer * t) {
+    struct session * s = t->session;
+    struct transfer ** p;
+    char message[BUF_SIZE];
+
+    //Keep an upload only if all of it arrived intact:
+    if(t->upload != NULL) {
+        finish_upload(t);
+    }
+
+    //Follow a file with its checksum ("CRC32C -" if it was not all sent; the
+    //files of a batch carry their own, see batch_sum(), and stripes are put
+    //together once they have all finished, see stripes_sum()):
+    if(t->stripe > 0) {
+        stripe_done(t);
+    }
+    else if(t->summing && (t->connected || t->stream) && (t->batch == NULL || t->batch->sync != NULL)) {
+        transfer_sum(t);
+        if(t->summed == t->sum_end && !t->failed && t->status == FRAME_OK) {
+            snprintf(message, sizeof(message), "CRC32C %08x\n", (unsigned int) t->sum);
+
+            //Remember a whole file's checksum for next time:
+            if(t->cached != NULL && t->sum_start == 0 && t->sum_end == t->cached->st.st_size) {
+                t->cached->sum = t->sum;
+                t->cached->summed = 1;
+            }
+        }
+        else {
+            snprintf(message, sizeof(message), "CRC32C -\n");
+        }
+        session_send(s, message);
+    }
+
+    //A transfer that broke off fails its reply:
+    if(t->failed || t->status != FRAME_OK || (t->summing && t->summed != t->sum_end)) {
+        session_status(s, STATUS_INCOMPLETE);
+    }
+
+    for(p = &s->transfer; *p != t; p = &(*p)->next);
+    *p = t->next;
+    release_transfer(t);
+
+    //Wait for the rest of a striped transfer:
+    if(s->transfer == NULL && s->state == SESSION_TRANSFER) {
+        if(s->stripes > 0) {
+            stripes_sum(s);
+        }
+        s->state = SESSION_COMMAND;
+        session_prompt(s);
+        handle_request(s);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Frees a transfer, logging how it went and adding that to its session's
+ *      totals.  A multiplexed channel that is still usable goes back to the
+ *      session; any other data connection is closed.
+ * Param:   struct transfer * t -  The transfer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void release_transfer(struct transfer * t) {
+    struct session * s = t->session;
+    char summary[BUF_SIZE];
+
+    //The io_uring engine may still be sending from the file (or the cache's
+    //copy of it): that and the transfer go once it is done (see transfer_sent())
+    if(!loop_busy(&t->data)) {
+        transfer_close_file(t);
+    }
+    transfer_unwait(t);
+
+    if(!t->channel_setup) {
+        xfer_stats_end(&t->stats);
+        if(t->upload != NULL) {
+            transfer_tune(t);
+        }
+        xfer_totals_add(t->upload != NULL ? &s->received : &s->sent, &t->stats);
+        xfer_stats_summary(&t->stats, summary, sizeof(summary));
+        printf("%s: %s\n", t->upload != NULL ? "Received" : "Sent", summary);
+    }
+
+    if(t->codec.enabled && t->codec.raw_bytes > 0) {
+        codec_summary(&t->codec, summary, sizeof(summary));
+        printf("Compressed transfer: %s\n", summary);
+    }
+    codec_free(&t->codec);
+    free(t->stage);
+
+    if(t->stream && !t->failed && s->state != SESSION_CLOSED) {
+        loop_add(&s->channel, loop_remove(&t->data), WATCH_READ, channel_ready);
+    }
+    else {
+        if(t->stream) {
+            printf("Multiplexed data channel closed\n");
+        }
+        loop_close(&t->data);
+    }
+
+    if(t->batch != NULL) {
+        batch_free(t->batch);
+    }
+    if(t->upload != NULL) {
+        upload_free(t->upload, s->dir_fd);
+    }
+    ring_free(&t->pending);
+    if(!loop_busy(&t->data)) {
+        loop_free_later(t);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Says whether a session's transfers are rate limited, by its own limit or
+ *      by the server's
+ * Param:   struct session * s -  The session
+ * Return:  int -  1 if they are, 0 if not
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int session_shaped(struct session * s) {
+
+    return s->bucket.rate > 0 || total_bucket.rate > 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Makes sure a rate limited transfer has credit to send with.  Without any,
+ *      it takes a turn at once if no other transfer is waiting and there
+ *      are tokens to be had; otherwise it joins the end of the line (see
+ *      dispatch_waiting()), and its connection is not watched until its
+ *      turn comes.
+ * Param:   struct transfer * t -  The transfer
+ * Return:  int -  1 if the transfer has to wait, 0 if it may send
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int transfer_throttled(struct transfer * t) {
+
+    if(t->waiting) {
+        return 1;
+    }
+    if(!session_shaped(t->session) || t->credit > 0 ||
+       (waiting == NULL && transfer_grant(t, xfer_clock_ns()) > 0)) {
+        return 0;
+    }
+
+    t->waiting = 1;
+    t->wait_events = t->data.events;
+    t->wait_next = NULL;
+    loop_modify(&t->data, 0);
+
+    //Hand out turns often while anyone is waiting:
+    if(waiting == NULL) {
+        waiting = t;
+        loop_set_tick(SHAPE_INTERVAL, server_tick);
+    }
+    else {
+        waiting_tail->wait_next = t;
+    }
+    waiting_tail = t;
+
+    return 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Gives a transfer one turn's credit, taking the tokens for it from its
+ *      session's bucket and the server's.  A turn is SHAPE_QUANTUM bytes
+ *      times the session's weight, shared among the session's transfers,
+ *      so clients waiting for the same tokens get them in proportion to
+ *      their weights however many connections they open.
+ * Param:   struct transfer * t -  The transfer
+ * Param:   long long now_ns -  The time (see xfer_clock_ns())
+ * Return:  long long -  The credit given, or 0 if the tokens have run out
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+long long transfer_grant(struct transfer * t, long long now_ns) {
+    struct session * s = t->session;
+    struct transfer * other;
+    long long grant;
+    int count = 0;
+
+    bucket_refill(&total_bucket, now_ns);
+    bucket_refill(&s->bucket, now_ns);
+    if((total_bucket.rate > 0 && total_bucket.tokens <= 0) || (s->bucket.rate > 0 && s->bucket.tokens <= 0)) {
+        return 0;
+    }
+
+    for(other = s->transfer; other != NULL; other = other->next) {
+        count++;
+    }
+    grant = (long long) SHAPE_QUANTUM * s->weight / (count > 0 ? count : 1);
+    if(total_bucket.rate > 0 && grant > total_bucket.tokens) {
+        grant = total_bucket.tokens;
+    }
+    if(s->bucket.rate > 0 && grant > s->bucket.tokens) {
+        grant = s->bucket.tokens;
+    }
+
+    bucket_take(&total_bucket, grant);
+    bucket_take(&s->bucket, grant);
+    t->credit += grant;
+    return grant;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Spends a transfer's credit on what it has just sent.  Anything sent beyond
+ *      its credit (frames are written whole) is taken from the buckets too.
+ * Param:   struct transfer * t -  The transfer
+ * Param:   ssize_t sent -  Bytes sent, or -1 if the send failed
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void transfer_charge(struct transfer * t, ssize_t sent) {
+
+    if(sent <= 0 || !session_shaped(t->session)) {
+        return;
+    }
+    if(sent > t->credit) {
+        bucket_take(&total_bucket, sent - (t->credit > 0 ? t->credit : 0));
+        bucket_take(&t->session->bucket, sent - (t->credit > 0 ? t->credit : 0));
+    }
+    t->credit = sent < t->credit ? t->credit - sent : 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Takes a finished transfer out of the line, and gives back the tokens for
+ *      credit it did not use
+ * Param:   struct transfer * t -  The transfer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void transfer_unwait(struct transfer * t) {
+    struct transfer ** p;
+
+    if(t->credit > 0) {
+        bucket_take(&total_bucket, -t->credit);
+        bucket_take(&t->session->bucket, -t->credit);
+        t->credit = 0;
+    }
+    if(!t->waiting) {
+        return;
+    }
+
+    for(p = &waiting; *p != t; p = &(*p)->wait_next);
+    *p = t->wait_next;
+    if(waiting_tail == t) {
+        for(waiting_tail = waiting; waiting_tail != NULL && waiting_tail->wait_next != NULL; waiting_tail = waiting_tail->wait_next);
+    }
+    t->waiting = 0;
+
+    if(waiting == NULL) {
+        loop_set_tick(HEARTBEAT_INTERVAL, server_tick);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Gives the transfers waiting under a rate limit their turns, in the order
+ *      they joined the line, until the server's tokens run out (the rest
+ *      keep their places).  A transfer whose own session is out of tokens
+ *      goes to the back.  This is deficit round robin: each turn is worth
+ *      the session's weight in bytes, so backlogged sessions share the
+ *      bandwidth in proportion to their weights.
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void dispatch_waiting(void) {
+    struct transfer * t, * last = waiting_tail;
+    long long now_ns = xfer_clock_ns();
+
+    bucket_refill(&total_bucket, now_ns);
+    while((t = waiting) != NULL && (total_bucket.rate == 0 || total_bucket.tokens > 0)) {
+        waiting = t->wait_next;
+        t->wait_next = NULL;
+        if(waiting == NULL) {
+            waiting_tail = NULL;
+        }
+
+        if(!session_shaped(t->session) || transfer_grant(t, now_ns) > 0) {
+            t->waiting = 0;
+            loop_modify(&t->data, t->wait_events);
+        }
+        else if(waiting == NULL) {
+            waiting = waiting_tail = t;
+        }
+        else {
+            waiting_tail->wait_next = t;
+            waiting_tail = t;
+        }
+
+        if(t == last) {
+            break;
+        }
+    }
+
+    if(waiting == NULL) {
+        loop_set_tick(HEARTBEAT_INTERVAL, server_tick);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sets a session's rate limit and weight from the limits for its address
+ * Param:   struct session * s -  The session
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void session_limit(struct session * s) {
+    long long rate;
+
+    shape_match(&limits, s->peer.sin_addr, &rate, &s->weight);
+    bucket_set(&s->bucket, rate, xfer_clock_ns());
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Puts the limits into effect: on the whole server (shared equally between
+ *      workers), and on every session
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void apply_limits(void) {
+    struct session * s;
+
+    bucket_set(&total_bucket, limits.total / worker_count, xfer_clock_ns());
+    for(s = sessions; s != NULL; s = s->next) {
+        session_limit(s);
+    }
+
+    //Limits that were lifted release the transfers waiting under them:
+    if(waiting != NULL) {
+        dispatch_waiting();
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the limits file again (after a sighup).  A file with an error
+ *      leaves the limits as they were.
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void reload_limits(void) {
+
+    if(limits_path == NULL) {
+        printf("No limits file to reload\n");
+        return;
+    }
+    if(shape_load(limits_path, &limits) == 0) {
+        apply_limits();
+        printf("Limits reloaded from %s\n", limits_path);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Opens a multiplexed data channel for the session (connecting the same way
+ *      as a regular transfer), or closes the one that is open
+ * Param:   struct session * s -  The session
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void toggle_channel(struct session * s) {
+    struct transfer * t;
+
+    if(s->channel.fd != -1) {
+        loop_close(&s->channel);
+        session_send(s, "Multiplexed data channel closed\n");
+        return;
+    }
+
+    if((t = data_connect(s)) != NULL) {
+        t->channel_setup = 1;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Event handler for an idle multiplexed data channel.  The client never
+ *      sends on it, so readability means it has been closed.
+ * Param:   struct watch * w -  The channel's watch
+ * Param:   unsigned int events -  Events that occurred
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void channel_ready(struct watch * w, unsigned int events) {
+    char buffer[BUF_SIZE];
+    ssize_t n;
+
+    while((n = read(w->fd, buffer, BUF_SIZE)) > 0);
+
+    if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        loop_close(w);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Creates a data connection with a client and sends the specified file (or a
+ *      range of it, e.g. to resume an interrupted transfer) across it.  The
+ *      reply "SIZE <n>" says how many bytes follow (-1 for a pipe), and
+ *      "CRC32C <sum>" (see finish_transfer()) follows the data.
+ * Param:   struct session * s -  The session
+ * Param:   char * filename -  Name of the file to send
+ * Param:   off_t offset -  First byte to send, or -1 if the requested range was invalid
+ * Param:   off_t length -  Number of bytes to send, or RANGE_TO_END
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void send_file(struct session * s, char * filename, off_t offset, off_t length) {
+    struct cache_entry * entry = NULL;
+    struct transfer * t;
+    struct stat st = { 0 };
+    char * error = NULL, message[BUF_SIZE];
+    int file_fd = -1, status = STATUS_OK;
+
+    if(offset == -1) {
+        error = "Error: invalid arguments\n";
+        status = STATUS_INVALID_ARGUMENT;
+    }
+    //Open the specified file (hot files come straight from the cache):
+    else if((file_fd = cache_open(s->dir_fd, s->dir_dev, s->dir_ino, filename, &st, &entry)) == -1) {
+        status = open_status(errno);
+        error = open_error(errno);
+    }
+    else if(S_ISDIR(st.st_mode)) {
+        error = "Invalid filename: file is a directory\n";
+        status = STATUS_NOT_FOUND;
+    }
+
+    //Clamp the range to the file (a range past the end sends nothing):
+    else if(S_ISREG(st.st_mode)) {
+        offset = offset < st.st_size ? offset : st.st_size;
+        if(length == RANGE_TO_END || length > st.st_size - offset) {
+            length = st.st_size - offset;
+        }
+    }
+
+    //Pipes and devices can only be read from the start:
+    else if(offset != 0 || length != RANGE_TO_END) {
+        error = "Error: ranges are only supported for regular files\n";
+        status = STATUS_UNSUPPORTED;
+    }
+    else {
+        length = XFER_UNTIL_EOF;
+    }
+
+    if(error != NULL && file_fd != -1) {
+        close(file_fd);
+        file_fd = -1;
+    }
+
+    //The client is waiting for a data connection (or stream) either way:
+    t = data_connect(s);
+    if(t != NULL && s->compress) {
+        transfer_compress(t);
+    }
+    if(t != NULL && file_fd != -1) {
+        t->cached = entry;
+        transfer_body(t, file_fd, offset, length);
+
+        //Tell the client how much is coming, so it can allocate the space up
+        //front (an error message takes its place if the file can't be sent):
+        snprintf(message, sizeof(message), "SIZE %lld\n", (long long) length);
+        session_send(s, message);
+
+        //Checksum the file as it is sent (unless the cache already knows it):
+        if(length != XFER_UNTIL_EOF) {
+            t->summing = 1;
+            t->sum_start = offset;
+            t->summed = offset;
+            t->sum_end = offset + length;
+            if(entry != NULL && entry->summed && offset == 0 && length == st.st_size) {
+                t->sum = entry->sum;
+                t->summed = t->sum_end;
+            }
+        }
+    }
+    else if(t != NULL) {
+        t->status = FRAME_ERROR;
+    }
+    else if(entry != NULL) {
+        cache_release(entry);
+    }
+    else if(file_fd != -1) {
+        close(file_fd);
+    }
+
+    if(error != NULL) {
+        session_error(s, status, error);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sends a file split into ranges ("stripes"), each over its own data
+ *      connection, so that one download can use several TCP streams.  The
+ *      reply "STRIPES <count> <size>" comes first; then each connection
+ *      carries a stripe header (see stripe_pack()) and its range of the file.
+ * Param:   struct session * s -  The session
+ * Param:   char * filename -  Name of the file to send
+ * Param:   int count -  Number of data connections to use
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void send_stripes(struct session * s, char * filename, int count) {
+    struct transfer * t;
+    struct stat st;
+    char header[STRIPE_HEADER_SIZE], message[BUF_SIZE];
+    off_t stripe, offset, length;
+    int i, file_fd, fds[MAX_STRIPES];
+
+    //Streams on the multiplexed channel are sent one at a time:
+    if(s->channel.fd != -1) {
+        session_error(s, STATUS_UNSUPPORTED, "Error: striped gets are not supported over the multiplexed data channel\n");
+        return;
+    }
+
+    //Open the specified file (without waiting for a writer if it is a pipe):
+    if((file_fd = openat(s->dir_fd, filename, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) == -1) {
+        session_error(s, open_status(errno), open_error(errno));
+        return;
+    }
+    if(fstat(file_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        session_error(s, STATUS_NOT_FOUND, "Error: striped gets need a regular file\n");
+        close(file_fd);
+        return;
+    }
+
+    //Split the file into aligned stripes:
+    stripe = (st.st_size + count - 1) / count;
+    stripe = (stripe + STRIPE_ALIGN - 1) / STRIPE_ALIGN * STRIPE_ALIGN;
+
+    //Each connection gets its own descriptor for the file (taken before the
+    //stripes are announced, so running out of them is a plain error):
+    for(i=0; i<count; i++) {
+        if((fds[i] = dup(file_fd)) == -1) {
+            perror("Error duplicating file descriptor");
+            session_error(s, STATUS_FAILED, "Error: could not open file\n");
+            while(i-- > 0) {
+                close(fds[i]);
+            }
+            close(file_fd);
+            return;
+        }
+    }
+    close(file_fd);
+
+    snprintf(message, BUF_SIZE, "STRIPES %d %lld\n", count, (long long) st.st_size);
+    session_send(s, message);
+    s->stripes = count;
+    s->stripes_summed = 0;
+
+    for(i=0; i<count; i++) {
+        offset = (off_t) i * stripe < st.st_size ? (off_t) i * stripe : st.st_size;
+        length = stripe < st.st_size - offset ? stripe : st.st_size - offset;
+
+        //A connection that cannot be opened fails the whole get: its error
+        //is sent instead of the rest of the stripes, and the client closes
+        //the ones already started (the reply ends once they have failed)
+        if((t = data_connect(s)) == NULL) {
+            while(i < count) {
+                close(fds[i++]);
+            }
+            s->stripes = 0;
+            return;
+        }
+        stripe_pack(header, st.st_size, offset, length);
+        ring_init(&t->pending, STRIPE_HEADER_SIZE, STRIPE_HEADER_SIZE);
+        ring_write(&t->pending, header, STRIPE_HEADER_SIZE);
+        transfer_body(t, fds[i], offset, length);
+
+        //Each stripe is checksummed as it is sent:
+        t->stripe = i + 1;
+        t->summing = 1;
+        t->sum_start = offset;
+        t->summed = offset;
+        t->sum_end = offset + length;
+        s->stripe_lengths[i] = length;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Keeps the checksum of a stripe that has finished, for stripes_sum()
+ * Param:   struct transfer * t -  The stripe's transfer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void stripe_done(struct transfer * t) {
+    struct session * s = t->session;
+
+    //A stripe that never connected failed the get before the client started
+    //it, so the client is not waiting for a checksum:
+    if(!t->connected) {
+        s->stripes = 0;
+        return;
+    }
+
+    transfer_sum(t);
+    if(t->summed == t->sum_end && !t->failed && t->status == FRAME_OK) {
+        s->stripe_sums[t->stripe - 1] = t->sum;
+        s->stripes_summed++;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Follows a striped get with the checksum of the whole file, put together
+ *      from those of its stripes (see sum_combine()), or "CRC32C -" if any
+ *      of them was not sent in full
+ * Param:   struct session * s -  The session
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void stripes_sum(struct session * s) {
+    char message[BUF_SIZE];
+    uint32_t sum;
+    int i;
+
+    if(s->stripes_summed == s->stripes) {
+        sum = s->stripe_sums[0];
+        for(i=1; i<s->stripes; i++) {
+            sum = sum_combine(sum, s->stripe_sums[i], s->stripe_lengths[i]);
+        }
+        snprintf(message, sizeof(message), "CRC32C %08x\n", (unsigned int) sum);
+    }
+    else {
+        snprintf(message, sizeof(message), "CRC32C -\n");
+    }
+    session_send(s, message);
+    s->stripes = 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sends every regular file in the session's directory that matches a
+ *      pattern, back to back over a single data connection (or stream).
+ *      Each file is preceded by a batch header (see batch_pack()) and its
+ *      name, and followed by its CRC32C checksum (see batch_sum()); a header
+ *      with an empty name ends the batch.
+ * Param:   struct session * s -  The session
+ * Param:   char * pattern -  Shell wildcard pattern (see fnmatch(3))
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void send_batch(struct session * s, char * pattern) {
+    struct transfer * t;
+    struct batch * b;
+    DIR * directory = NULL;
+    struct dirent * entry;
+    char ** grown;
+    size_t capacity = 0;
+    int fd;
+
+    if((b = calloc(1, sizeof(*b))) == NULL) {
+        perror("Error allocating memory");
+        session_error(s, STATUS_FAILED, "Error: out of memory\n");
+        return;
+    }
+    b->next = batch_next_file;
+    b->dir_fd = -1;
+
+    //Collect the matching names (hidden files only match patterns starting with '.'):
+    if((fd = dup(s->dir_fd)) == -1 || (directory = fdopendir(fd)) == NULL) {
+        perror("Error opening directory");
+        if(fd != -1) {
+            close(fd);
+        }
+        session_error(s, STATUS_FAILED, "Error: could not open directory\n");
+    }
+    else {
+        rewinddir(directory);
+        while((entry = readdir(directory)) != NULL) {
+            if(entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) {
+                continue;
+            }
+            if(fnmatch(pattern, entry->d_name, FNM_PERIOD) != 0) {
+                continue;
+            }
+            if(b->count == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                if((grown = realloc(b->names, capacity * sizeof(*grown))) == NULL) {
+                    break;
+                }
+                b->names = grown;
+            }
+            if((b->names[b->count] = strdup(entry->d_name)) == NULL) {
+                break;
+            }
+            b->count++;
+        }
+        closedir(directory);
+        qsort(b->names, b->count, sizeof(*b->names), compare_names);
+    }
+
+    //The client is waiting for a data connection (or stream) either way:
+    if((t = data_connect(s)) == NULL) {
+        batch_free(b);
+        return;
+    }
+    if(s->compress) {
+        transfer_compress(t);
+    }
+    else if(!t->stream) {
+        ring_init(&t->pending, RING_SIZE, RING_SIZE);
+    }
+    t->batch = b;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Batch producer for mget: queues the next matching file's header and body,
+ *      skipping anything that is no longer a readable regular file
+ * Param:   struct transfer * t -  The batch's transfer
+ * Return:  int -  1 if more was queued, 0 once the end of the batch has been sent
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int batch_next_file(struct transfer * t) {
+    struct batch * b = t->batch;
+    struct stat st;
+    char header[BATCH_HEADER_SIZE + BUF_SIZE];
+    size_t length;
+    int fd;
+
+    batch_sum(t);
+    while(b->index < b->count) {
+        length = strlen(b->names[b->index]);
+        if((fd = openat(t->session->dir_fd, b->names[b->index++], O_RDONLY | O_NONBLOCK | O_CLOEXEC)) == -1) {
+            continue;
+        }
+        if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || length >= BUF_SIZE) {
+            close(fd);
+            continue;
+        }
+
+        batch_pack(header, length, st.st_mode, st.st_size);
+        memcpy(header + BATCH_HEADER_SIZE, b->names[b->index - 1], length);
+        transfer_data(t, header, BATCH_HEADER_SIZE + length);
+        batch_body(t, fd, st.st_size);
+        return 1;
+    }
+
+    return batch_finish(t);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Starts sending the body of a batch's next file, checksumming it as it goes
+ * Param:   struct transfer * t -  The batch's transfer
+ * Param:   int fd -  The file (closed along with the transfer)
+ * Param:   off_t size -  Its size
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void batch_body(struct transfer * t, int fd, off_t size) {
+
+    transfer_body(t, fd, 0, size);
+    t->summing = 1;
+    t->sum = 0;
+    t->sum_start = 0;
+    t->summed = 0;
+    t->sum_end = size;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Follows the body a batch has just queued with its CRC32C checksum (4 bytes,
+ *      in network byte order), once the rest of it has been read back.  A
+ *      file that shrank while it was sent is only summed as far as it went,
+ *      so the client sees that it does not match.
+ * Param:   struct transfer * t -  The batch's transfer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void batch_sum(struct transfer * t) {
+    char trailer[BATCH_SUM_SIZE];
+    uint32_t sum;
+    off_t summed;
+
+    if(!t->summing) {
+        return;
+    }
+
+    do {
+        summed = t->summed;
+        transfer_sum(t);
+    } while(t->summed < t->sum_end && t->summed > summed);
+
+    sum = htonl(t->sum);
+    memcpy(trailer, &sum, BATCH_SUM_SIZE);
+    transfer_data(t, trailer, BATCH_SUM_SIZE);
+    t->summing = 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Ends a batch of files by queueing a header with an empty name
+ * Param:   struct transfer * t -  The batch's transfer
+ * Return:  int -  1 if the end marker was queued, 0 if it already had been
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int batch_finish(struct transfer * t) {
+    char header[BATCH_HEADER_SIZE];
+
+    if(t->batch->finished) {
+        return 0;
+    }
+
+    t->batch->finished = 1;
+    batch_pack(header, 0, 0, 0);
+    transfer_data(t, header, BATCH_HEADER_SIZE);
+    return 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sends a directory tree as one batch ("get -r <directory>"): the directory
+ *      itself, then every subdirectory and regular file below it, each with
+ *      its path (starting with the directory's name), mode and size, in the
+ *      same format as mget.  The tree is walked as the data connection
+ *      drains and file bodies are sent with sendfile(), so it needs no more
+ *      memory for 100,000 files than for one.  Symbolic links are skipped.
+ * Param:   struct session * s -  The session
+ * Param:   char * directory -  The directory to send
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void send_tree(struct session * s, char * directory) {
+    struct transfer * t;
+    struct batch * b;
+    struct stat st;
+    char header[BATCH_HEADER_SIZE + PATH_MAX], * base, * error = NULL;
+    size_t length;
+    int fd, status = STATUS_OK;
+
+    if((b = calloc(1, sizeof(*b))) == NULL || (b->path = malloc(PATH_MAX)) == NULL) {
+        perror("Error allocating memory");
+        session_error(s, STATUS_FAILED, "Error: out of memory\n");
+        free(b);
+        return;
+    }
+    b->next = batch_next_tree;
+    b->dir_fd = -1;
+
+    //Paths in the archive start with the directory's own name ("." and ".."
+    //send their contents without one):
+    length = strlen(directory);
+    while(length > 1 && directory[length - 1] == '/') {
+        directory[--length] = '\0';
+    }
+    base = strrchr(directory, '/') != NULL ? strrchr(directory, '/') + 1 : directory;
+    if(strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+        base = "";
+    }
+    strcpy(b->path, base);
+
+    if((fd = openat(s->dir_fd, directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        status = errno == ENOTDIR || errno == ENOENT ? STATUS_NOT_FOUND : open_status(errno);
+        error = errno == ENOTDIR || errno == ENOENT ? "Error: invalid directory\n" : open_error(errno);
+    }
+    else if(fstat(fd, &st) == -1 || walk_push(b, fd, strlen(b->path)) == -1) {
+        status = open_status(errno);
+        error = open_error(errno);
+        close(fd);
+    }
+
+    //The client is waiting for a data connection (or stream) either way:
+    if((t = data_connect(s)) == NULL) {
+        batch_free(b);
+        return;
+    }
+    if(s->compress) {
+        transfer_compress(t);
+    }
+    else if(!t->stream) {
+        ring_init(&t->pending, RING_SIZE, PENDING_LIMIT);
+    }
+    t->batch = b;
+
+    //The directory itself comes first:
+    if(error == NULL && b->path[0] != '\0') {
+        batch_pack(header, strlen(b->path), st.st_mode, 0);
+        memcpy(header + BATCH_HEADER_SIZE, b->path, strlen(b->path));
+        transfer_data(t, header, BATCH_HEADER_SIZE + strlen(b->path));
+    }
+    if(error != NULL) {
+        t->status = FRAME_ERROR;
+        session_error(s, status, error);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Batch producer for recursive gets: queues the header of the next entry in
+ *      the tree, and the body of a regular file or the contents of a
+ *      directory after it
+ * Param:   struct transfer * t -  The batch's transfer
+ * Return:  int -  1 if more was queued, 0 once the end of the batch has been sent
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int batch_next_tree(struct transfer * t) {
+    struct batch * b = t->batch;
+    struct walk_level * level;
+    struct dirent * entry;
+    struct stat st;
+    char header[BATCH_HEADER_SIZE + PATH_MAX];
+    size_t length, prefix;
+    int fd;
+
+    batch_sum(t);
+    while(b->depth > 0) {
+        level = &b->levels[b->depth - 1];
+
+        //Done with this directory: go back up
+        if((entry = readdir(level->dir)) == NULL) {
+            closedir(level->dir);
+            b->depth--;
+            continue;
+        }
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || entry->d_type == DT_LNK) {
+            continue;
+        }
 
-    //Iteratively handle connections:
-    while(1) {
+        //The entry's path is its directory's path and its name:
+        prefix = level->path_len > 0 ? level->path_len + 1 : 0;
+        if((length = prefix + strlen(entry->d_name)) >= PATH_MAX) {
+            continue;
+        }
+        if(prefix > 0) {
+            b->path[level->path_len] = '/';
+        }
+        strcpy(b->path + prefix, entry->d_name);
+
+        if((fd = openat(dirfd(level->dir), entry->d_name, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC)) == -1) {
+            continue;
+        }
+        if(fstat(fd, &st) == -1 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+            close(fd);
+            continue;
+        }
+
+        batch_pack(header, length, st.st_mode, S_ISREG(st.st_mode) ? st.st_size : 0);
+        memcpy(header + BATCH_HEADER_SIZE, b->path, length);
+        transfer_data(t, header, BATCH_HEADER_SIZE + length);
 
-        //Accept a connection:
-        control_fd = accept_connection(server_fd);
-        
-        //Handle it:
-        handle_request(control_fd);
+        //Descend into directories (what was listed so far stays valid):
+        if(S_ISDIR(st.st_mode)) {
+            if(walk_push(b, fd, length) == -1) {
+                close(fd);
+            }
+            return 1;
+        }
 
-        //Close it:
-        close(control_fd);
-        control_fd = -1;
-        printf("Connection closed by client\n");
+        batch_body(t, fd, st.st_size);
+        return 1;
     }
 
-    close(server_fd);    
-    return EXIT_SUCCESS;
+    return batch_finish(t);
 }
 
-
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Creates a passive socket that listens on the control port
- * Param:   void
- * Return:  int -  File descriptor of the passive socket
+ * Starts walking a directory of a recursive get
+ * Param:   struct batch * b -  The batch
+ * Param:   int dir_fd -  The directory (owned by the batch on success)
+ * Param:   size_t path_len -  Length of the directory's path in b->path
+ * Return:  int -  0 on success, or -1 if the directory could not be read
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-int start_server(void) {
-    int fd;
-
-    fd = create_socket();
-    bind_socket(fd, CONTROL_PORT);
-    listen_socket(fd);
+int walk_push(struct batch * b, int dir_fd, size_t path_len) {
+    struct walk_level * grown;
+    DIR * dir;
 
-    printf("Server started\n");
-    printf("Listening for incoming connections...\n");
+    if(b->depth == b->levels_cap) {
+        b->levels_cap = b->levels_cap ? b->levels_cap * 2 : 16;
+        if((grown = realloc(b->levels, b->levels_cap * sizeof(*grown))) == NULL) {
+            return -1;
+        }
+        b->levels = grown;
+    }
+    if((dir = fdopendir(dir_fd)) == NULL) {
+        return -1;
+    }
 
-    return fd;
+    b->levels[b->depth].dir = dir;
+    b->levels[b->depth].path_len = path_len;
+    b->depth++;
+    return 0;
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Accepts an incoming connection on the control port
- * Param:   int socket_fd -  File descriptor of the passive, listening socket
- * Return:  int -  File descriptor for the newly initiated control connection
+ * Starts a sync ("sync <filename> <block size> <count>").  The client's
+ *      signatures of its copy of the file follow the command on the control
+ *      connection, and the delta is sent once they have all arrived (see
+ *      read_signatures()).
+ * Param:   struct session * s -  The session
+ * Param:   char * request -  The raw command
+ * Param:   char * filename -  Name of the file to sync
+ * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-int accept_connection(int socket_fd) {
-    struct sockaddr_in address;
-    char address_str[BUF_SIZE];
-    int connection_fd;
-    unsigned int length;
+void start_sync(struct session * s, char * request, char * filename) {
+    struct sync * y;
+    off_t block, count;
 
-    //Accept a connection:
-    length = sizeof(address);
-    if((connection_fd = accept(socket_fd, (struct sockaddr *) &address, &length)) == -1) {
-        perror("Error accepting incoming connection");
-        close(socket_fd);
-        exit(EXIT_FAILURE);
+    if(parse_sync(request, &block, &count) == -1) {
+        session_error(s, STATUS_INVALID_ARGUMENT, "Error: invalid arguments\n");
+        return;
     }
-    
-    //Get the peer's address as a string:
-    if(inet_ntop(AF_INET, &address.sin_addr, address_str, BUF_SIZE) == NULL) {
-        perror("Error converting ip address to string");
-        close(socket_fd);
-        exit(EXIT_FAILURE);
+
+    if((y = calloc(1, sizeof(*y))) == NULL || (y->name = strdup(filename)) == NULL ||
+        delta_index_init(&y->index, block, count) == -1 ||
+        (y->sigs = malloc(count * DELTA_SIG_SIZE + 1)) == NULL) {
+        perror("Error allocating memory");
+        sync_free(y);
+
+        //The signatures can't be told apart from commands, so give up on the session:
+        session_error(s, STATUS_FAILED, "Error: out of memory\n");
+        session_flush(s);
+        session_close(s);
+        return;
     }
-    
-    //Print message:
-    printf("Connection accepted: %s\n", address_str);
+    y->sigs_len = count * DELTA_SIG_SIZE;
 
-    return connection_fd;
+    s->sync = y;
+    s->state = SESSION_SIGNATURES;
+    read_signatures(s);
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Handles a complete client session
- * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Takes in as much of a sync's signatures as has arrived: first what was
+ *      read along with the command, then straight from the socket (the
+ *      command buffer is far smaller than the signatures of a large file).
+ *      Once they are complete they are indexed and the delta is sent.
+ * Param:   struct session * s -  The session
  * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-void handle_request(int ctrl_fd) {
-    int command;
-    char arg[BUF_SIZE];
+void read_signatures(struct session * s) {
+    struct sync * y = s->sync;
+    ssize_t n;
+    size_t i;
 
-    //Display greeting and instructions:
-    send_message(ctrl_fd, "Welcome to Nathan's File Transfer Program\nCommands:\n\t");
-    send_message(ctrl_fd, "exit\t- end the ftp session\n\t");
-    send_message(ctrl_fd, "pwd\t- print working directory\n\t");
-    send_message(ctrl_fd, "list\t- view files in current directory\n\t");
-    send_message(ctrl_fd, "cd <directory>\t- change directory\n\t");
-    send_message(ctrl_fd, "get <filename>\t- get the specified file\n");
+    y->received += ring_read(&s->in, y->sigs + y->received, y->sigs_len - y->received);
 
-    //Get user's command choice:
-    while((command = get_command(ctrl_fd, arg)) != EXIT) {
+    while(y->received < y->sigs_len) {
+        if((n = read(s->ctrl.fd, y->sigs + y->received, y->sigs_len - y->received)) > 0) {
+            y->received += n;
+            continue;
+        }
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if(n == -1) {
+            perror("Error reading from socket");
+        }
+        session_close(s);
+        return;
+    }
 
-        //Perform appropriate response:
-        switch(command) {
-            case INVALID:
-                send_message(ctrl_fd, "Invalid command\n");
-                break;
+    for(i=0; i<y->index.count; i++) {
+        sig_unpack(y->sigs + i * DELTA_SIG_SIZE, &y->index.weak[i], &y->index.strong[i]);
+    }
+    free(y->sigs);
+    y->sigs = NULL;
+    delta_index_build(&y->index);
 
-            case LIST:
-                list_directories(ctrl_fd);
-                break;
+    s->sync = NULL;
+    s->state = SESSION_COMMAND;
+    send_delta(s, y);
+}
 
-            case GET:
-                send_file(ctrl_fd, arg);
-                break;
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sends a file as a delta against the client's copy of it: "SIZE <n>" with
+ *      the new size, then over a data connection (or stream) a series of
+ *      records (see delta_pack()), each either literal data or a run of the
+ *      client's own blocks, and finally the CRC32C of the whole new file.
+ *      The delta is produced as the connection drains (see
+ *      batch_next_delta()), and literal data goes out with sendfile().
+ * Param:   struct session * s -  The session
+ * Param:   struct sync * y -  The client's signatures (taken over)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void send_delta(struct session * s, struct sync * y) {
+    struct cache_entry * entry = NULL;
+    struct transfer * t;
+    struct batch * b = NULL;
+    struct stat st;
+    char * error = NULL, message[BUF_SIZE];
+    int file_fd, status = STATUS_OK;
 
-            case CD:
-                change_directory(ctrl_fd, arg);
-                break;
+    //Open the file as get does:
+    if((file_fd = cache_open(s->dir_fd, s->dir_dev, s->dir_ino, y->name, &st, &entry)) == -1) {
+        status = open_status(errno);
+        error = open_error(errno);
+    }
+    else if(S_ISDIR(st.st_mode)) {
+        error = "Invalid filename: file is a directory\n";
+        status = STATUS_NOT_FOUND;
+    }
+    else if(!S_ISREG(st.st_mode)) {
+        error = "Error: only regular files can be synced\n";
+        status = STATUS_NOT_FOUND;
+    }
+    else if((b = calloc(1, sizeof(*b))) == NULL || (y->window = malloc(DELTA_WINDOW)) == NULL) {
+        perror("Error allocating memory");
+        error = "Error: out of memory\n";
+        status = STATUS_FAILED;
+    }
 
-            case PWD:
-                show_cwd(ctrl_fd);
-                break;
+    if(error != NULL) {
+        if(entry != NULL) {
+            cache_release(entry);
+        }
+        else if(file_fd != -1) {
+            close(file_fd);
+        }
+        free(b);
+        sync_free(y);
+
+        //The client is waiting for a data connection (or stream) either way:
+        if((t = data_connect(s)) != NULL) {
+            t->status = FRAME_ERROR;
+        }
+        session_error(s, status, error);
+        return;
+    }
+
+    b->next = batch_next_delta;
+    b->dir_fd = -1;
+    b->sync = y;
+    y->size = st.st_size;
+    y->expected = -1;
 
+    if((t = data_connect(s)) == NULL) {
+        if(entry != NULL) {
+            cache_release(entry);
+        }
+        else {
+            close(file_fd);
         }
+        batch_free(b);
+        return;
+    }
+    if(s->compress) {
+        transfer_compress(t);
+    }
+    else if(!t->stream) {
+        ring_init(&t->pending, RING_SIZE, RING_SIZE);
+    }
+    t->batch = b;
+    t->cached = entry;
+    t->file_fd = file_fd;
+    xfer_init(&t->x, t->data.fd, file_fd, 0, 0);
+
+    snprintf(message, sizeof(message), "SIZE %lld\n", (long long) st.st_size);
+    session_send(s, message);
+
+    //The new file's checksum (unless the cache already knows it):
+    t->summing = 1;
+    t->sum_end = st.st_size;
+    if(entry != NULL && entry->summed) {
+        t->sum = entry->sum;
+        t->summed = t->sum_end;
     }
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Reads a single user's command from the control socket, and returns the command type
- * Param:   int ctrl_fd -  File descriptor of the control socket
- * Param:   char * arg -  Buffer to store any arguments sent with the command
- * Return:  int -  Command type identifier
+ * Batch producer for sync: rolls through the file a window at a time
+ *      looking for the client's blocks, and queues the next record of the
+ *      delta.  Data that matches none of them is sent as it is; a run of
+ *      matching blocks is sent as a reference to the client's copy.
+ * Param:   struct transfer * t -  The sync's transfer
+ * Return:  int -  1 if more was queued, 0 once the end of the delta has been sent
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-int get_command(int ctrl_fd, char * arg) {
-    int i;
-    char buffer[BUF_SIZE];
+int batch_next_delta(struct transfer * t) {
+    struct batch * b = t->batch;
+    struct sync * y = b->sync;
+    char header[DELTA_HEADER_SIZE];
+    size_t pos, block = y->index.block;
+    uint32_t count;
+    off_t end;
+    ssize_t n;
+    long index;
 
-    //Read the command from the socket:
-    for(i=0; i<BUF_SIZE; i++) {
+    if(b->finished) {
+        return 0;
+    }
+
+    for(;;) {
+        //Look for a block the client has in what has been read:
+        pos = y->scan - y->window_offset;
+        index = delta_scan(&y->index, y->window, y->window_len, &pos, y->expected);
+        y->scan = y->window_offset + pos;
 
-        if(i==0) {
-            send_message(ctrl_fd, PROMPT);
+        //Send the data before it as it is (straight from the file):
+        if(y->scan > y->literal) {
+            delta_pack(header, DELTA_DATA, 0, y->scan - y->literal);
+            transfer_data(t, header, DELTA_HEADER_SIZE);
+            transfer_body(t, t->file_fd, y->literal, y->scan - y->literal);
+            y->literal = y->scan;
+            return 1;
         }
 
-        //Read a character:
-        if(read(ctrl_fd, &buffer[i], 1) == -1) {
-            perror("Error reading from socket");
-            exit(EXIT_FAILURE);
-        };
-        
-        //End of line:
-        if((buffer[i] == '\n') || (buffer[i] == '\r')) {
-            if(i==0) {
-                i--;
-                continue;
-            }
-            else {
-                break;
+        //Then the run of the client's blocks that starts there:
+        if(index != -1) {
+            for(count = 1; pos + (count + 1) * block <= y->window_len &&
+                delta_match(&y->index, y->window + pos + count * block, index + count); count++);
+
+            delta_pack(header, DELTA_COPY, count, index);
+            transfer_data(t, header, DELTA_HEADER_SIZE);
+            y->scan += (off_t) count * block;
+            y->literal = y->scan;
+            y->expected = index + count;
+            return 1;
+        }
+
+        //A tail too short to be a block is sent as it is, then the end:
+        end = y->window_offset + y->window_len;
+        if(end >= y->size && y->scan < y->size) {
+            y->scan = y->size;
+            continue;
+        }
+        if(end >= y->size) {
+            delta_pack(header, DELTA_END, 0, y->size);
+            transfer_data(t, header, DELTA_HEADER_SIZE);
+            b->finished = 1;
+            return 1;
+        }
+
+        //Read on from the first byte that has not been dealt with:
+        y->window_offset = y->scan;
+        n = transfer_pread(t, y->window, y->size - y->scan < DELTA_WINDOW ? y->size - y->scan : DELTA_WINDOW, y->scan);
+        if(n <= 0) {
+            //The file shrank (or can't be read): end it there
+            if(n == -1) {
+                perror("Error reading file");
             }
+            y->window_len = 0;
+            y->size = y->scan;
+            t->status = FRAME_ERROR;
+            continue;
+        }
+        y->window_len = n;
+
+        //Checksum the new file as it is read:
+        end = y->window_offset + n;
+        if(t->summed < end) {
+            t->sum = sum_crc32c(t->sum, y->window + (t->summed - y->window_offset), end - t->summed);
+            t->summed = end;
         }
     }
+}
 
-    return parse_command(buffer, arg);
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Frees a sync and everything it holds
+ * Param:   struct sync * y -  The sync (may be NULL)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void sync_free(struct sync * y) {
+
+    if(y == NULL) {
+        return;
+    }
+
+    delta_index_free(&y->index);
+    free(y->name);
+    free(y->sigs);
+    free(y->window);
+    free(y);
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Creates a data connection with a client and sends a list of all files in the current directory
- * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Frees a batch and everything it holds
+ * Param:   struct batch * b -  The batch
  * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-void list_directories(int ctrl_fd) {
-    DIR * directory;
-    struct dirent * entry;
-    int data_fd;
+void batch_free(struct batch * b) {
+
+    while(b->count > 0) {
+        free(b->names[--b->count]);
+    }
+    while(b->depth > 0) {
+        closedir(b->levels[--b->depth].dir);
+    }
+    if(b->dir_fd != -1) {
+        close(b->dir_fd);
+    }
+    sync_free(b->sync);
+    free(b->names);
+    free(b->entries);
+    free(b->levels);
+    free(b->path);
+    free(b);
+}
 
-    //Open data connection:
-    data_fd = data_connect(ctrl_fd);
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Orders file names for qsort()
+ * Param:   const void * a -  Pointer to the first name
+ * Param:   const void * b -  Pointer to the second name
+ * Return:  int -  Negative, zero or positive, as with strcmp()
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int compare_names(const void * a, const void * b) {
 
-    if((directory = opendir("./")) == NULL) {
-        perror("Error opening directory");
-        exit(EXIT_FAILURE);
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Starts an upload ("put <filename> <size> <CRC32C>"): replies "UPLOAD
+ *      <size>" and opens a data connection, over which the client sends the
+ *      file and then closes it.  The file is received into a hidden file in
+ *      the same directory (preallocated with fallocate()) and renamed into
+ *      place once it is complete and its checksum matches (see
+ *      finish_upload()), so nobody ever sees half of it.
+ * Param:   struct session * s -  The session
+ * Param:   char * request -  The raw command
+ * Param:   char * filename -  Name to store the file under
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void receive_upload(struct session * s, char * request, char * filename) {
+    static unsigned int uploads;
+    struct upload * u;
+    struct transfer * t;
+    struct stat st;
+    char message[BUF_SIZE], * base;
+    int exists;
+    off_t size;
+    uint32_t sum;
+
+    if(parse_put(request, &size, &sum) == -1) {
+        session_error(s, STATUS_INVALID_ARGUMENT, "Error: invalid arguments\n");
+        return;
     }
-    
-    while((entry = readdir(directory)) != NULL) {
-        if((strcmp(entry->d_name, ".") != 0) && (strcmp(entry->d_name, "..") != 0)) {
-            send_message(ctrl_fd, entry->d_name);
-            send_message(ctrl_fd, "  ");
-        }
+
+    //The data comes from the client, so it can't share the channel's frames:
+    if(s->channel.fd != -1) {
+        session_error(s, STATUS_UNSUPPORTED, "Error: uploads are not supported over the multiplexed data channel\n");
+        return;
+    }
+
+    //Only into the current directory or below it:
+    if(!safe_path(filename)) {
+        session_error(s, STATUS_DENIED, "Invalid filename: uploads must stay within the current directory\n");
+        return;
+    }
+    if((exists = fstatat(s->dir_fd, filename, &st, 0) == 0) && !S_ISREG(st.st_mode)) {
+        session_error(s, STATUS_NOT_FOUND, "Invalid filename: not a regular file\n");
+        return;
+    }
+
+    if((u = calloc(1, sizeof(*u))) == NULL) {
+        perror("Error allocating memory");
+        session_error(s, STATUS_FAILED, "Error: out of memory\n");
+        return;
+    }
+    u->pipe_fd[0] = -1;
+    u->pipe_fd[1] = -1;
+    u->size = size;
+    u->expected = sum;
+    snprintf(u->name, sizeof(u->name), "%s", filename);
+
+    //Receive into a hidden file beside the one it replaces (so the rename
+    //stays on one filesystem):
+    base = strrchr(filename, '/');
+    base = base != NULL ? base + 1 : filename;
+    if(snprintf(u->temp, sizeof(u->temp), "%.*s.%s.%d.%u.part", (int) (base - filename), filename, base,
+                (int) getpid(), uploads++) >= (int) sizeof(u->temp)) {
+        //(A truncated name could be shared by two uploads)
+        session_error(s, STATUS_INVALID_ARGUMENT, "Invalid filename: name too long\n");
+        free(u);
+        return;
+    }
+    if((u->file_fd = openat(s->dir_fd, u->temp, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0666)) == -1) {
+        perror("Error creating file");
+        session_error(s, errno == ENOENT ? STATUS_NOT_FOUND : errno == EACCES ? STATUS_DENIED : STATUS_FAILED,
+                      errno == ENOENT ? "Invalid filename: directory does not exist\n" :
+                      errno == EACCES ? "Error: permission denied\n" : "Error: could not create file\n");
+        free(u);
+        return;
+    }
+
+    //A file that is replaced keeps its permissions:
+    if(exists) {
+        fchmod(u->file_fd, st.st_mode & 07777);
+    }
+
+    //Reserve the space up front, so a large upload is not fragmented (and a
+    //full disk is found out before anything is sent):
+    if(size > 0 && fallocate(u->file_fd, 0, 0, size) == -1 && (errno == ENOSPC || errno == EFBIG)) {
+        session_error(s, STATUS_NO_SPACE, "Error: not enough space for the file\n");
+        upload_free(u, s->dir_fd);
+        return;
+    }
+
+    if(pipe2(u->pipe_fd, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("Error creating pipe");
+        session_error(s, STATUS_FAILED, "Error: could not receive file\n");
+        upload_free(u, s->dir_fd);
+        return;
     }
-    send_message(ctrl_fd, "\n");
+    fcntl(u->pipe_fd[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+
+    snprintf(message, sizeof(message), "UPLOAD %lld\n", (long long) size);
+    session_send(s, message);
 
-    closedir(directory);
-    close(data_fd);
+    if((t = data_connect(s)) == NULL) {
+        upload_free(u, s->dir_fd);
+        return;
+    }
+    t->upload = u;
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Adds what has been received of an upload so far to its checksum, reading
+ *      it back from the page cache
+ * Param:   struct upload * u -  The upload
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void upload_sum(struct upload * u) {
+    off_t n;
+
+    while(u->summed < u->received && (n = sum_file(u->file_fd, u->summed, u->received - u->summed, &u->sum)) > 0) {
+        u->summed += n;
+    }
+}
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Initiates a data connection with a listening client
- * Param:   int ctrl_fd -  File descriptor of the control connection
- * Return:  int -  File descriptor of the newly initiated data connection
+ * Stores a finished upload under its name if all of it arrived and matches
+ *      the client's checksum (flushed to disk first, as "-f" asks), and tells
+ *      the client how it went
+ * Param:   struct transfer * t -  The upload's transfer
+ * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-int data_connect(int ctrl_fd) {
-    struct sockaddr_in address;
-    int data_fd;
-    unsigned int length;
+void finish_upload(struct transfer * t) {
+    struct upload * u = t->upload;
+    struct session * s = t->session;
+    char message[2 * BUF_SIZE], * slash;
+    int fd;
 
-    //Get peer's address:
-    length = sizeof(address);
-    if(getpeername(ctrl_fd, (struct sockaddr *) &address, &length) == -1) {
-        perror("Error getting peer's address");
-        close(ctrl_fd);
-        exit(EXIT_FAILURE);
+    upload_sum(u);
+
+    if(t->failed || !t->connected || u->received != u->size || u->summed != u->received) {
+        snprintf(message, sizeof(message), "Error: upload incomplete (%lld of %lld bytes received), file not stored\n",
+                 (long long) u->received, (long long) u->size);
+        session_status(s, STATUS_INCOMPLETE);
+    }
+    else if(u->sum != u->expected) {
+        snprintf(message, sizeof(message), "Error: checksum mismatch (sent %08x, received %08x), file not stored\n",
+                 (unsigned int) u->expected, (unsigned int) u->sum);
+        session_status(s, STATUS_INCOMPLETE);
     }
-    
-    //Change to the data port:
-    address.sin_port = htons(DATA_PORT);
 
-    //Create a new socket:
-    data_fd = create_socket();
+    //Make sure the data is on disk before the rename makes it visible:
+    else if((flush_policy == FLUSH_DATA && fdatasync(u->file_fd) == -1) ||
+            (flush_policy == FLUSH_ALL && fsync(u->file_fd) == -1) ||
+            renameat(s->dir_fd, u->temp, s->dir_fd, u->name) == -1) {
+        perror("Error storing file");
+        snprintf(message, sizeof(message), "Error: could not store file\n");
+        session_status(s, STATUS_FAILED);
+    }
+    else {
+        u->stored = 1;
 
-    //Connect to peer via that socket:
-    if(connect(data_fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
-        perror("Error opening data connection");
-        close(ctrl_fd);
-        exit(EXIT_FAILURE);
+        //And that the rename itself is:
+        if(flush_policy == FLUSH_ALL) {
+            if((slash = strrchr(u->name, '/')) == NULL) {
+                fsync(s->dir_fd);
+            }
+            else {
+                *slash = '\0';
+                if((fd = openat(s->dir_fd, u->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+                    fsync(fd);
+                    close(fd);
+                }
+                *slash = '/';
+            }
+        }
+        snprintf(message, sizeof(message), "File stored: %s (%lld bytes)\n", u->name, (long long) u->received);
     }
-    
-    return data_fd;
+
+    session_send(s, message);
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Creates a data connection with a client and sends the specified file across it
- * Param:   int ctrl_fd -  File descriptor of the control connection
- * Param:   char * arg -  Name of the file to send
+ * Frees an upload, removing the file it was received into unless it was stored
+ * Param:   struct upload * u -  The upload
+ * Param:   int dir_fd -  The directory the upload's names are relative to
  * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-void send_file(int ctrl_fd, char * filename) {
-    int data_fd, file_fd, num_read;
-    char c;
-
-    //Open data connection:
-    data_fd = data_connect(ctrl_fd);
+void upload_free(struct upload * u, int dir_fd) {
 
-    //Open the specified file:
-    if((file_fd = open(filename, O_RDONLY)) == -1) {
-        if(errno == ENOENT) {
-            send_message(ctrl_fd, "Invalid filename: file does not exist\n");
-            close(data_fd);
-            return;
+    if(u->pipe_fd[0] != -1) {
+        close(u->pipe_fd[0]);
+        close(u->pipe_fd[1]);
+    }
+    if(u->file_fd != -1) {
+        if(!u->stored) {
+            unlinkat(dir_fd, u->temp, 0);
         }
-        perror("Error opening file");
-        exit(EXIT_FAILURE);
+        close(u->file_fd);
+    }
+    free(u);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Tells the client the size of a file ("SIZE <bytes>"), e.g. so it can
+ *      resume a partial download
+ * Param:   struct session * s -  The session
+ * Param:   char * filename -  Name of the file
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void show_size(struct session * s, char * filename) {
+    struct stat st;
+    char message[BUF_SIZE];
+
+    if(fstatat(s->dir_fd, filename, &st, 0) == -1) {
+        session_error(s, open_status(errno), open_error(errno));
+    }
+    else if(!S_ISREG(st.st_mode)) {
+        session_error(s, STATUS_NOT_FOUND, "Error: not a regular file\n");
+    }
+    else {
+        snprintf(message, BUF_SIZE, "SIZE %lld\n", (long long) st.st_size);
+        session_send(s, message);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Tells the client the CRC32C checksum of a file, or of a range of it
+ *      ("CRC32C <sum>"): the same one a get of that range is followed by.
+ *      Clients check the start of a partial download with it before
+ *      resuming it.
+ * Param:   struct session * s -  The session
+ * Param:   char * filename -  Name of the file
+ * Param:   off_t offset -  Offset of the first byte (clamped to the file)
+ * Param:   off_t length -  Number of bytes, or RANGE_TO_END
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void show_sum(struct session * s, char * filename, off_t offset, off_t length) {
+    struct cache_entry * entry = NULL;
+    struct stat st;
+    char message[BUF_SIZE];
+    uint32_t sum = 0;
+    off_t summed;
+    int file_fd;
+
+    if((file_fd = cache_open(s->dir_fd, s->dir_dev, s->dir_ino, filename, &st, &entry)) == -1) {
+        session_error(s, open_status(errno), open_error(errno));
+        return;
+    }
+
+    if(!S_ISREG(st.st_mode)) {
+        session_error(s, STATUS_NOT_FOUND, "Error: not a regular file\n");
     }
+    else {
+        offset = offset < st.st_size ? offset : st.st_size;
+        if(length == RANGE_TO_END || length > st.st_size - offset) {
+            length = st.st_size - offset;
+        }
+
+        //A cached file may have been summed already, or be in memory:
+        summed = length;
+        if(entry != NULL && entry->summed && offset == 0 && length == st.st_size) {
+            sum = entry->sum;
+        }
+        else if(entry != NULL && entry->data != NULL) {
+            sum = sum_crc32c(0, entry->data + offset, length);
+        }
+        else {
+            summed = sum_file(file_fd, offset, length, &sum);
+        }
 
-    //Transfer file:
-    while((num_read = read(file_fd, &c, 1)) > 0) {
-        if(write(data_fd, &c, 1) != 1) {
-            perror("Error writing to data socket");
-            exit(EXIT_FAILURE);
+        if(summed != length) {
+            session_error(s, STATUS_FAILED, "Error: could not read file\n");
+        }
+        else {
+            if(entry != NULL && offset == 0 && length == st.st_size) {
+                entry->sum = sum;
+                entry->summed = 1;
+            }
+            snprintf(message, BUF_SIZE, "CRC32C %08x\n", (unsigned int) sum);
+            session_send(s, message);
         }
     }
-    if(num_read == -1) {
-        perror("Error reading from file");
-        exit(EXIT_FAILURE);
+
+    if(entry != NULL) {
+        cache_release(entry);
+    }
+    else {
+        close(file_fd);
     }
+}
 
-    close(file_fd);
-    close(data_fd);
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Tells the client what its session's transfers have added up to: how long
+ *      it has been connected, the commands it has sent, and the transfers,
+ *      bytes, busy time, throughput, average time to first byte and system
+ *      calls on data connections each way
+ * Param:   struct session * s -  The session
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void show_stats(struct session * s) {
+    char message[BUF_SIZE], summary[BUF_SIZE - 16];
+
+    snprintf(message, sizeof(message), "Session: connected for %.1f s, %ld commands\n",
+        (xfer_clock_ns() - s->opened_ns) / 1e9, s->commands);
+    session_send(s, message);
+    xfer_totals_summary(&s->sent, summary, sizeof(summary));
+    snprintf(message, sizeof(message), "Sent: %s\n", summary);
+    session_send(s, message);
+    xfer_totals_summary(&s->received, summary, sizeof(summary));
+    snprintf(message, sizeof(message), "Received: %s\n", summary);
+    session_send(s, message);
+    shape_summary(s->bucket.rate, s->weight, summary, sizeof(summary));
+    snprintf(message, sizeof(message), "Rate limit: %s\n", summary);
+    session_send(s, message);
+    tune_summary(&s->tuning, summary, sizeof(summary));
+    snprintf(message, sizeof(message), "Server tuning: %s\n", summary);
+    session_send(s, message);
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Changes the current working directory, and informs client of new location
- * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Describes why a file could not be opened, for the client
+ * Param:   int error -  errno from the failed call
+ * Return:  char * -  Message to send
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+char * open_error(int error) {
+
+    if(error == ENOENT) {
+        return "Invalid filename: file does not exist\n";
+    }
+    if(error == EACCES) {
+        return "Error: permission denied\n";
+    }
+
+    errno = error;
+    perror("Error opening file");
+    return "Error: could not open file\n";
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Returns the reply status that goes with open_error()'s message
+ * Param:   int error -  The errno value from open()
+ * Return:  int -  The status (one of the STATUS_ codes)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int open_status(int error) {
+
+    if(error == ENOENT) {
+        return STATUS_NOT_FOUND;
+    }
+    if(error == EACCES) {
+        return STATUS_DENIED;
+    }
+    return STATUS_FAILED;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Changes the session's working directory, and informs client of new location
+ * Param:   struct session * s -  The session
  * Param:   char * directory -  Name of the target directory
  * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-void change_directory(int ctrl_fd, char * directory) {
+void change_directory(struct session * s, char * directory) {
+    struct stat st;
+    int fd;
 
-    if(chdir(directory) == -1) {
+    if((fd = openat(s->dir_fd, directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
         if(errno == EACCES) {
-            send_message(ctrl_fd, "Error: permission denied\n");
+            session_error(s, STATUS_DENIED, "Error: permission denied\n");
         }
         else if(errno == ENOTDIR || errno == ENOENT) {
-            send_message(ctrl_fd, "Error: invalid directory\n");
+            session_error(s, STATUS_NOT_FOUND, "Error: invalid directory\n");
         }
         else {
-            send_message(ctrl_fd, "Error: could not change directories\n");
+            session_error(s, STATUS_FAILED, "Error: could not change directories\n");
         }
     }
+    else if(fstat(fd, &st) == -1) {
+        session_error(s, STATUS_FAILED, "Error: could not change directories\n");
+        close(fd);
+    }
     else {
-        show_cwd(ctrl_fd);
+        close(s->dir_fd);
+        s->dir_fd = fd;
+        s->dir_dev = st.st_dev;
+        s->dir_ino = st.st_ino;
+        show_cwd(s);
     }
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Shows the client the current working directory
- * Param:   int ctrl_fd -  File descriptor of the control connection
+ * Shows the client the session's working directory
+ * Param:   struct session * s -  The session
  * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-void show_cwd(int ctrl_fd) {
-    char buf[BUF_SIZE];
+void show_cwd(struct session * s) {
+    char link[BUF_SIZE], buf[PATH_MAX];
+    ssize_t length;
 
-    if(getcwd(buf, BUF_SIZE) == NULL) {
+    snprintf(link, BUF_SIZE, "/proc/self/fd/%d", s->dir_fd);
+    if((length = readlink(link, buf, PATH_MAX - 1)) == -1) {
         perror("Error getting the current working directory");
-        close(ctrl_fd);
-        exit(EXIT_FAILURE);
+        session_error(s, STATUS_FAILED, "Error: could not get working directory\n");
+        return;
     }
-    send_message(ctrl_fd, "Remote working directory: ");
-    send_message(ctrl_fd, buf);
-    send_message(ctrl_fd, "\n");
+    buf[length] = '\0';
+
+    session_send(s, "Remote working directory: ");
+    session_send(s, buf);
+    session_send(s, "\n");
 }
 
 
@@ -329,23 +3452,29 @@ void show_cwd(int ctrl_fd) {
  * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 void signal_handler(int sig) {
-    if(control_fd != -1) {
+    struct session * s;
+    char summary[BUF_SIZE];
+
+    for(s = sessions; s != NULL; s = s->next) {
         printf("Closing client connection...\n");
-        send_message(control_fd, "Server closed connection.\n");
+        write(s->ctrl.fd, "Server closed connection.\n", 26);
 
-        close(control_fd);
-        control_fd = -1;
+        close(s->ctrl.fd);
         printf("Client connection closed\n");
     }
 
-    close(server_fd);
+    close(listener.fd);
+    cache_summary(summary, sizeof(summary));
+    printf("File cache: %s\n", summary);
     printf("Server shut down\n");
     exit(EXIT_SUCCESS);
 }
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Installs the signal handlers for the sigint and sigterm signals
+ * Installs the signal handlers for the sigint and sigterm signals and for
+ *      sighup (which reloads the limits), and ignores sigpipe so a vanished
+ *      client only ends its own session
  * Param:   void
  * Return:  void
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -358,4 +3487,20 @@ void install_sigint_handler(void) {
 
     sigaction(SIGINT, &sig, NULL);
     sigaction(SIGTERM, &sig, NULL);
+
+    sig.sa_handler = reload_handler;
+    sigaction(SIGHUP, &sig, NULL);
+
+    sig.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sig, NULL);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Signal handler for sighup: the limits are reloaded on the next tick
+ * Param:   int sig -  The signal received
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void reload_handler(int sig) {
+
+    reload_pending = 1;
 }
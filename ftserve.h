@@ -16,17 +16,276 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <fnmatch.h>
 #include "ftutil.h"
+#include "ftxfer.h"
+#include "ftloop.h"
+#include "ftworker.h"
+#include "ftcache.h"
+#include "ftsum.h"
+#include "ftdelta.h"
+#include "fttune.h"
+#include "ftshape.h"
+
+//Constants:
+#define NO_COMMAND -2
+#define TRANSFER_BURST 16
+#define SESSION_OUT_LIMIT (256 * 1024 * 1024)
+#define FRAME_READ_SIZE (65536 - FRAME_HEADER_SIZE)
+#define PENDING_LIMIT (2 * (FRAME_HEADER_SIZE + FRAME_READ_SIZE))
+#define LIST_READ_SIZE 32768
+#define LIST_LINE_MAX (NAME_MAX + 128)
+#define CACHE_REPORT_INTERVAL 60000
+#define UPLOAD_PIPE_SIZE (1024 * 1024)
+#define SHAPE_INTERVAL 5
+
+//Session States:
+#define SESSION_COMMAND 0
+#define SESSION_TRANSFER 1
+#define SESSION_CLOSED 2
+#define SESSION_SIGNATURES 3
+
+//Upload Flush Policies:
+#define FLUSH_NONE 0
+#define FLUSH_DATA 1
+#define FLUSH_ALL 2
+
+//Types:
+struct transfer;
+
+//A directory being walked by a recursive get, and the length of its path
+//in the archive
+struct walk_level {
+    DIR * dir;
+    size_t path_len;
+};
+
+//A sync: the client's signatures of its copy of a file (taken in from the
+//control connection as they arrive), then how far the server's copy has
+//been compared with them.  The file is read a window at a time; everything
+//before literal has been sent, and scan is where the search goes on from.
+struct sync {
+    char * name;
+    struct delta_index index;
+    char * sigs;
+    size_t sigs_len;
+    size_t received;
+    char * window;
+    off_t window_offset;
+    size_t window_len;
+    off_t scan;
+    off_t literal;
+    off_t size;
+    long expected;
+};
+
+//A file being uploaded.  It is received into a hidden file beside the one
+//it replaces, which is renamed over it only once all of it has arrived and
+//matches the client's checksum.
+struct upload {
+    char name[BUF_SIZE];
+    char temp[BUF_SIZE + 64];
+    int file_fd;
+    int pipe_fd[2];
+    int reading;
+    int stored;
+    off_t size;
+    off_t received;
+    off_t summed;
+    uint32_t sum;
+    uint32_t expected;
+};
+
+//Work queued for a single transfer: the files of an mget or a recursive
+//get, the entries of a directory listing, or the delta of a sync.  next()
+//queues the next part of it on the transfer and returns 0 once there is
+//nothing left.
+struct batch {
+    int (*next)(struct transfer * t);
+    char ** names;
+    size_t count;
+    size_t index;
+    int finished;
+    int dir_fd;
+    int format;
+    long limit;
+    long sent;
+    off_t cursor;
+    char * entries;
+    size_t entries_len;
+    size_t entries_pos;
+    struct walk_level * levels;
+    size_t depth;
+    size_t levels_cap;
+    char * path;
+    struct sync * sync;
+};
+
+//One client's control connection and everything it has asked for so far
+//(a striped get keeps several transfers in progress at once, and the
+//checksum of each stripe until they can be put together), what its
+//transfers have added up to, and the rate limit they share
+struct session {
+    struct watch ctrl;
+    int state;
+    int dir_fd;
+    dev_t dir_dev;
+    ino_t dir_ino;
+    int passive;
+    int compress;
+    int binary;
+    int status;
+    struct sockaddr_in peer;
+    struct tuning tuning;
+    struct bucket bucket;
+    int weight;
+    struct watch channel;
+    unsigned int next_stream;
+    struct ring in;
+    struct ring out;
+    struct transfer * transfer;
+    int stripes;
+    int stripes_summed;
+    uint32_t stripe_sums[MAX_STRIPES];
+    off_t stripe_lengths[MAX_STRIPES];
+    struct sync * sync;
+    long long opened_ns;
+    long commands;
+    struct xfer_totals sent;
+    struct xfer_totals received;
+    struct session * prev;
+    struct session * next;
+};
+
+//A data connection (or a stream on the session's multiplexed channel),
+//the payload being sent over it and how that has gone so far (and where
+//the path was last measured from it, see transfer_tune()).  Under a rate
+//limit it sends only as much as it has credit for, and waits in line (not
+//watching its connection) for more.
+struct transfer {
+    struct watch data;
+    struct session * session;
+    int listening;
+    int connected;
+    int channel_setup;
+    int failed;
+    unsigned int stream;
+    int status;
+    int ended;
+    struct ring pending;
+    int file_fd;
+    struct cache_entry * cached;
+    int stripe;
+    int summing;
+    uint32_t sum;
+    off_t sum_start;
+    off_t summed;
+    off_t sum_end;
+    off_t body_left;
+    struct xfer x;
+    struct codec codec;
+    char * stage;
+    size_t stage_len;
+    struct batch * batch;
+    struct upload * upload;
+    struct xfer_stats stats;
+    off_t tuned;
+    long long credit;
+    int waiting;
+    unsigned int wait_events;
+    struct transfer * wait_next;
+    struct transfer * next;
+};
 
 //Function Prototypes:
-int start_server(void);
-void handle_request(int ctrl_fd);
-int get_command(int ctrl_fd, char *arg);
-void list_directories(int ctrl_fd);
-int data_connect(int ctrl_fd);
-void send_file(int ctrl_fd, char *arg);
-void change_directory(int ctrl_fd, char * directory);
-void show_cwd(int ctrl_fd);
+void serve(int beat_fd);
+void server_tick(void);
+int start_server(int shared);
+void raise_fd_limit(void);
+void accept_session(struct watch * w, int fd);
+struct session * session_open(int ctrl_fd);
+void session_ready(struct watch * w, unsigned int events);
+void session_read(struct session * s);
+void session_send(struct session * s, char * message);
+void session_error(struct session * s, int status, char * message);
+void session_status(struct session * s, int status);
+void session_prompt(struct session * s);
+void session_flush(struct session * s);
+void session_watch(struct session * s);
+void session_close(struct session * s);
+void handle_request(struct session * s);
+int get_command(struct session * s, char * buffer, char * arg);
+void list_directories(struct session * s, char * request);
+int batch_next_entries(struct transfer * t);
+size_t format_entry(int dir_fd, int format, struct dirent64 * entry, char * buf, size_t size);
+struct transfer * data_connect(struct session * s);
+struct transfer * data_listen(struct session * s);
+struct transfer * data_stream(struct session * s);
+void transfer_body(struct transfer * t, int file_fd, off_t offset, off_t length);
+void transfer_close_file(struct transfer * t);
+void transfer_sum(struct transfer * t);
+ssize_t transfer_pread(struct transfer * t, char * buf, size_t count, off_t offset);
+void transfer_ready(struct watch * w, unsigned int events);
+void transfer_cork(struct transfer * t);
+int transfer_pump(struct transfer * t);
+int transfer_submit(struct transfer * t);
+void transfer_sent(struct watch * w, int filled, int sent);
+void transfer_tune(struct transfer * t);
+int transfer_receive(struct transfer * t);
+int transfer_next(struct transfer * t);
+void transfer_data(struct transfer * t, const char * data, size_t length);
+void transfer_compress(struct transfer * t);
+void transfer_seal(struct transfer * t);
+ssize_t transfer_read_block(struct transfer * t);
+void transfer_attach(struct session * s, struct transfer * t);
+void finish_transfer(struct transfer * t);
+void release_transfer(struct transfer * t);
+int session_shaped(struct session * s);
+int transfer_throttled(struct transfer * t);
+long long transfer_grant(struct transfer * t, long long now_ns);
+void transfer_charge(struct transfer * t, ssize_t sent);
+void transfer_unwait(struct transfer * t);
+void dispatch_waiting(void);
+void session_limit(struct session * s);
+void apply_limits(void);
+void reload_limits(void);
+void toggle_channel(struct session * s);
+void channel_ready(struct watch * w, unsigned int events);
+void send_file(struct session * s, char * filename, off_t offset, off_t length);
+void send_stripes(struct session * s, char * filename, int count);
+void stripe_done(struct transfer * t);
+void stripes_sum(struct session * s);
+void send_batch(struct session * s, char * pattern);
+int batch_next_file(struct transfer * t);
+void batch_body(struct transfer * t, int fd, off_t size);
+void batch_sum(struct transfer * t);
+int batch_finish(struct transfer * t);
+void send_tree(struct session * s, char * directory);
+int batch_next_tree(struct transfer * t);
+int walk_push(struct batch * b, int dir_fd, size_t path_len);
+void start_sync(struct session * s, char * request, char * filename);
+void read_signatures(struct session * s);
+void send_delta(struct session * s, struct sync * y);
+int batch_next_delta(struct transfer * t);
+void sync_free(struct sync * y);
+void batch_free(struct batch * b);
+int compare_names(const void * a, const void * b);
+void receive_upload(struct session * s, char * request, char * filename);
+void upload_sum(struct upload * u);
+void finish_upload(struct transfer * t);
+void upload_free(struct upload * u, int dir_fd);
+void show_size(struct session * s, char * filename);
+void show_sum(struct session * s, char * filename, off_t offset, off_t length);
+void show_stats(struct session * s);
+char * open_error(int error);
+int open_status(int error);
+void change_directory(struct session * s, char * directory);
+void show_cwd(struct session * s);
 void signal_handler(int signal);
 void install_sigint_handler(void);
+void reload_handler(int sig);
 
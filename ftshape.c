@@ -0,0 +1,237 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftshape.c
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Bandwidth shaping.  Token buckets that limit
+ *      how fast data is sent, and the limits file that says
+ *      which clients get which rate (and weight), e.g.:
+ *
+ *          # <address>[/<prefix>] <rate> [<weight>]
+ *          all          1G
+ *          default      100M
+ *          10.1.0.0/16  unlimited 4
+ *          10.1.2.3     20M
+ *
+ *      Rates are in bits per second (K, M and G suffixes),
+ *      "all" limits the whole server, and "default" covers
+ *      clients no other line matches.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include "ftshape.h"
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sets a bucket's rate.  A bucket that was not limited before starts full.
+ * Param:   struct bucket * b -  The bucket
+ * Param:   long long rate -  Bytes per second, or 0 for no limit
+ * Param:   long long now_ns -  The time (see xfer_clock_ns())
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void bucket_set(struct bucket * b, long long rate, long long now_ns) {
+    long long burst = rate / (1000 / SHAPE_BURST_MS);
+
+    bucket_refill(b, now_ns);
+    if(b->rate == 0) {
+        b->tokens = burst > SHAPE_QUANTUM ? burst : SHAPE_QUANTUM;
+    }
+    b->rate = rate;
+    b->burst = burst > SHAPE_QUANTUM ? burst : SHAPE_QUANTUM;
+    b->updated_ns = now_ns;
+    if(b->tokens > b->burst) {
+        b->tokens = b->burst;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Adds the tokens that have accumulated since the bucket was last refilled
+ * Param:   struct bucket * b -  The bucket
+ * Param:   long long now_ns -  The time (see xfer_clock_ns())
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void bucket_refill(struct bucket * b, long long now_ns) {
+    double added;
+
+    if(b->rate == 0 || now_ns <= b->updated_ns) {
+        return;
+    }
+
+    added = (double) b->rate * (now_ns - b->updated_ns) / 1e9;
+    b->tokens = b->tokens + added < b->burst ? b->tokens + (long long) added : b->burst;
+    b->updated_ns = now_ns;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Takes tokens from a bucket (nothing, if it is not limited)
+ * Param:   struct bucket * b -  The bucket
+ * Param:   long long count -  Bytes about to be sent
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void bucket_take(struct bucket * b, long long count) {
+
+    if(b->rate > 0) {
+        b->tokens -= count;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads a limits file.  On an error nothing is changed, so a server that is
+ *      reloading its limits keeps the ones it has.
+ * Param:   const char * path -  The file
+ * Param:   struct shape_rules * rules -  Replaced with the file's rules
+ * Return:  int -  0 on success, -1 if the file could not be read or has an
+ *      invalid line (the reason has been printed)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int shape_load(const char * path, struct shape_rules * rules) {
+    struct shape_rules loaded = { NULL, 0, 0 };
+    char line[SHAPE_LINE_SIZE];
+    FILE * file;
+    int number = 0;
+
+    if((file = fopen(path, "r")) == NULL) {
+        perror("Error opening limits file");
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), file) != NULL) {
+        number++;
+        if(shape_parse_line(line, &loaded) == -1) {
+            printf("Error in limits file %s, line %d: %s", path, number, line);
+            fclose(file);
+            shape_free(&loaded);
+            return -1;
+        }
+    }
+    fclose(file);
+
+    shape_free(rules);
+    *rules = loaded;
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Adds a line of a limits file to its rules (blank lines and lines starting
+ *      with '#' add nothing)
+ * Param:   char * line -  The line
+ * Param:   struct shape_rules * rules -  The rules so far
+ * Return:  int -  0 on success, or -1 if the line is invalid
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int shape_parse_line(char * line, struct shape_rules * rules) {
+    char address[64], rate[64], weight[16], extra[2], * slash, * end;
+    struct shape_rule rule = { 0, 0, 0, 0, 1 };
+    struct shape_rule * grown;
+    struct in_addr network;
+    int fields;
+
+    if((fields = sscanf(line, "%63s %63s %15s %1s", address, rate, weight, extra)) < 1 || address[0] == '#') {
+        return 0;
+    }
+    if(fields < 2 || fields > 3 || (rule.rate = shape_parse_rate(rate)) == -1) {
+        return -1;
+    }
+    if(fields == 3) {
+        rule.weight = strtol(weight, &end, 10);
+        if(*end != '\0' || rule.weight < 1 || rule.weight > SHAPE_WEIGHT_MAX) {
+            return -1;
+        }
+    }
+
+    //The limit on the whole server:
+    if(strcmp(address, "all") == 0) {
+        rules->total = rule.rate;
+        return 0;
+    }
+
+    //Everyone else is 0.0.0.0/0; otherwise a host or a network:
+    if(strcmp(address, "default") != 0) {
+        if((slash = strchr(address, '/')) != NULL) {
+            *slash = '\0';
+            rule.prefix = strtol(slash + 1, &end, 10);
+            if(end == slash + 1 || *end != '\0' || rule.prefix < 0 || rule.prefix > 32) {
+                return -1;
+            }
+        }
+        else {
+            rule.prefix = 32;
+        }
+        if(inet_pton(AF_INET, address, &network) != 1) {
+            return -1;
+        }
+        rule.mask = rule.prefix == 0 ? 0 : htonl(0xffffffffu << (32 - rule.prefix));
+        rule.network = network.s_addr & rule.mask;
+    }
+
+    if((grown = realloc(rules->rules, (rules->count + 1) * sizeof(*grown))) == NULL) {
+        perror("Error allocating memory");
+        return -1;
+    }
+    rules->rules = grown;
+    rules->rules[rules->count++] = rule;
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Parses a rate limit: bits per second as tune_parse_rate() takes them, or
+ *      "unlimited"
+ * Param:   const char * text -  The rate
+ * Return:  long long -  Bytes per second (0 for no limit), or -1 if invalid
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+long long shape_parse_rate(const char * text) {
+
+    if(strcmp(text, "unlimited") == 0) {
+        return 0;
+    }
+    return tune_parse_rate(text);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Finds the limit for a client: the rule with the longest prefix that
+ *      covers its address
+ * Param:   struct shape_rules * rules -  The rules
+ * Param:   struct in_addr address -  The client's address
+ * Param:   long long * rate -  Set to its rate (0 if no rule covers it)
+ * Param:   int * weight -  Set to its weight (1 if no rule covers it)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void shape_match(struct shape_rules * rules, struct in_addr address, long long * rate, int * weight) {
+    struct shape_rule * best = NULL;
+    size_t i;
+
+    for(i=0; i<rules->count; i++) {
+        if((address.s_addr & rules->rules[i].mask) == rules->rules[i].network &&
+           (best == NULL || rules->rules[i].prefix >= best->prefix)) {
+            best = &rules->rules[i];
+        }
+    }
+
+    *rate = best != NULL ? best->rate : 0;
+    *weight = best != NULL ? best->weight : 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Frees a set of rules, leaving it empty
+ * Param:   struct shape_rules * rules -  The rules
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void shape_free(struct shape_rules * rules) {
+
+    free(rules->rules);
+    rules->rules = NULL;
+    rules->count = 0;
+    rules->total = 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Describes a limit, e.g. "20 Mbit/s, weight 1"
+ * Param:   long long rate -  Bytes per second, or 0 for no limit
+ * Param:   int weight -  The weight
+ * Param:   char * buf -  Buffer for the description
+ * Param:   size_t size -  Size of the buffer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void shape_summary(long long rate, int weight, char * buf, size_t size) {
+
+    if(rate > 0) {
+        snprintf(buf, size, "%.1f Mbit/s, weight %d", rate * 8 / 1e6, weight);
+    }
+    else {
+        snprintf(buf, size, "unlimited, weight %d", weight);
+    }
+}
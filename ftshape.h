@@ -0,0 +1,71 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftshape.h
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Header file for ftshape.c
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "fttune.h"
+
+#ifndef FTSHAPE_H
+#define FTSHAPE_H
+
+//CONSTANTS:
+
+#define SHAPE_BURST_MS 50
+#define SHAPE_QUANTUM (64 * 1024)
+#define SHAPE_WEIGHT_MAX 100
+#define SHAPE_LINE_SIZE 256
+
+
+//TYPES:
+
+//A token bucket: rate bytes per second (0 for no limit) accumulate as
+//tokens, up to burst of them, and each byte sent takes one.  Tokens may go
+//negative when a send overshoots, which later sends pay back.
+struct bucket {
+    long long rate;
+    long long burst;
+    long long tokens;
+    long long updated_ns;
+};
+
+//A line of the limits file: the clients in a network (the longest prefix
+//that matches wins), the rate each may use, and its weight when clients
+//wait for the same tokens
+struct shape_rule {
+    in_addr_t network;
+    in_addr_t mask;
+    int prefix;
+    long long rate;
+    int weight;
+};
+
+//The limits file: its rules, and the limit on the whole server (0 for none)
+struct shape_rules {
+    struct shape_rule * rules;
+    size_t count;
+    long long total;
+};
+
+
+//FUNCTION PROTOTYPES:
+
+void bucket_set(struct bucket * b, long long rate, long long now_ns);
+void bucket_refill(struct bucket * b, long long now_ns);
+void bucket_take(struct bucket * b, long long count);
+int shape_load(const char * path, struct shape_rules * rules);
+int shape_parse_line(char * line, struct shape_rules * rules);
+long long shape_parse_rate(const char * text);
+void shape_match(struct shape_rules * rules, struct in_addr address, long long * rate, int * weight);
+void shape_free(struct shape_rules * rules);
+void shape_summary(long long rate, int weight, char * buf, size_t size);
+
+#endif
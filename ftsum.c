@@ -0,0 +1,386 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftsum.c
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: CRC32C checksums of transferred files.  On
+ *      x86-64 processors with SSE4.2 the CRC instruction is
+ *      run over three blocks at once (so that its latency is
+ *      hidden) and the three results are combined with a
+ *      table; elsewhere a portable slice-by-8 table version
+ *      is used.  Either way the result is the standard
+ *      CRC32C (iSCSI) of the data.  XXH64 is used where a
+ *      64-bit hash of a block is wanted instead (see ftdelta.c).
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include "ftsum.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+//Static Variables:
+static uint32_t table[8][256];
+static uint32_t shift_table[4][256];
+static int hardware;
+static int ready;
+static char buffer[SUM_READ_SIZE];
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Updates a raw CRC register with the portable table method
+ * Param:   uint32_t crc -  The register
+ * Param:   const unsigned char * p -  Data
+ * Param:   size_t length -  Number of bytes
+ * Return:  uint32_t -  The register after the data
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint32_t sum_soft(uint32_t crc, const unsigned char * p, size_t length) {
+    uint32_t hi;
+
+    //Eight bytes at a time:
+    while(length >= 8) {
+        crc ^= (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+        hi = (uint32_t) p[4] | (uint32_t) p[5] << 8 | (uint32_t) p[6] << 16 | (uint32_t) p[7] << 24;
+        crc = table[7][crc & 0xff] ^ table[6][(crc >> 8) & 0xff] ^
+              table[5][(crc >> 16) & 0xff] ^ table[4][crc >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+        p += 8;
+        length -= 8;
+    }
+
+    while(length > 0) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        length--;
+    }
+
+    return crc;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Advances a raw CRC register past SUM_BLOCK zero bytes (what a register
+ *      computed for one block is worth once the blocks after it are added)
+ * Param:   uint32_t crc -  The register
+ * Return:  uint32_t -  The register after SUM_BLOCK zero bytes
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint32_t sum_shift(uint32_t crc) {
+    return shift_table[0][crc & 0xff] ^ shift_table[1][(crc >> 8) & 0xff] ^
+           shift_table[2][(crc >> 16) & 0xff] ^ shift_table[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Updates a raw CRC register with the SSE4.2 CRC32 instruction
+ * Param:   uint32_t crc -  The register
+ * Param:   const unsigned char * p -  Data
+ * Param:   size_t length -  Number of bytes
+ * Return:  uint32_t -  The register after the data
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+__attribute__((target("sse4.2")))
+static uint32_t sum_hard(uint32_t crc, const unsigned char * p, size_t length) {
+    uint64_t c0, c1, c2, v0, v1, v2;
+    size_t i;
+
+    while(length > 0 && ((uintptr_t) p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        length--;
+    }
+
+    //Three independent blocks at a time keep the instruction's pipeline full:
+    while(length >= 3 * SUM_BLOCK) {
+        c0 = crc;
+        c1 = 0;
+        c2 = 0;
+        for(i=0; i<SUM_BLOCK; i+=8) {
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p + SUM_BLOCK + i, 8);
+            memcpy(&v2, p + 2 * SUM_BLOCK + i, 8);
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        crc = sum_shift(sum_shift((uint32_t) c0) ^ (uint32_t) c1) ^ (uint32_t) c2;
+        p += 3 * SUM_BLOCK;
+        length -= 3 * SUM_BLOCK;
+    }
+
+    while(length >= 8) {
+        memcpy(&v0, p, 8);
+        crc = (uint32_t) _mm_crc32_u64(crc, v0);
+        p += 8;
+        length -= 8;
+    }
+    while(length > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        length--;
+    }
+
+    return crc;
+}
+#endif
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Builds the tables, and checks for the CRC instruction
+ * Param:   void
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void sum_init(void) {
+    static const unsigned char zeros[SUM_BLOCK];
+    uint32_t crc, basis[32];
+    int i, j, k;
+
+    for(i=0; i<256; i++) {
+        crc = i;
+        for(j=0; j<8; j++) {
+            crc = (crc >> 1) ^ (SUM_POLY & -(crc & 1));
+        }
+        table[0][i] = crc;
+    }
+    for(k=1; k<8; k++) {
+        for(i=0; i<256; i++) {
+            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+        }
+    }
+
+    //Skipping zero bytes is linear in the register, so it is tabulated from
+    //where each single bit ends up:
+    for(i=0; i<32; i++) {
+        basis[i] = sum_soft(1u << i, zeros, SUM_BLOCK);
+    }
+    for(k=0; k<4; k++) {
+        for(i=0; i<256; i++) {
+            for(crc=0, j=0; j<8; j++) {
+                crc ^= (i >> j) & 1 ? basis[8 * k + j] : 0;
+            }
+            shift_table[k][i] = crc;
+        }
+    }
+
+#if defined(__x86_64__)
+    hardware = __builtin_cpu_supports("sse4.2");
+#endif
+    ready = 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Adds data to a CRC32C checksum
+ * Param:   uint32_t sum -  Checksum of the data so far (0 to start)
+ * Param:   const void * buf -  More data
+ * Param:   size_t length -  Number of bytes
+ * Return:  uint32_t -  Checksum including the new data
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+uint32_t sum_crc32c(uint32_t sum, const void * buf, size_t length) {
+
+    if(!ready) {
+        sum_init();
+    }
+
+#if defined(__x86_64__)
+    if(hardware) {
+        return ~sum_hard(~sum, buf, length);
+    }
+#endif
+    return ~sum_soft(~sum, buf, length);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Adds part of a file to a CRC32C checksum
+ * Param:   int fd -  The file
+ * Param:   off_t offset -  Where the part starts
+ * Param:   off_t length -  Number of bytes
+ * Param:   uint32_t * sum -  The checksum, updated in place
+ * Return:  off_t -  Bytes added (less than length if the file ended first),
+ *      or -1 on error
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+off_t sum_file(int fd, off_t offset, off_t length, uint32_t * sum) {
+    off_t total = 0;
+    ssize_t n;
+
+    while(total < length) {
+        n = length - total < SUM_READ_SIZE ? length - total : SUM_READ_SIZE;
+        if((n = pread(fd, buffer, n, offset + total)) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if(n == 0) {
+            break;
+        }
+        *sum = sum_crc32c(*sum, buffer, n);
+        total += n;
+    }
+
+    return total;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Multiplies a 32-bit vector by a 32x32 matrix over GF(2)
+ * Param:   const uint32_t * matrix -  The matrix, one column per bit
+ * Param:   uint32_t vector -  The vector
+ * Return:  uint32_t -  The product
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint32_t sum_gf2_times(const uint32_t * matrix, uint32_t vector) {
+    uint32_t product = 0;
+
+    for(; vector != 0; vector >>= 1, matrix++) {
+        if(vector & 1) {
+            product ^= *matrix;
+        }
+    }
+    return product;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Squares a 32x32 matrix over GF(2)
+ * Param:   uint32_t * square -  Set to the square
+ * Param:   const uint32_t * matrix -  The matrix
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void sum_gf2_square(uint32_t * square, const uint32_t * matrix) {
+    int i;
+
+    for(i=0; i<32; i++) {
+        square[i] = sum_gf2_times(matrix, matrix[i]);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Works out the CRC32C checksum of two pieces of data one after the other
+ *      from the checksums of each, without the data.  The first checksum is
+ *      run through as many zero bytes as the second piece is long (by
+ *      repeatedly squaring the operator for one zero bit), and the second
+ *      is added to it.
+ * Param:   uint32_t first -  Checksum of the first piece
+ * Param:   uint32_t second -  Checksum of the second piece
+ * Param:   off_t length -  Length of the second piece
+ * Return:  uint32_t -  Checksum of both pieces together
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+uint32_t sum_combine(uint32_t first, uint32_t second, off_t length) {
+    uint32_t even[32], odd[32], row = 1;
+    int i;
+
+    if(length <= 0) {
+        return first;
+    }
+
+    //The operator for one zero bit, then for two and four:
+    odd[0] = SUM_POLY;
+    for(i=1; i<32; i++) {
+        odd[i] = row;
+        row <<= 1;
+    }
+    sum_gf2_square(even, odd);
+    sum_gf2_square(odd, even);
+
+    //Apply the operator for each set bit of the length in bytes:
+    do {
+        sum_gf2_square(even, odd);
+        if(length & 1) {
+            first = sum_gf2_times(even, first);
+        }
+        length >>= 1;
+        if(length == 0) {
+            break;
+        }
+        sum_gf2_square(odd, even);
+        if(length & 1) {
+            first = sum_gf2_times(odd, first);
+        }
+        length >>= 1;
+    } while(length != 0);
+
+    return first ^ second;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads 8 bytes, least significant first
+ * Param:   const unsigned char * p -  The bytes
+ * Return:  uint64_t -  Their value
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint64_t sum_read64(const unsigned char * p) {
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24 |
+           (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 | (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Mixes 8 bytes of input into one of XXH64's accumulators
+ * Param:   uint64_t acc -  The accumulator
+ * Param:   uint64_t input -  The input
+ * Return:  uint64_t -  The new accumulator
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint64_t sum_xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * XXH_PRIME1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Folds one of XXH64's accumulators into the hash
+ * Param:   uint64_t hash -  The hash
+ * Param:   uint64_t acc -  The accumulator
+ * Return:  uint64_t -  The new hash
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static uint64_t sum_xxh_merge(uint64_t hash, uint64_t acc) {
+    hash ^= sum_xxh_round(0, acc);
+    return hash * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Hashes a buffer with XXH64 (seed 0): a fast 64-bit hash for telling blocks
+ *      of data apart, not a checksum
+ * Param:   const void * buf -  Data
+ * Param:   size_t length -  Number of bytes
+ * Return:  uint64_t -  The hash
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+uint64_t sum_xxh64(const void * buf, size_t length) {
+    const unsigned char * p = buf, * end = p + length;
+    uint64_t v1, v2, v3, v4, hash;
+
+    //Four lanes of 8 bytes at a time:
+    if(length >= 32) {
+        v1 = XXH_PRIME1 + XXH_PRIME2;
+        v2 = XXH_PRIME2;
+        v3 = 0;
+        v4 = -XXH_PRIME1;
+        while(end - p >= 32) {
+            v1 = sum_xxh_round(v1, sum_read64(p));
+            v2 = sum_xxh_round(v2, sum_read64(p + 8));
+            v3 = sum_xxh_round(v3, sum_read64(p + 16));
+            v4 = sum_xxh_round(v4, sum_read64(p + 24));
+            p += 32;
+        }
+        hash = ((v1 << 1) | (v1 >> 63)) + ((v2 << 7) | (v2 >> 57)) +
+               ((v3 << 12) | (v3 >> 52)) + ((v4 << 18) | (v4 >> 46));
+        hash = sum_xxh_merge(hash, v1);
+        hash = sum_xxh_merge(hash, v2);
+        hash = sum_xxh_merge(hash, v3);
+        hash = sum_xxh_merge(hash, v4);
+    }
+    else {
+        hash = XXH_PRIME5;
+    }
+    hash += length;
+
+    //Then the rest:
+    while(end - p >= 8) {
+        hash ^= sum_xxh_round(0, sum_read64(p));
+        hash = ((hash << 27) | (hash >> 37)) * XXH_PRIME1 + XXH_PRIME4;
+        p += 8;
+    }
+    if(end - p >= 4) {
+        hash ^= ((uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24) * XXH_PRIME1;
+        hash = ((hash << 23) | (hash >> 41)) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    while(p < end) {
+        hash ^= *p++ * XXH_PRIME5;
+        hash = ((hash << 11) | (hash >> 53)) * XXH_PRIME1;
+    }
+
+    //Avalanche:
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
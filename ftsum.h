@@ -0,0 +1,37 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftsum.h
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Header file for ftsum.c
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifndef FTSUM_H
+#define FTSUM_H
+
+//CONSTANTS:
+
+#define SUM_POLY 0x82f63b78u
+#define SUM_BLOCK 4096
+#define SUM_READ_SIZE (256 * 1024)
+#define XXH_PRIME1 0x9e3779b185ebca87ull
+#define XXH_PRIME2 0xc2b2ae3d27d4eb4full
+#define XXH_PRIME3 0x165667b19e3779f9ull
+#define XXH_PRIME4 0x85ebca77c2b2ae63ull
+#define XXH_PRIME5 0x27d4eb2f165667c5ull
+
+
+//FUNCTION PROTOTYPES:
+
+uint32_t sum_crc32c(uint32_t sum, const void * buf, size_t length);
+off_t sum_file(int fd, off_t offset, off_t length, uint32_t * sum);
+uint32_t sum_combine(uint32_t first, uint32_t second, off_t length);
+uint64_t sum_xxh64(const void * buf, size_t length);
+
+#endif
@@ -0,0 +1,428 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: fttune.c
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Socket tuning.  Sizes a session's data
+ *      connection buffers to the bandwidth-delay product
+ *      of its path (the RTT the kernel measured during the
+ *      control connection's handshake, times the rate the
+ *      path is measured to carry once data flows, capped
+ *      by the speed of the network interface), picks the
+ *      congestion control and pacing, and sets TCP_NODELAY
+ *      and TCP_CORK where they help.
+ *      Control connections are marked interactive and data
+ *      connections bulk, so replies are not queued behind
+ *      data on the way out.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include "fttune.h"
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Works out how a session's data connections should be tuned when it
+ *      starts.  The RTT is known from the handshake, but a path only shows
+ *      what it can carry once data flows over it, so unless the rate is
+ *      given the buffers are left to autotuning until tune_sample() or
+ *      tune_observe() has measured it.
+ * Param:   struct tuning * t -  Set to the tuning chosen
+ * Param:   int ctrl_fd -  The session's control connection (connected)
+ * Param:   long long rate -  Path rate in bytes per second, or 0 to measure
+ *      it (up to the speed of the network interface the session runs over)
+ * Param:   const char * congestion -  Congestion control to use where the
+ *      kernel allows it (e.g. "bbr"), or NULL for the system default
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void tune_measure(struct tuning * t, int ctrl_fd, long long rate, const char * congestion) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+
+    memset(t, 0, sizeof(*t));
+
+    //The kernel has an RTT sample from the handshake already:
+    if(getsockopt(ctrl_fd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0) {
+        t->rtt_us = info.tcpi_rtt;
+    }
+    t->link = tune_link_rate(ctrl_fd);
+    t->fixed = rate > 0;
+    t->rate = rate;
+
+    //Autotuning grows the buffers up to the third field of tcp_wmem and
+    //tcp_rmem (see tune_size()):
+    t->wmem_auto = tune_sysctl("/proc/sys/net/ipv4/tcp_wmem", 2);
+    t->rmem_auto = tune_sysctl("/proc/sys/net/ipv4/tcp_rmem", 2);
+
+    //Try the congestion control on the control connection (which benefits
+    //from it too), and keep whatever the kernel ends up using:
+    if(congestion != NULL) {
+        setsockopt(ctrl_fd, IPPROTO_TCP, TCP_CONGESTION, congestion, strlen(congestion));
+    }
+    length = sizeof(t->congestion) - 1;
+    if(getsockopt(ctrl_fd, IPPROTO_TCP, TCP_CONGESTION, t->congestion, &length) == -1) {
+        t->congestion[0] = '\0';
+    }
+
+    tune_size(t);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Sizes the buffers and pacing to the tuning's RTT and path rate
+ * Param:   struct tuning * t -  The tuning
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void tune_size(struct tuning * t) {
+
+    t->bdp = t->rate * t->rtt_us / 1000000;
+
+    //Autotuning needs about twice the BDP (the rest is overhead).  Only when
+    //that is not enough are the buffers set, which turns autotuning off:
+    t->sndbuf = tune_buffer(t->bdp, t->wmem_auto, tune_sysctl("/proc/sys/net/core/wmem_max", 0), &t->sndbuf_capped);
+    t->rcvbuf = tune_buffer(t->bdp, t->rmem_auto, tune_sysctl("/proc/sys/net/core/rmem_max", 0), &t->rcvbuf_capped);
+
+    //BBR paces itself; otherwise keep bursts to the rate given, or a little
+    //above the rate measured, so the pacing never holds the path to an
+    //estimate that is too low (the next measurement can still raise it):
+    t->pacing = 0;
+    if(t->rate > 0 && strcmp(t->congestion, "bbr") != 0) {
+        t->pacing = t->fixed ? t->rate : t->rate * TUNE_PACING_GAIN / 100;
+        if(!t->fixed && t->link > 0 && t->pacing > t->link) {
+            t->pacing = t->link;
+        }
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Measures the path's rate from a connection the data is sent over: the
+ *      kernel's delivery rate (the rate its recent segments were
+ *      acknowledged at), but no more than the transfer's average so far,
+ *      since a short burst can be acknowledged far faster than the path
+ *      carries data for long.  A connection that spent most of its time
+ *      held back by the receiver's window or its own send buffer says more
+ *      about the buffers than the path (see tune_estimate()).
+ * Param:   struct tuning * t -  The tuning, retuned if the path turns out
+ *      to be faster than it was sized for
+ * Param:   int fd -  The connection
+ * Param:   long long sent -  Bytes the transfer has written to it
+ * Param:   long long ns -  Nanoseconds since its first byte was written
+ * Return:  int -  1 if the tuning changed, 0 if not
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int tune_sample(struct tuning * t, int fd, long long sent, long long ns) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    long long limited, average;
+    int queued;
+
+    //Only what has left the send queue has crossed the path:
+    if(ioctl(fd, SIOCOUTQ, &queued) == 0) {
+        sent -= queued;
+    }
+    if(sent < TUNE_SAMPLE_BYTES || ns <= 0) {
+        return 0;
+    }
+    average = (long long) (sent * 1e9 / ns);
+
+    //(Kernels before 4.10 don't report the delivery rate and limits)
+    memset(&info, 0, sizeof(info));
+    if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) == -1 || info.tcpi_delivery_rate == 0) {
+        return 0;
+    }
+
+    //The least RTT the data saw is the path's own, without its queues:
+    if(info.tcpi_min_rtt > 0 && (t->rtt_us == 0 || info.tcpi_min_rtt < t->rtt_us)) {
+        t->rtt_us = info.tcpi_min_rtt;
+    }
+
+    limited = info.tcpi_rwnd_limited + info.tcpi_sndbuf_limited;
+    return tune_estimate(t, (long long) info.tcpi_delivery_rate < average ? (long long) info.tcpi_delivery_rate : average,
+                         2 * limited > (long long) info.tcpi_busy_time);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Measures the path's rate from a transfer that was received (where the
+ *      kernel has no delivery rate to report): the bytes over the time from
+ *      the first to the last.  A transfer whose rate filled most of the
+ *      window the receive buffer allows may have been held back by it.
+ * Param:   struct tuning * t -  The tuning, retuned if the path turns out
+ *      to be faster than it was sized for
+ * Param:   long long bytes -  Bytes the transfer received
+ * Param:   long long ns -  Nanoseconds from its first byte to its last
+ * Return:  int -  1 if the tuning changed, 0 if not
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int tune_observe(struct tuning * t, long long bytes, long long ns) {
+    long long rate, window;
+
+    if(bytes < TUNE_SAMPLE_BYTES || ns <= 0) {
+        return 0;
+    }
+    rate = (long long) (bytes * 1e9 / ns);
+
+    //The kernel doubles a buffer that is set, and autotuning keeps half of
+    //its own for overhead:
+    window = t->rcvbuf > 0 ? t->rcvbuf : t->rmem_auto / 2;
+    return tune_estimate(t, rate, window > 0 && rate * t->rtt_us / 1000000 >= window * 3 / 4);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Takes a measurement of the path's rate.  The fastest one so far stands
+ *      (a slower one only means the path was not kept busy), up to the
+ *      speed of the network interface.  One that was held back by a buffer
+ *      only shows that the path can carry at least that much, so the rate
+ *      is doubled, and the next measurement (with buffers sized for it)
+ *      shows whether the path keeps up.
+ * Param:   struct tuning * t -  The tuning, retuned if the rate went up
+ * Param:   long long rate -  The rate measured, in bytes per second
+ * Param:   int limited -  Whether a buffer held the transfer back
+ * Return:  int -  1 if the tuning changed, 0 if not
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int tune_estimate(struct tuning * t, long long rate, int limited) {
+
+    if(t->fixed || rate <= 0) {
+        return 0;
+    }
+    if(limited) {
+        rate *= 2;
+    }
+    if(t->link > 0 && rate > t->link) {
+        rate = t->link;
+    }
+    if(rate <= t->rate) {
+        return 0;
+    }
+
+    t->rate = rate;
+    tune_size(t);
+    return 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Chooses the size of a socket buffer for a bandwidth-delay product
+ * Param:   long long bdp -  The bandwidth-delay product (0 if unknown)
+ * Param:   long long autotune -  Most autotuning grows the buffer to
+ * Param:   long long core_max -  Most an unprivileged process can set
+ * Param:   int * capped -  Set if core_max keeps the buffer below the BDP
+ * Return:  int -  Size to set, or 0 to leave the buffer to autotuning
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int tune_buffer(long long bdp, long long autotune, long long core_max, int * capped) {
+    long long size = bdp < TUNE_BUF_MAX ? bdp : TUNE_BUF_MAX;
+
+    *capped = 0;
+    if(bdp <= 0 || autotune <= 0 || 2 * bdp <= autotune) {
+        return 0;
+    }
+
+    //Without CAP_NET_ADMIN (for SO_SNDBUFFORCE) the kernel caps what is set,
+    //and a capped buffer smaller than autotuning would reach is no help:
+    if(geteuid() != 0 && core_max > 0 && size > core_max) {
+        *capped = 1;
+        size = core_max;
+        if(2 * size <= autotune) {
+            return 0;
+        }
+    }
+
+    return size;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Applies the tuning to a data socket.  Called before it connects or
+ *      listens, so the window scale covers the buffers (connections a
+ *      passive socket accepts inherit its settings).
+ * Param:   struct tuning * t -  The tuning from tune_measure()
+ * Param:   int fd -  The socket
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void tune_apply(struct tuning * t, int fd) {
+    unsigned long long pacing64 = t->pacing;
+    unsigned int pacing32 = t->pacing < UINT_MAX ? t->pacing : UINT_MAX;
+    int tos = IPTOS_THROUGHPUT;
+
+    //Bulk data (which also puts it in the host's lowest priority queue):
+    setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+
+    if(t->sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &t->sndbuf, sizeof(t->sndbuf)) == -1) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &t->sndbuf, sizeof(t->sndbuf));
+    }
+    if(t->rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &t->rcvbuf, sizeof(t->rcvbuf)) == -1) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &t->rcvbuf, sizeof(t->rcvbuf));
+    }
+    if(t->congestion[0] != '\0') {
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, t->congestion, strlen(t->congestion));
+    }
+
+    //Kernels before 4.20 only take a 32-bit rate:
+    if(t->pacing > 0 && setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing64, sizeof(pacing64)) == -1) {
+        setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing32, sizeof(pacing32));
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Tunes a control connection: commands and replies are written whole, so
+ *      Nagle's algorithm would only hold them back waiting for an ack, and
+ *      they go out ahead of any bulk data queued on the host
+ * Param:   int fd -  The control connection
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void tune_control(int fd) {
+    int one = 1, tos = IPTOS_LOWDELAY, priority = TUNE_CONTROL_PRIORITY;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority));
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Corks (or uncorks) a data connection.  While corked, the headers a
+ *      transfer writes ahead of a file go out in full segments with its
+ *      data instead of as small packets of their own; whatever is left is
+ *      sent when the connection is uncorked or closed.
+ * Param:   int fd -  The data connection
+ * Param:   int on -  1 to cork, 0 to uncork
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void tune_cork(int fd, int on) {
+
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Finds the speed of the network interface a connection runs over
+ * Param:   int fd -  The connection
+ * Return:  long long -  The speed in bytes per second, or 0 if it is not
+ *      known (e.g. loopback and most virtual interfaces)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+long long tune_link_rate(int fd) {
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    struct ifaddrs * list, * i;
+    char path[PATH_MAX];
+    long long speed = 0;
+
+    if(getsockname(fd, (struct sockaddr *) &address, &length) == -1 || getifaddrs(&list) == -1) {
+        return 0;
+    }
+
+    for(i = list; i != NULL; i = i->ifa_next) {
+        if(i->ifa_addr != NULL && i->ifa_addr->sa_family == AF_INET &&
+           ((struct sockaddr_in *) i->ifa_addr)->sin_addr.s_addr == address.sin_addr.s_addr) {
+            snprintf(path, sizeof(path), "/sys/class/net/%s/speed", i->ifa_name);
+            speed = tune_sysctl(path, 0);
+            break;
+        }
+    }
+    freeifaddrs(list);
+
+    //The speed is given in Mbit/s:
+    return speed > 0 ? speed * 1000000 / 8 : 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads a number from a file of whitespace-separated numbers (e.g. a sysctl
+ *      under /proc/sys)
+ * Param:   const char * path -  The file
+ * Param:   int field -  Which number to read (0 for the first)
+ * Return:  long long -  The number, or -1 if it could not be read
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+long long tune_sysctl(const char * path, int field) {
+    FILE * file;
+    long long value = -1;
+    int i;
+
+    if((file = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    for(i=0; i<=field; i++) {
+        if(fscanf(file, "%lld", &value) != 1) {
+            value = -1;
+            break;
+        }
+    }
+    fclose(file);
+
+    return value;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Parses a link rate given in bits per second, with an optional K, M or G
+ *      suffix (e.g. "10G")
+ * Param:   const char * text -  The rate
+ * Return:  long long -  The rate in bytes per second, or -1 if it is invalid
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+long long tune_parse_rate(const char * text) {
+    char * end;
+    double value;
+
+    errno = 0;
+    value = strtod(text, &end);
+    if(errno != 0 || end == text || value <= 0) {
+        return -1;
+    }
+    if(*end == 'K' || *end == 'k') {
+        value *= 1e3;
+        end++;
+    }
+    else if(*end == 'M' || *end == 'm') {
+        value *= 1e6;
+        end++;
+    }
+    else if(*end == 'G' || *end == 'g') {
+        value *= 1e9;
+        end++;
+    }
+    if(*end != '\0' || value / 8 < 1) {
+        return -1;
+    }
+
+    return (long long) (value / 8);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Describes the tuning chosen, e.g. "RTT 40.12 ms, path 9412 Mbit/s
+ *      measured (link 10000 Mbit/s), BDP 47204 KB; send buffer 47204 KB,
+ *      receive buffer 47204 KB; congestion control bbr (paces itself)"
+ * Param:   struct tuning * t -  The tuning
+ * Param:   char * buf -  Buffer for the description
+ * Param:   size_t size -  Size of the buffer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void tune_summary(struct tuning * t, char * buf, size_t size) {
+    char link[48], path[128], sndbuf[96], rcvbuf[96], pacing[64];
+
+    if(t->link > 0) {
+        snprintf(link, sizeof(link), "link %lld Mbit/s", t->link * 8 / 1000000);
+    }
+    else {
+        snprintf(link, sizeof(link), "link speed unknown");
+    }
+    if(t->rate > 0) {
+        snprintf(path, sizeof(path), "path %lld Mbit/s %s (%s), BDP %lld KB", t->rate * 8 / 1000000,
+                 t->fixed ? "given" : "measured", link, t->bdp / 1024);
+    }
+    else {
+        snprintf(path, sizeof(path), "path not measured yet (%s)", link);
+    }
+
+    if(t->sndbuf > 0) {
+        snprintf(sndbuf, sizeof(sndbuf), "%d KB%s", t->sndbuf / 1024, t->sndbuf_capped ? " (capped by net.core.wmem_max)" : "");
+    }
+    else {
+        snprintf(sndbuf, sizeof(sndbuf), "autotuned up to %lld KB%s", t->wmem_auto / 1024,
+                 t->sndbuf_capped ? " (raise net.core.wmem_max to cover the BDP)" : "");
+    }
+    if(t->rcvbuf > 0) {
+        snprintf(rcvbuf, sizeof(rcvbuf), "%d KB%s", t->rcvbuf / 1024, t->rcvbuf_capped ? " (capped by net.core.rmem_max)" : "");
+    }
+    else {
+        snprintf(rcvbuf, sizeof(rcvbuf), "autotuned up to %lld KB%s", t->rmem_auto / 1024,
+                 t->rcvbuf_capped ? " (raise net.core.rmem_max to cover the BDP)" : "");
+    }
+
+    if(strcmp(t->congestion, "bbr") == 0) {
+        snprintf(pacing, sizeof(pacing), "paces itself");
+    }
+    else if(t->pacing > 0) {
+        snprintf(pacing, sizeof(pacing), "paced at %lld Mbit/s", t->pacing * 8 / 1000000);
+    }
+    else {
+        snprintf(pacing, sizeof(pacing), "not paced");
+    }
+
+    snprintf(buf, size, "RTT %.2f ms, %s; send buffer %s, receive buffer %s; congestion control %s (%s)",
+             t->rtt_us / 1000.0, path, sndbuf, rcvbuf, t->congestion[0] != '\0' ? t->congestion : "default", pacing);
+}
@@ -0,0 +1,77 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: fttune.h
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Header file for fttune.c
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <linux/tcp.h>
+#include <ifaddrs.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#ifndef FTTUNE_H
+#define FTTUNE_H
+
+//CONSTANTS:
+
+#define TUNE_CONGESTION "bbr"
+#define TUNE_NAME_SIZE 16
+#define TUNE_BUF_MAX (INT_MAX / 2)
+#define TUNE_CONTROL_PRIORITY 6
+#define TUNE_SAMPLE_BYTES (4 * 1024 * 1024)
+#define TUNE_PACING_GAIN 125
+
+
+//TYPES:
+
+//How a session's data connections are tuned: the round-trip time and path
+//rate (in bytes per second, 0 until it has been measured) they are sized
+//for, the speed of the network interface that caps it (0 if unknown),
+//whether the rate was given instead of measured, the resulting
+//bandwidth-delay product, the socket buffer sizes set (0 leaves a buffer to
+//the kernel's autotuning, which already covers the BDP), and the congestion
+//control and pacing rate (0 for none) used
+struct tuning {
+    long long rtt_us;
+    long long rate;
+    long long link;
+    int fixed;
+    long long bdp;
+    long long wmem_auto;
+    long long rmem_auto;
+    int sndbuf;
+    int rcvbuf;
+    int sndbuf_capped;
+    int rcvbuf_capped;
+    char congestion[TUNE_NAME_SIZE];
+    long long pacing;
+};
+
+
+//FUNCTION PROTOTYPES:
+
+void tune_measure(struct tuning * t, int ctrl_fd, long long rate, const char * congestion);
+void tune_size(struct tuning * t);
+int tune_sample(struct tuning * t, int fd, long long sent, long long ns);
+int tune_observe(struct tuning * t, long long bytes, long long ns);
+int tune_estimate(struct tuning * t, long long rate, int limited);
+int tune_buffer(long long bdp, long long autotune, long long core_max, int * capped);
+void tune_apply(struct tuning * t, int fd);
+void tune_control(int fd);
+void tune_cork(int fd, int on);
+long long tune_link_rate(int fd);
+long long tune_sysctl(const char * path, int field);
+long long tune_parse_rate(const char * text);
+void tune_summary(struct tuning * t, char * buf, size_t size);
+
+#endif
@@ -7,6 +7,15 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 #include "ftutil.h"
 
+//Static Variables:
+
+//Names of the commands, indexed by their type identifiers (the opcodes of
+//the binary control protocol)
+static const char * command_names[] = {
+    "exit", "list", "get", "cd", "pwd", "passive", "mux", "size",
+    "mget", "compress", "sum", "sync", "put", "stats", "binary"
+};
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
  * Sends a message over the specified socket
  * Param:   int socket_fd -  File descriptor of connection to send message over
@@ -49,6 +58,10 @@ int create_socket(void) {
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 void bind_socket(int socket_fd, unsigned short port) {
     struct sockaddr_in address;
+    int reuse = 1;
+
+    //Allow quick rebinding while old connections sit in TIME_WAIT:
+    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
     //Create address:
     address.sin_family = AF_INET;
@@ -78,6 +91,20 @@ void listen_socket(int socket_fd) {
 }
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Puts a socket (or any file descriptor) into non-blocking mode
+ * Param:   int fd -  File descriptor to change
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void set_nonblocking(int fd) {
+    int flags;
+
+    if((flags = fcntl(fd, F_GETFL)) == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("Error making descriptor non-blocking");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+}
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
@@ -123,6 +150,76 @@ int parse_command(char * buffer, char * arg) {
         command = PWD;   
     }
 
+    else if(strncmp(buffer, "passive ", 8) == 0 ||
+            strncmp(buffer, "passive\t", 8) == 0 ||
+            strncmp(buffer, "passive\n", 8) == 0) {
+        buffer = buffer + 7;
+        command = PASSIVE;
+    }
+
+    else if(strncmp(buffer, "mux ", 4) == 0 ||
+            strncmp(buffer, "mux\t", 4) == 0 ||
+            strncmp(buffer, "mux\n", 4) == 0) {
+        buffer = buffer + 3;
+        command = MUX;
+    }
+
+    else if(strncmp(buffer, "mget ", 5) == 0 ||
+            strncmp(buffer, "mget\t", 5) == 0 ||
+            strncmp(buffer, "mget\n", 5) == 0) {
+        buffer = buffer + 4;
+        command = MGET;
+    }
+
+    else if(strncmp(buffer, "size ", 5) == 0 ||
+            strncmp(buffer, "size\t", 5) == 0 ||
+            strncmp(buffer, "size\n", 5) == 0) {
+        buffer = buffer + 4;
+        command = SIZE;
+    }
+
+    else if(strncmp(buffer, "sync ", 5) == 0 ||
+            strncmp(buffer, "sync\t", 5) == 0 ||
+            strncmp(buffer, "sync\n", 5) == 0) {
+        buffer = buffer + 4;
+        command = SYNC;
+    }
+
+    else if(strncmp(buffer, "put ", 4) == 0 ||
+            strncmp(buffer, "put\t", 4) == 0 ||
+            strncmp(buffer, "put\n", 4) == 0) {
+        buffer = buffer + 3;
+        command = PUT;
+    }
+
+    else if(strncmp(buffer, "sum ", 4) == 0 ||
+            strncmp(buffer, "sum\t", 4) == 0 ||
+            strncmp(buffer, "sum\n", 4) == 0) {
+        buffer = buffer + 3;
+        command = SUM;
+    }
+
+    else if(strncmp(buffer, "stats ", 6) == 0 ||
+            strncmp(buffer, "stats\t", 6) == 0 ||
+            strncmp(buffer, "stats\n", 6) == 0) {
+        buffer = buffer + 5;
+        command = STATS;
+    }
+
+    else if(strncmp(buffer, "compress ", 9) == 0 ||
+            strncmp(buffer, "compress\t", 9) == 0 ||
+            strncmp(buffer, "compress\n", 9) == 0) {
+        buffer = buffer + 8;
+        command = COMPRESS;
+    }
+
+    else if(strncmp(buffer, "binary ", 7) == 0 ||
+            strncmp(buffer, "binary\t", 7) == 0 ||
+            strncmp(buffer, "binary\n", 7) == 0) {
+        buffer = buffer + 6;
+        command = BINARY;
+    }
+
     else if(strncmp(buffer, "exit ", 5) == 0 ||
             strncmp(buffer, "exit\t", 5) == 0 ||
             strncmp(buffer, "exit\n", 5) == 0) {
@@ -152,6 +249,740 @@ int parse_command(char * buffer, char * arg) {
     return command;
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the optional byte range that may follow a command's argument
+ *      (e.g. "get <filename> [<offset> [<length>]]")
+ * Param:   const char * buffer -  The raw command
+ * Param:   off_t * offset -  Set to the first byte wanted (0 if not given)
+ * Param:   off_t * length -  Set to the number of bytes wanted (RANGE_TO_END if not given)
+ * Return:  int -  1 if a range was given, 0 if not, or -1 if it is invalid
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int parse_range(const char * buffer, off_t * offset, off_t * length) {
+    const char * p = buffer;
+    char * end;
+    long long value;
+    int i;
+
+    *offset = 0;
+    *length = RANGE_TO_END;
+
+    //Skip over the command and its argument:
+    for(i=0; i<2; i++) {
+        while(*p == ' ' || *p == '\t') {
+            p++;
+        }
+        while(*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r' && *p != '\0') {
+            p++;
+        }
+    }
+
+    //Read up to two non-negative numbers:
+    for(i=0; i<3; i++) {
+        while(*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if(*p == '\n' || *p == '\r' || *p == '\0') {
+            return i > 0;
+        }
+        if(i == 2 || *p < '0' || *p > '9') {
+            return -1;
+        }
+
+        errno = 0;
+        value = strtoll(p, &end, 10);
+        if(errno != 0 || (*end != ' ' && *end != '\t' && *end != '\n' && *end != '\r' && *end != '\0')) {
+            return -1;
+        }
+        if(i == 0) {
+            *offset = value;
+        }
+        else {
+            *length = value;
+        }
+        p = end;
+    }
+
+    return -1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the options of a listing ("list [-l|-m] [--limit <n>] [--cursor <c>]")
+ * Param:   const char * buffer -  The raw command
+ * Param:   int * format -  Set to LIST_NAMES, LIST_LONG or LIST_MACHINE
+ * Param:   long * limit -  Set to the most entries wanted (0 for all of them)
+ * Param:   off_t * cursor -  Set to where to resume the listing (0 for the start)
+ * Return:  int -  0 on success, or -1 if the options are invalid
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int parse_list(const char * buffer, int * format, long * limit, off_t * cursor) {
+    char copy[BUF_SIZE], * token, * number, * save, * end;
+    long long value;
+
+    *format = LIST_NAMES;
+    *limit = 0;
+    *cursor = 0;
+
+    //Skip over the command:
+    snprintf(copy, sizeof(copy), "%s", buffer);
+    if(strtok_r(copy, " \t\r\n", &save) == NULL) {
+        return -1;
+    }
+
+    while((token = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        if(strcmp(token, "-l") == 0) {
+            *format = LIST_LONG;
+        }
+        else if(strcmp(token, "-m") == 0) {
+            *format = LIST_MACHINE;
+        }
+
+        //--limit and --cursor take a non-negative number (a limit of at least 1):
+        else if(strcmp(token, "--limit") == 0 || strcmp(token, "--cursor") == 0) {
+            if((number = strtok_r(NULL, " \t\r\n", &save)) == NULL) {
+                return -1;
+            }
+            errno = 0;
+            value = strtoll(number, &end, 10);
+            if(errno != 0 || *end != '\0' || value < 0) {
+                return -1;
+            }
+            if(strcmp(token, "--cursor") == 0) {
+                *cursor = value;
+            }
+            else if(value == 0 || value > LONG_MAX) {
+                return -1;
+            }
+            else {
+                *limit = value;
+            }
+        }
+        else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads a striped get ("get -j <count> <filename>")
+ * Param:   const char * buffer -  The raw command
+ * Param:   int * count -  Set to the number of data connections wanted
+ * Param:   char * filename -  Buffer of BUF_SIZE bytes to store the filename
+ * Return:  int -  1 if the command is a striped get, 0 if not, or -1 if it is invalid
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int parse_stripes(const char * buffer, int * count, char * filename) {
+    char option[BUF_SIZE], name[BUF_SIZE], extra[2];
+    int fields;
+
+    //Leave filename alone unless this really is a striped get (a ranged
+    //get has the same shape):
+    if((fields = sscanf(buffer, "%*s %255s %d %255s %1s", option, count, name, extra)) < 1 ||
+        strcmp(option, "-j") != 0) {
+        return 0;
+    }
+    if(fields != 3 || *count < 1 || *count > MAX_STRIPES) {
+        return -1;
+    }
+
+    strcpy(filename, name);
+    return 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads a recursive get ("get -r <directory>")
+ * Param:   const char * buffer -  The raw command
+ * Param:   char * directory -  Buffer of BUF_SIZE bytes to store the directory
+ * Return:  int -  1 if the command is a recursive get, 0 if not, or -1 if it is invalid
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int parse_recursive(const char * buffer, char * directory) {
+    char option[BUF_SIZE], name[BUF_SIZE], extra[2];
+    int fields;
+
+    if((fields = sscanf(buffer, "%*s %255s %255s %1s", option, name, extra)) < 1 ||
+        strcmp(option, "-r") != 0) {
+        return 0;
+    }
+    if(fields != 2) {
+        return -1;
+    }
+
+    strcpy(directory, name);
+    return 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the block size and number of signatures of a sync, as the client
+ *      sends it ("sync <filename> <block size> <count>")
+ * Param:   const char * buffer -  The raw command
+ * Param:   off_t * block -  Set to the block size the signatures were made with
+ * Param:   off_t * count -  Set to the number of signatures that follow
+ * Return:  int -  0 on success, or -1 if they are missing or out of range
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int parse_sync(const char * buffer, off_t * block, off_t * count) {
+    long long fields[2];
+    char extra[2];
+
+    if(sscanf(buffer, "%*s %*s %lld %lld %1s", &fields[0], &fields[1], extra) != 2 ||
+        fields[0] < SYNC_BLOCK_MIN || fields[0] > SYNC_BLOCK_MAX ||
+        fields[1] < 0 || fields[1] > SYNC_MAX_BLOCKS) {
+        return -1;
+    }
+
+    *block = fields[0];
+    *count = fields[1];
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the size and checksum of an upload, as the client sends them
+ *      ("put <filename> <size> <CRC32C>")
+ * Param:   const char * buffer -  The raw command
+ * Param:   off_t * size -  Set to the number of bytes that will be sent
+ * Param:   uint32_t * sum -  Set to the CRC32C checksum of those bytes
+ * Return:  int -  0 on success, or -1 if they are missing or invalid
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int parse_put(const char * buffer, off_t * size, uint32_t * sum) {
+    long long length;
+    unsigned int crc;
+    char extra[2];
+
+    if(sscanf(buffer, "%*s %*s %lld %x %1s", &length, &crc, extra) != 2 || length < 0) {
+        return -1;
+    }
+
+    *size = length;
+    *sum = crc;
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Checks that a path stays inside the current directory (a path received
+ *      from the server, or the name of an upload): relative, with no empty,
+ *      "." or ".." components
+ * Param:   const char * path -  The path
+ * Return:  int -  1 if the path is safe to create, 0 if not
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int safe_path(const char * path) {
+    const char * start = path, * end;
+    size_t length;
+
+    if(*path == '\0') {
+        return 0;
+    }
+
+    while(1) {
+        end = strchr(start, '/');
+        length = end != NULL ? (size_t) (end - start) : strlen(start);
+        if(length == 0 || (length == 1 && start[0] == '.') || (length == 2 && start[0] == '.' && start[1] == '.')) {
+            return 0;
+        }
+        if(end == NULL) {
+            return 1;
+        }
+        start = end + 1;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Encodes a frame header for the multiplexed data channel
+ * Param:   char * buf -  Buffer of at least FRAME_HEADER_SIZE bytes
+ * Param:   uint32_t stream -  Stream the frame belongs to
+ * Param:   uint16_t type -  FRAME_DATA or FRAME_END
+ * Param:   uint16_t status -  FRAME_OK or FRAME_ERROR (meaningful for FRAME_END)
+ * Param:   uint32_t length -  Length of the payload that follows
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void frame_pack(char * buf, uint32_t stream, uint16_t type, uint16_t status, uint32_t length) {
+
+    stream = htonl(stream);
+    type = htons(type);
+    status = htons(status);
+    length = htonl(length);
+
+    memcpy(buf, &stream, 4);
+    memcpy(buf + 4, &type, 2);
+    memcpy(buf + 6, &status, 2);
+    memcpy(buf + 8, &length, 4);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Decodes a frame header received over the multiplexed data channel
+ * Param:   const char * buf -  FRAME_HEADER_SIZE bytes as received
+ * Param:   struct frame_header * header -  Decoded header
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void frame_unpack(const char * buf, struct frame_header * header) {
+
+    memcpy(&header->stream, buf, 4);
+    memcpy(&header->type, buf + 4, 2);
+    memcpy(&header->status, buf + 6, 2);
+    memcpy(&header->length, buf + 8, 4);
+
+    header->stream = ntohl(header->stream);
+    header->type = ntohs(header->type);
+    header->status = ntohs(header->status);
+    header->length = ntohl(header->length);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Encodes the header that starts each data connection of a striped get
+ * Param:   char * buf -  Buffer of at least STRIPE_HEADER_SIZE bytes
+ * Param:   off_t total -  Size of the whole file
+ * Param:   off_t offset -  Where this connection's stripe starts
+ * Param:   off_t length -  Length of this connection's stripe
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void stripe_pack(char * buf, off_t total, off_t offset, off_t length) {
+    uint64_t fields[3];
+
+    fields[0] = htobe64(total);
+    fields[1] = htobe64(offset);
+    fields[2] = htobe64(length);
+    memcpy(buf, fields, STRIPE_HEADER_SIZE);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Decodes a stripe header
+ * Param:   const char * buf -  STRIPE_HEADER_SIZE bytes as received
+ * Param:   off_t * total -  Size of the whole file
+ * Param:   off_t * offset -  Where the stripe starts
+ * Param:   off_t * length -  Length of the stripe
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void stripe_unpack(const char * buf, off_t * total, off_t * offset, off_t * length) {
+    uint64_t fields[3];
+
+    memcpy(fields, buf, STRIPE_HEADER_SIZE);
+    *total = be64toh(fields[0]);
+    *offset = be64toh(fields[1]);
+    *length = be64toh(fields[2]);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Encodes a command for the binary control protocol: a request header (see
+ *      request_pack()) followed by each of the command's arguments as a
+ *      16-bit length and its bytes.  The opcode is the command's type
+ *      identifier, so the server dispatches on it without parsing any text.
+ * Param:   char * buf -  Buffer to encode the request into
+ * Param:   size_t size -  Size of the buffer
+ * Param:   char * request -  The command as typed (e.g. "get file 0 100")
+ * Return:  size_t -  Length of the encoded request, or 0 if it does not fit
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+size_t request_encode(char * buf, size_t size, char * request) {
+    int command = parse_command(request, NULL);
+    unsigned int count = 0;
+    size_t pos = REQUEST_HEADER_SIZE, length;
+    uint16_t arg_length;
+    char * p = request + strspn(request, " \t");
+
+    //Skip over the command's name; the words after it are its arguments:
+    p += strcspn(p, " \t\r\n");
+    while(*(p += strspn(p, " \t\r\n")) != '\0') {
+        length = strcspn(p, " \t\r\n");
+        if(count == UINT8_MAX || pos + 2 + length > size || pos + 2 + length - REQUEST_HEADER_SIZE > REQUEST_MAX) {
+            return 0;
+        }
+        arg_length = htons(length);
+        memcpy(buf + pos, &arg_length, 2);
+        memcpy(buf + pos + 2, p, length);
+        pos += 2 + length;
+        p += length;
+        count++;
+    }
+
+    request_pack(buf, command == INVALID ? REQUEST_INVALID : (unsigned int) command, count, pos - REQUEST_HEADER_SIZE);
+    return pos;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Decodes the arguments of a binary request, and rebuilds the command's
+ *      text for the handlers that read options from it
+ * Param:   unsigned int opcode -  The request's opcode
+ * Param:   unsigned int count -  Number of arguments
+ * Param:   const char * payload -  The arguments as received
+ * Param:   size_t length -  Length of the payload
+ * Param:   char * line -  Buffer of BUF_SIZE bytes for the command's text
+ * Param:   char * arg -  Buffer of BUF_SIZE bytes for the first argument
+ * Return:  int -  The command type identifier (INVALID for an unknown
+ *      opcode or arguments that are malformed or contain whitespace)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int request_decode(unsigned int opcode, unsigned int count, const char * payload, size_t length, char * line, char * arg) {
+    size_t pos = 0, used, i;
+    uint16_t arg_length;
+    unsigned int n;
+
+    line[0] = '\0';
+    arg[0] = '\0';
+    if(opcode >= sizeof(command_names) / sizeof(command_names[0])) {
+        return INVALID;
+    }
+    used = strlen(command_names[opcode]);
+    memcpy(line, command_names[opcode], used);
+
+    for(n=0; n<count; n++) {
+        if(pos + 2 > length) {
+            return INVALID;
+        }
+        memcpy(&arg_length, payload + pos, 2);
+        arg_length = ntohs(arg_length);
+        pos += 2;
+        if(arg_length == 0 || pos + arg_length > length || used + arg_length + 3 > BUF_SIZE) {
+            return INVALID;
+        }
+        for(i=0; i<arg_length; i++) {
+            if(payload[pos + i] == ' ' || payload[pos + i] == '\t' || payload[pos + i] == '\n' ||
+               payload[pos + i] == '\r' || payload[pos + i] == '\0') {
+                return INVALID;
+            }
+        }
+        line[used++] = ' ';
+        memcpy(line + used, payload + pos, arg_length);
+        if(n == 0) {
+            memcpy(arg, payload + pos, arg_length);
+            arg[arg_length] = '\0';
+        }
+        used += arg_length;
+        pos += arg_length;
+    }
+    if(pos != length) {
+        return INVALID;
+    }
+
+    line[used++] = '\n';
+    line[used] = '\0';
+    return opcode;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Encodes the header of a binary request
+ * Param:   char * buf -  Buffer of at least REQUEST_HEADER_SIZE bytes
+ * Param:   unsigned int opcode -  The command's type identifier (or REQUEST_INVALID)
+ * Param:   unsigned int count -  Number of arguments that follow (at most 255)
+ * Param:   unsigned int length -  Length of the arguments (at most REQUEST_MAX)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void request_pack(char * buf, unsigned int opcode, unsigned int count, unsigned int length) {
+    uint16_t length16 = htons(length);
+
+    buf[0] = (char) opcode;
+    buf[1] = (char) count;
+    memcpy(buf + 2, &length16, 2);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Decodes the header of a binary request
+ * Param:   const char * buf -  REQUEST_HEADER_SIZE bytes as received
+ * Param:   unsigned int * opcode -  The command's opcode
+ * Param:   unsigned int * count -  Number of arguments
+ * Param:   unsigned int * length -  Length of the arguments
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void request_unpack(const char * buf, unsigned int * opcode, unsigned int * count, unsigned int * length) {
+    uint16_t length16;
+
+    *opcode = (unsigned char) buf[0];
+    *count = (unsigned char) buf[1];
+    memcpy(&length16, buf + 2, 2);
+    *length = ntohs(length16);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Encodes the header sent before each file of a batch (the file's name follows it)
+ * Param:   char * buf -  Buffer of at least BATCH_HEADER_SIZE bytes
+ * Param:   uint32_t name_length -  Length of the name that follows (0 ends the batch)
+ * Param:   uint32_t mode -  The file's mode (type and permission bits)
+ * Param:   off_t size -  Size of the file (0 for a directory)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void batch_pack(char * buf, uint32_t name_length, uint32_t mode, off_t size) {
+    uint64_t size64 = htobe64(size);
+
+    name_length = htonl(name_length);
+    mode = htonl(mode);
+
+    memcpy(buf, &name_length, 4);
+    memcpy(buf + 4, &mode, 4);
+    memcpy(buf + 8, &size64, 8);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Decodes a batch header
+ * Param:   const char * buf -  BATCH_HEADER_SIZE bytes as received
+ * Param:   uint32_t * name_length -  Length of the name that follows
+ * Param:   uint32_t * mode -  The file's permission bits
+ * Param:   off_t * size -  Size of the file
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void batch_unpack(const char * buf, uint32_t * name_length, uint32_t * mode, off_t * size) {
+    uint64_t size64;
+
+    memcpy(name_length, buf, 4);
+    memcpy(mode, buf + 4, 4);
+    memcpy(&size64, buf + 8, 8);
+
+    *name_length = ntohl(*name_length);
+    *mode = ntohl(*mode);
+    *size = be64toh(size64);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Encodes a record of a sync's delta: literal data (DELTA_DATA, whose
+ *      length is the value and which the data itself follows), a run of the
+ *      client's own blocks (DELTA_COPY, from the block numbered by the value),
+ *      or the end (DELTA_END, whose value is the size of the file)
+ * Param:   char * buf -  Buffer of at least DELTA_HEADER_SIZE bytes
+ * Param:   uint32_t type -  DELTA_DATA, DELTA_COPY or DELTA_END
+ * Param:   uint32_t count -  Number of blocks to copy (DELTA_COPY only)
+ * Param:   off_t value -  Length, first block or size (see above)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void delta_pack(char * buf, uint32_t type, uint32_t count, off_t value) {
+    batch_pack(buf, type, count, value);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Decodes a record of a sync's delta
+ * Param:   const char * buf -  DELTA_HEADER_SIZE bytes as received
+ * Param:   uint32_t * type -  DELTA_DATA, DELTA_COPY or DELTA_END
+ * Param:   uint32_t * count -  Number of blocks to copy
+ * Param:   off_t * value -  Length, first block or size (see delta_pack())
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void delta_unpack(const char * buf, uint32_t * type, uint32_t * count, off_t * value) {
+    batch_unpack(buf, type, count, value);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Encodes the signature of one block of the client's copy of a file
+ * Param:   char * buf -  Buffer of at least DELTA_SIG_SIZE bytes
+ * Param:   uint32_t weak -  The block's rolling checksum
+ * Param:   uint64_t strong -  The block's hash
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void sig_pack(char * buf, uint32_t weak, uint64_t strong) {
+
+    weak = htonl(weak);
+    strong = htobe64(strong);
+
+    memcpy(buf, &weak, 4);
+    memcpy(buf + 4, &strong, 8);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Decodes the signature of a block
+ * Param:   const char * buf -  DELTA_SIG_SIZE bytes as received
+ * Param:   uint32_t * weak -  The block's rolling checksum
+ * Param:   uint64_t * strong -  The block's hash
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void sig_unpack(const char * buf, uint32_t * weak, uint64_t * strong) {
+
+    memcpy(weak, buf, 4);
+    memcpy(strong, buf + 4, 8);
+
+    *weak = ntohl(*weak);
+    *strong = be64toh(*strong);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Encodes the header sent before each block of a compressed transfer
+ * Param:   char * buf -  Buffer of at least BLOCK_HEADER_SIZE bytes
+ * Param:   uint32_t wire_length -  Length of the block as sent
+ * Param:   uint32_t raw_length -  Length of the block once decoded (equal to
+ *      wire_length if the block was sent uncompressed)
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void block_pack(char * buf, uint32_t wire_length, uint32_t raw_length) {
+
+    wire_length = htonl(wire_length);
+    raw_length = htonl(raw_length);
+
+    memcpy(buf, &wire_length, 4);
+    memcpy(buf + 4, &raw_length, 4);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Decodes the header of a block of a compressed transfer
+ * Param:   const char * buf -  BLOCK_HEADER_SIZE bytes as received
+ * Param:   uint32_t * wire_length -  Length of the block as sent
+ * Param:   uint32_t * raw_length -  Length of the block once decoded
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void block_unpack(const char * buf, uint32_t * wire_length, uint32_t * raw_length) {
+
+    memcpy(wire_length, buf, 4);
+    memcpy(raw_length, buf + 4, 4);
+
+    *wire_length = ntohl(*wire_length);
+    *raw_length = ntohl(*raw_length);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Prepares one side of a transfer for block compression.  The zlib stream is
+ *      created when the first block needs it.
+ * Param:   struct codec * c -  The codec
+ * Param:   int enabled -  Whether the transfer is compressed at all
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void codec_init(struct codec * c, int enabled) {
+
+    memset(c, 0, sizeof(*c));
+    c->enabled = enabled;
+    c->mode = CODEC_NONE;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Releases a codec's zlib stream
+ * Param:   struct codec * c -  The codec
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void codec_free(struct codec * c) {
+
+    if(c->mode == CODEC_DEFLATE) {
+        deflateEnd(&c->z);
+    }
+    else if(c->mode == CODEC_INFLATE) {
+        inflateEnd(&c->z);
+    }
+    c->mode = CODEC_NONE;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Encodes a block of a compressed transfer: a header followed by the data,
+ *      deflated if that saves at least 1/16 of it.  A block that doesn't
+ *      compress makes the codec send the next 1, 2, 4 ... BLOCK_SKIP_MAX
+ *      blocks as they are without trying, so already-compressed files cost
+ *      almost no CPU; one that does compress resets the backoff.
+ * Param:   struct codec * c -  The sending side's codec
+ * Param:   char * out -  Buffer of at least BLOCK_HEADER_SIZE + length bytes
+ * Param:   const char * in -  Data to encode
+ * Param:   size_t length -  Length of the data (at most BLOCK_MAX)
+ * Return:  size_t -  Number of bytes written to out
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+size_t block_encode(struct codec * c, char * out, const char * in, size_t length) {
+    size_t packed = 0;
+    long long start;
+
+    //Small blocks (e.g. headers) and blocks in a skipped run go as they are:
+    if(c->skip > 0) {
+        c->skip--;
+    }
+    else if(length >= BLOCK_MIN_COMPRESS) {
+        start = cpu_time_ns();
+
+        if(c->mode == CODEC_NONE) {
+            if(deflateInit(&c->z, COMPRESS_LEVEL) == Z_OK) {
+                c->mode = CODEC_DEFLATE;
+            }
+            else {
+                c->skip = UINT_MAX;
+            }
+        }
+
+        //Only room for a useful saving: running out of it means "incompressible"
+        if(c->skip == 0 && deflateReset(&c->z) == Z_OK) {
+            c->z.next_in = (Bytef *) in;
+            c->z.avail_in = length;
+            c->z.next_out = (Bytef *) out + BLOCK_HEADER_SIZE;
+            c->z.avail_out = length - length / 16;
+            if(deflate(&c->z, Z_FINISH) == Z_STREAM_END) {
+                packed = c->z.total_out;
+            }
+        }
+
+        if(packed > 0) {
+            c->backoff = 0;
+        }
+        else if(c->skip == 0) {
+            c->backoff = c->backoff == 0 ? 1 : c->backoff * 2;
+            c->backoff = c->backoff < BLOCK_SKIP_MAX ? c->backoff : BLOCK_SKIP_MAX;
+            c->skip = c->backoff;
+        }
+        c->cpu_ns += cpu_time_ns() - start;
+    }
+
+    if(packed == 0) {
+        memcpy(out + BLOCK_HEADER_SIZE, in, length);
+        packed = length;
+    }
+    block_pack(out, packed, length);
+
+    c->raw_bytes += length;
+    c->wire_bytes += BLOCK_HEADER_SIZE + packed;
+    return BLOCK_HEADER_SIZE + packed;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Decodes the body of a block of a compressed transfer
+ * Param:   struct codec * c -  The receiving side's codec
+ * Param:   char * out -  Buffer of at least raw_length bytes
+ * Param:   size_t raw_length -  Length of the block once decoded
+ * Param:   const char * in -  The block's body as received
+ * Param:   size_t wire_length -  Length of the body as received
+ * Return:  int -  0 on success, or -1 if the block is corrupt
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int block_decode(struct codec * c, char * out, size_t raw_length, const char * in, size_t wire_length) {
+    long long start;
+    int result;
+
+    c->raw_bytes += raw_length;
+    c->wire_bytes += BLOCK_HEADER_SIZE + wire_length;
+
+    //Stored blocks:
+    if(wire_length == raw_length) {
+        if(out != in) {
+            memcpy(out, in, raw_length);
+        }
+        return 0;
+    }
+
+    start = cpu_time_ns();
+    if(c->mode == CODEC_NONE) {
+        if(inflateInit(&c->z) != Z_OK) {
+            return -1;
+        }
+        c->mode = CODEC_INFLATE;
+    }
+
+    result = inflateReset(&c->z);
+    c->z.next_in = (Bytef *) in;
+    c->z.avail_in = wire_length;
+    c->z.next_out = (Bytef *) out;
+    c->z.avail_out = raw_length;
+    if(result == Z_OK) {
+        result = inflate(&c->z, Z_FINISH);
+    }
+    c->cpu_ns += cpu_time_ns() - start;
+
+    return result == Z_STREAM_END && c->z.total_out == raw_length ? 0 : -1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Describes how well a compressed transfer went, e.g. "1048576 bytes sent
+ *      as 131090 (8.0x), 2.1 ms CPU"
+ * Param:   struct codec * c -  The codec
+ * Param:   char * buf -  Buffer to store the description
+ * Param:   size_t size -  Size of the buffer
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void codec_summary(struct codec * c, char * buf, size_t size) {
+
+    snprintf(buf, size, "%lld bytes sent as %lld (%.1fx), %.1f ms CPU", c->raw_bytes, c->wire_bytes,
+        c->wire_bytes > 0 ? (double) c->raw_bytes / c->wire_bytes : 1.0, c->cpu_ns / 1e6);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the CPU time used by the calling thread
+ * Param:   void
+ * Return:  long long -  Nanoseconds of CPU time
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+long long cpu_time_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
  * Prompts the user for a yes/no answer.  Returns 1 for yes, 0 for no.
  * Param:   char * prompt -  The prompt to display
@@ -163,7 +994,12 @@ int input_yn(char * prompt) {
     printf("%s", prompt);
 
     while(1) {
-        fgets(buf, BUF_SIZE, stdin);
+
+        //No more input: take that as a no
+        if(fgets(buf, BUF_SIZE, stdin) == NULL) {
+            printf("\n");
+            return 0;
+        }
         
         if(strncmp(buf, "yes\n", 4) == 0 ||
             strncmp(buf, "yes ", 4) == 0 ||
@@ -185,3 +1021,291 @@ int input_yn(char * prompt) {
 
     return -1;
 }
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Creates an empty ring buffer
+ * Param:   struct ring * r -  The ring to initialize
+ * Param:   size_t size -  Initial capacity (a power of two)
+ * Param:   size_t limit -  Largest capacity the ring may grow to by ring_write()
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void ring_init(struct ring * r, size_t size, size_t limit) {
+
+    if((r->data = malloc(size)) == NULL) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+    r->size = size;
+    r->limit = limit;
+    r->head = 0;
+    r->tail = 0;
+    r->discard = 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Releases a ring buffer's memory
+ * Param:   struct ring * r -  The ring
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void ring_free(struct ring * r) {
+
+    free(r->data);
+    r->data = NULL;
+    r->size = 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Returns the number of bytes waiting in a ring
+ * Param:   struct ring * r -  The ring
+ * Return:  size_t -  Bytes waiting
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+size_t ring_used(struct ring * r) {
+
+    return r->tail - r->head;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Returns the number of bytes that can be added without growing the ring
+ * Param:   struct ring * r -  The ring
+ * Return:  size_t -  Free bytes
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+size_t ring_space(struct ring * r) {
+
+    return r->size - ring_used(r);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Describes a region of the ring (which may wrap) as at most two iovecs
+ * Param:   struct ring * r -  The ring
+ * Param:   size_t start -  Position of the region (a head/tail count)
+ * Param:   size_t length -  Length of the region
+ * Param:   struct iovec * iov -  Array of two iovecs to fill
+ * Return:  int -  Number of iovecs used
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static int ring_iov(struct ring * r, size_t start, size_t length, struct iovec * iov) {
+    size_t offset = start & (r->size - 1);
+
+    iov[0].iov_base = r->data + offset;
+    if(offset + length <= r->size) {
+        iov[0].iov_len = length;
+        return length > 0 ? 1 : 0;
+    }
+    iov[0].iov_len = r->size - offset;
+    iov[1].iov_base = r->data;
+    iov[1].iov_len = length - iov[0].iov_len;
+    return 2;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads as much as the kernel has available (and the ring can hold) in one call
+ * Param:   struct ring * r -  The ring to fill
+ * Param:   int fd -  File descriptor to read from
+ * Return:  ssize_t -  Bytes read, 0 at end of file, or -1 on error (errno is set;
+ *      EAGAIN for an empty non-blocking socket, ENOBUFS if the ring is full)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+ssize_t ring_fill(struct ring * r, int fd) {
+    struct iovec iov[2];
+    ssize_t num_read;
+    int count;
+
+    if(ring_space(r) == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    count = ring_iov(r, r->tail, ring_space(r), iov);
+    if((num_read = readv(fd, iov, count)) > 0) {
+        r->tail += num_read;
+    }
+
+    return num_read;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Appends data to a ring, growing it (up to its limit) if needed
+ * Param:   struct ring * r -  The ring
+ * Param:   const void * data -  Data to append
+ * Param:   size_t length -  Number of bytes to append
+ * Return:  int -  0 on success, -1 if the data does not fit
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int ring_write(struct ring * r, const void * data, size_t length) {
+    struct iovec iov[2];
+    size_t used, size;
+    char * grown;
+    int count;
+
+    //Grow, moving the waiting bytes to the start of the new buffer:
+    if(length > ring_space(r)) {
+        used = ring_used(r);
+        for(size = r->size; size - used < length; size *= 2);
+        if(size > r->limit || (grown = malloc(size)) == NULL) {
+            return -1;
+        }
+        count = ring_iov(r, r->head, used, iov);
+        if(count > 0) {
+            memcpy(grown, iov[0].iov_base, iov[0].iov_len);
+        }
+        if(count > 1) {
+            memcpy(grown + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+        }
+        free(r->data);
+        r->data = grown;
+        r->size = size;
+        r->head = 0;
+        r->tail = used;
+    }
+
+    count = ring_iov(r, r->tail, length, iov);
+    if(count > 0) {
+        memcpy(iov[0].iov_base, data, iov[0].iov_len);
+    }
+    if(count > 1) {
+        memcpy(iov[1].iov_base, (const char *) data + iov[0].iov_len, iov[1].iov_len);
+    }
+    r->tail += length;
+
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Writes everything waiting in a ring with a single writev call
+ * Param:   struct ring * r -  The ring
+ * Param:   int fd -  File descriptor to write to
+ * Return:  ssize_t -  Bytes written, or -1 on error (errno is set)
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+ssize_t ring_flush(struct ring * r, int fd) {
+    struct iovec iov[2];
+    ssize_t num_written;
+    int count;
+
+    if((count = ring_iov(r, r->head, ring_used(r), iov)) == 0) {
+        return 0;
+    }
+
+    if((num_written = writev(fd, iov, count)) > 0) {
+        r->head += num_written;
+    }
+
+    return num_written;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copies bytes out of a ring and removes them
+ * Param:   struct ring * r -  The ring
+ * Param:   void * buf -  Buffer to copy into
+ * Param:   size_t length -  Largest number of bytes to copy
+ * Return:  size_t -  Number of bytes copied
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+size_t ring_read(struct ring * r, void * buf, size_t length) {
+
+    length = ring_peek(r, buf, length);
+    r->head += length;
+
+    return length;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copies data from the front of a ring, leaving it there
+ * Param:   struct ring * r -  The ring
+ * Param:   void * buf -  Buffer to copy into
+ * Param:   size_t length -  Most bytes to copy
+ * Return:  size_t -  Number of bytes copied
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+size_t ring_peek(struct ring * r, void * buf, size_t length) {
+    struct iovec iov[2];
+    int count;
+
+    if(length > ring_used(r)) {
+        length = ring_used(r);
+    }
+
+    count = ring_iov(r, r->head, length, iov);
+    if(count > 0) {
+        memcpy(buf, iov[0].iov_base, iov[0].iov_len);
+    }
+    if(count > 1) {
+        memcpy((char *) buf + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+    }
+
+    return length;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Finds the end of the first frame terminated by marker
+ * Param:   struct ring * r -  The ring
+ * Param:   const char * marker -  The frame terminator (e.g. PROMPT)
+ * Return:  ssize_t -  Length of the frame including the marker, or -1 if no
+ *      complete frame is waiting
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+ssize_t ring_find(struct ring * r, const char * marker) {
+    size_t i, j, used = ring_used(r), length = strlen(marker);
+
+    for(i=0; i + length <= used; i++) {
+        for(j=0; j<length && r->data[(r->head + i + j) & (r->size - 1)] == marker[j]; j++);
+        if(j == length) {
+            return i + length;
+        }
+    }
+
+    return -1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Takes the next complete line (ended by '\n' or '\r') out of a ring.  A line
+ *      too long for the caller's buffer is reported once and the rest of it is
+ *      dropped as it arrives.
+ * Param:   struct ring * r -  The ring
+ * Param:   char * line -  Buffer to copy the null-terminated line into (without its ending)
+ * Param:   size_t size -  Size of the line buffer
+ * Return:  int -  Length of the line, RING_NO_LINE if no complete line is waiting,
+ *      or RING_LONG_LINE if the line did not fit
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int ring_getline(struct ring * r, char * line, size_t size) {
+    size_t i, used;
+    char c;
+
+    while(1) {
+        used = ring_used(r);
+
+        //Find the end of the line:
+        for(i=0; i<used; i++) {
+            c = r->data[(r->head + i) & (r->size - 1)];
+            if(c == '\n' || c == '\r') {
+                break;
+            }
+        }
+
+        //Still dropping an over-long line:
+        if(r->discard) {
+            r->head += i;
+            if(i == used) {
+                return RING_NO_LINE;
+            }
+            r->head++;
+            r->discard = 0;
+            continue;
+        }
+
+        //Line will not fit: drop it
+        if(i >= size) {
+            r->head += i;
+            if(i == used) {
+                r->discard = 1;
+            }
+            else {
+                r->head++;
+            }
+            return RING_LONG_LINE;
+        }
+
+        if(i == used) {
+            return RING_NO_LINE;
+        }
+
+        ring_read(r, line, i);
+        line[i] = '\0';
+        r->head++;
+
+        return i;
+    }
+}
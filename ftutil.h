@@ -6,12 +6,20 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <endian.h>
 #include <netdb.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <zlib.h>
 
 #ifndef FTUTIL_H
 #define FTUTIL_H
@@ -22,10 +30,88 @@
 #define CONTROL_PORT 30021
 #define CONTROL_PORT_STR "30021"
 #define DATA_PORT 30020
-#define BACKLOG 5
+#define BACKLOG SOMAXCONN
 #define BUF_SIZE 256
 #define FILE_BUF_SIZE 4096
 #define PROMPT ">>"
+#define RING_SIZE 4096
+#define RING_NO_LINE -1
+#define RING_LONG_LINE -2
+#define RANGE_TO_END -1
+
+
+//MULTIPLEXED DATA CHANNEL FRAMES:
+
+#define FRAME_HEADER_SIZE 12
+#define FRAME_MAX (1 << 20)
+#define FRAME_DATA 0
+#define FRAME_END 1
+#define FRAME_OK 0
+#define FRAME_ERROR 1
+
+
+//STRIPED TRANSFERS:
+
+#define STRIPE_HEADER_SIZE 24
+#define STRIPE_ALIGN 65536
+#define MAX_STRIPES 16
+
+
+//BATCHES (MGET):
+
+#define BATCH_HEADER_SIZE 16
+#define BATCH_SUM_SIZE 4
+
+
+//SYNCS (DELTA TRANSFERS):
+
+#define DELTA_HEADER_SIZE 16
+#define DELTA_SIG_SIZE 12
+#define DELTA_DATA 1
+#define DELTA_COPY 2
+#define DELTA_END 3
+#define SYNC_BLOCK_MIN 2048
+#define SYNC_BLOCK_MAX (128 * 1024)
+#define SYNC_MAX_BLOCKS (1 << 20)
+
+
+//BINARY CONTROL PROTOCOL (see request_encode()):
+
+#define REQUEST_HEADER_SIZE 4
+#define REQUEST_MAX (2 * BUF_SIZE)
+#define REQUEST_INVALID 255
+
+
+//REPLY STATUS CODES (sent with the end of each reply in binary mode):
+
+#define STATUS_OK 200
+#define STATUS_INCOMPLETE 426
+#define STATUS_FAILED 451
+#define STATUS_NO_SPACE 452
+#define STATUS_INVALID_COMMAND 500
+#define STATUS_INVALID_ARGUMENT 501
+#define STATUS_UNSUPPORTED 504
+#define STATUS_NOT_FOUND 550
+#define STATUS_DENIED 553
+
+
+//LISTING FORMATS:
+
+#define LIST_NAMES 0
+#define LIST_LONG 1
+#define LIST_MACHINE 2
+
+
+//COMPRESSED TRANSFERS:
+
+#define BLOCK_HEADER_SIZE 8
+#define BLOCK_MAX (65536 - FRAME_HEADER_SIZE - BLOCK_HEADER_SIZE)
+#define BLOCK_MIN_COMPRESS 128
+#define BLOCK_SKIP_MAX 64
+#define COMPRESS_LEVEL 1
+#define CODEC_NONE 0
+#define CODEC_DEFLATE 1
+#define CODEC_INFLATE 2
 
 
 //COMMAND TYPE IDENTIFIERS:
@@ -36,6 +122,51 @@
 #define GET 2
 #define CD 3
 #define PWD 4
+#define PASSIVE 5
+#define MUX 6
+#define SIZE 7
+#define MGET 8
+#define COMPRESS 9
+#define SUM 10
+#define SYNC 11
+#define PUT 12
+#define STATS 13
+#define BINARY 14
+
+
+//TYPES:
+
+//A byte queue over a power-of-two buffer.  head and tail count the bytes
+//consumed and added so far; output rings may grow up to limit bytes.
+struct ring {
+    char * data;
+    size_t size;
+    size_t limit;
+    size_t head;
+    size_t tail;
+    int discard;
+};
+
+//Header sent before every frame's payload (in network byte order on the wire)
+struct frame_header {
+    uint32_t stream;
+    uint16_t type;
+    uint16_t status;
+    uint32_t length;
+};
+
+//One side of a compressed transfer: the zlib stream (reset for every block,
+//so blocks decode independently), the adaptive skip state, and statistics
+struct codec {
+    int enabled;
+    int mode;
+    z_stream z;
+    unsigned int skip;
+    unsigned int backoff;
+    long long raw_bytes;
+    long long wire_bytes;
+    long long cpu_ns;
+};
 
 
 //FUNCTION PROTOTYPES:
@@ -44,8 +175,48 @@ void send_message(int socket_fd, char *message);
 int create_socket(void);
 void bind_socket(int socket_fd, unsigned short port);
 void listen_socket(int socket_fd);
-int accept_connection(int socket_fd);
+void set_nonblocking(int fd);
 int parse_command(char * buffer, char * arg);
+int parse_range(const char * buffer, off_t * offset, off_t * length);
+int parse_list(const char * buffer, int * format, long * limit, off_t * cursor);
+int parse_recursive(const char * buffer, char * directory);
+int safe_path(const char * path);
+int parse_stripes(const char * buffer, int * count, char * filename);
+int parse_sync(const char * buffer, off_t * block, off_t * count);
+int parse_put(const char * buffer, off_t * size, uint32_t * sum);
 int input_yn(char * prompt);
+void ring_init(struct ring * r, size_t size, size_t limit);
+void ring_free(struct ring * r);
+size_t ring_used(struct ring * r);
+size_t ring_space(struct ring * r);
+ssize_t ring_fill(struct ring * r, int fd);
+int ring_write(struct ring * r, const void * data, size_t length);
+ssize_t ring_flush(struct ring * r, int fd);
+size_t ring_read(struct ring * r, void * buf, size_t length);
+size_t ring_peek(struct ring * r, void * buf, size_t length);
+ssize_t ring_find(struct ring * r, const char * marker);
+int ring_getline(struct ring * r, char * line, size_t size);
+void frame_pack(char * buf, uint32_t stream, uint16_t type, uint16_t status, uint32_t length);
+void frame_unpack(const char * buf, struct frame_header * header);
+size_t request_encode(char * buf, size_t size, char * request);
+int request_decode(unsigned int opcode, unsigned int count, const char * payload, size_t length, char * line, char * arg);
+void request_pack(char * buf, unsigned int opcode, unsigned int count, unsigned int length);
+void request_unpack(const char * buf, unsigned int * opcode, unsigned int * count, unsigned int * length);
+void stripe_pack(char * buf, off_t total, off_t offset, off_t length);
+void stripe_unpack(const char * buf, off_t * total, off_t * offset, off_t * length);
+void batch_pack(char * buf, uint32_t name_length, uint32_t mode, off_t size);
+void batch_unpack(const char * buf, uint32_t * name_length, uint32_t * mode, off_t * size);
+void delta_pack(char * buf, uint32_t type, uint32_t count, off_t value);
+void delta_unpack(const char * buf, uint32_t * type, uint32_t * count, off_t * value);
+void sig_pack(char * buf, uint32_t weak, uint64_t strong);
+void sig_unpack(const char * buf, uint32_t * weak, uint64_t * strong);
+void block_pack(char * buf, uint32_t wire_length, uint32_t raw_length);
+void block_unpack(const char * buf, uint32_t * wire_length, uint32_t * raw_length);
+void codec_init(struct codec * c, int enabled);
+void codec_free(struct codec * c);
+size_t block_encode(struct codec * c, char * out, const char * in, size_t length);
+int block_decode(struct codec * c, char * out, size_t raw_length, const char * in, size_t wire_length);
+void codec_summary(struct codec * c, char * buf, size_t size);
+long long cpu_time_ns(void);
 
 #endif
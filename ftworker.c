@@ -0,0 +1,212 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftworker.c
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Supervisor for multi-process servers.  Starts
+ *      a fixed number of worker processes, watches their
+ *      heartbeats, and restarts any worker that exits or
+ *      stops responding.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include "ftworker.h"
+
+//Static Variables:
+static volatile sig_atomic_t stopping;
+static volatile sig_atomic_t reloading;
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads the monotonic clock
+ * Param:   void
+ * Return:  time_t -  Seconds since an arbitrary fixed point
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static time_t now_seconds(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Runs worker processes until the supervisor receives sigint or sigterm
+ * Param:   int count -  Number of workers to keep running
+ * Param:   worker_main body -  Function each worker runs; it is passed a
+ *      descriptor to send heartbeats over and must not return
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void run_supervisor(int count, worker_main body) {
+    struct sigaction sig;
+    struct worker * workers;
+    struct pollfd * fds;
+    char beats[64];
+    pid_t pid;
+    time_t now;
+    int i, status;
+
+    //Stop cleanly on sigint and sigterm:
+    sig.sa_handler = supervisor_signal_handler;
+    sigemptyset(&sig.sa_mask);
+    sig.sa_flags = 0;
+    sigaction(SIGINT, &sig, NULL);
+    sigaction(SIGTERM, &sig, NULL);
+
+    //Pass sighup (reload) on to the workers:
+    sig.sa_handler = supervisor_reload_handler;
+    sigaction(SIGHUP, &sig, NULL);
+
+    if((workers = calloc(count, sizeof(*workers))) == NULL ||
+        (fds = calloc(count, sizeof(*fds))) == NULL) {
+        perror("Error allocating memory");
+        exit(EXIT_FAILURE);
+    }
+
+    //Start the workers:
+    for(i=0; i<count; i++) {
+        spawn_worker(&workers[i], body);
+    }
+    printf("Server started with %d workers\n", count);
+    printf("Listening for incoming connections...\n");
+
+    while(!stopping) {
+
+        //Wait for heartbeats:
+        for(i=0; i<count; i++) {
+            fds[i].fd = workers[i].pid > 0 ? workers[i].heartbeat_fd : -1;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        poll(fds, count, HEARTBEAT_INTERVAL);
+        now = now_seconds();
+
+        if(reloading) {
+            reloading = 0;
+            for(i=0; i<count; i++) {
+                if(workers[i].pid > 0) {
+                    kill(workers[i].pid, SIGHUP);
+                }
+            }
+        }
+
+        for(i=0; i<count; i++) {
+            if(fds[i].revents & POLLIN) {
+                while(read(workers[i].heartbeat_fd, beats, sizeof(beats)) > 0);
+                workers[i].last_beat = now;
+            }
+        }
+
+        //Reap workers that have exited:
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for(i=0; i<count && workers[i].pid != pid; i++);
+            if(i == count) {
+                continue;
+            }
+
+            if(WIFSIGNALED(status)) {
+                printf("Worker %d killed by signal %d\n", (int) pid, WTERMSIG(status));
+            }
+            else {
+                printf("Worker %d exited with status %d\n", (int) pid, WEXITSTATUS(status));
+            }
+
+            //Back off if the worker died right after starting:
+            close(workers[i].heartbeat_fd);
+            workers[i].pid = 0;
+            workers[i].respawn_at = now + (now - workers[i].started < RESPAWN_DELAY ? RESPAWN_DELAY : 0);
+        }
+
+        for(i=0; i<count; i++) {
+
+            //Restart workers that have stopped responding:
+            if(workers[i].pid > 0 && now - workers[i].last_beat > WORKER_TIMEOUT) {
+                printf("Worker %d unresponsive, restarting\n", (int) workers[i].pid);
+                kill(workers[i].pid, SIGKILL);
+                workers[i].last_beat = now;
+            }
+
+            //Replace workers that have exited:
+            if(workers[i].pid == 0 && now >= workers[i].respawn_at) {
+                spawn_worker(&workers[i], body);
+                printf("Worker %d started\n", (int) workers[i].pid);
+            }
+        }
+    }
+
+    //Shut down the workers:
+    for(i=0; i<count; i++) {
+        if(workers[i].pid > 0) {
+            kill(workers[i].pid, SIGTERM);
+        }
+    }
+    while(wait(NULL) > 0 || errno == EINTR);
+
+    printf("Server shut down\n");
+    exit(EXIT_SUCCESS);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Forks a worker process connected to the supervisor by a heartbeat pipe
+ * Param:   struct worker * w -  Slot to record the worker in
+ * Param:   worker_main body -  Function the worker runs
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void spawn_worker(struct worker * w, worker_main body) {
+    int fds[2];
+    pid_t pid;
+
+    if(pipe2(fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("Error creating heartbeat pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    fflush(stdout);
+    if((pid = fork()) == -1) {
+        perror("Error starting worker");
+        exit(EXIT_FAILURE);
+    }
+
+    //Worker: exit along with the supervisor
+    if(pid == 0) {
+        close(fds[0]);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if(getppid() == 1) {
+            exit(EXIT_SUCCESS);
+        }
+        body(fds[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    //Supervisor:
+    close(fds[1]);
+    w->pid = pid;
+    w->heartbeat_fd = fds[0];
+    w->started = now_seconds();
+    w->last_beat = w->started;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Tells the supervisor that this worker is still making progress
+ * Param:   int heartbeat_fd -  Descriptor passed to the worker's main function
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void send_heartbeat(int heartbeat_fd) {
+
+    if(write(heartbeat_fd, ".", 1) == -1 && errno == EPIPE) {
+        exit(EXIT_SUCCESS);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Signal handler for the supervisor's sigint and sigterm signals
+ * Param:   int sig -  The signal received
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void supervisor_signal_handler(int sig) {
+    stopping = 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Signal handler for the supervisor's sighup, which it passes on to the workers
+ * Param:   int sig -  The signal received
+ * Return:  void
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+void supervisor_reload_handler(int sig) {
+    reloading = 1;
+}
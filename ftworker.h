@@ -0,0 +1,51 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftworker.h
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Header file for ftworker.c
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#ifndef FTWORKER_H
+#define FTWORKER_H
+
+//CONSTANTS:
+
+#define HEARTBEAT_INTERVAL 1000
+#define WORKER_TIMEOUT 10
+#define RESPAWN_DELAY 1
+
+
+//TYPES:
+
+typedef void (*worker_main)(int heartbeat_fd);
+
+struct worker {
+    pid_t pid;
+    int heartbeat_fd;
+    time_t started;
+    time_t last_beat;
+    time_t respawn_at;
+};
+
+
+//FUNCTION PROTOTYPES:
+
+void run_supervisor(int count, worker_main body);
+void spawn_worker(struct worker * w, worker_main body);
+void send_heartbeat(int heartbeat_fd);
+void supervisor_signal_handler(int sig);
+void supervisor_reload_handler(int sig);
+
+#endif
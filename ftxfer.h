@@ -0,0 +1,106 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Program: ftxfer.h
+ * Author: Nathan Cochran
+ * Date: 11/17/2013
+ * Description: Header file for ftxfer.c
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <time.h>
+
+#ifndef FTXFER_H
+#define FTXFER_H
+
+//CONSTANTS:
+
+#define XFER_CHUNK (1 << 20)
+#define XFER_COPY_SIZE (256 * 1024)
+#define XFER_UNTIL_EOF ((off_t) -1)
+
+
+//TRANSFER METHODS:
+
+#define XFER_SENDFILE 0
+#define XFER_SPLICE 1
+#define XFER_SPLICE_PIPE 2
+#define XFER_COPY 3
+#define XFER_MEMORY 4
+
+
+//TYPES:
+
+//A transfer from a file, pipe or buffer to a descriptor.  step caps how much
+//a single xfer_step() moves (0 for XFER_CHUNK), e.g. to stay within a rate
+//limit.  pipe_size is the capacity of the intermediate pipe, if there is one.
+struct xfer {
+    int out_fd;
+    int in_fd;
+    int method;
+    off_t offset;
+    off_t remaining;
+    off_t total;
+    int eof;
+    int pipe_fd[2];
+    size_t pipe_size;
+    size_t in_pipe;
+    char * buf;
+    size_t buf_off;
+    size_t buf_len;
+    const char * data;
+    off_t data_len;
+    size_t step;
+};
+
+//Measurements of one transfer: when it started, when its first byte went
+//over the data connection and when it ended, and the bytes and system
+//calls that took on the data connection
+struct xfer_stats {
+    long long start_ns;
+    long long first_ns;
+    long long end_ns;
+    off_t bytes;
+    long calls;
+};
+
+//The measurements of several transfers added up
+struct xfer_totals {
+    long transfers;
+    off_t bytes;
+    long calls;
+    long long busy_ns;
+    long long first_ns;
+    long firsts;
+};
+
+
+//FUNCTION PROTOTYPES:
+
+ssize_t write_all(int fd, const void * buf, size_t length);
+ssize_t pwrite_all(int fd, const void * buf, size_t length, off_t offset);
+ssize_t read_all(int fd, void * buf, size_t length);
+void xfer_init(struct xfer * x, int out_fd, int in_fd, off_t offset, off_t length);
+void xfer_init_memory(struct xfer * x, int out_fd, const char * data, off_t data_len, off_t offset, off_t length);
+size_t xfer_count(struct xfer * x, size_t limit);
+ssize_t xfer_step(struct xfer * x);
+int xfer_pipe(struct xfer * x);
+void xfer_moved(struct xfer * x, ssize_t filled, ssize_t sent);
+int xfer_done(struct xfer * x);
+void xfer_close(struct xfer * x);
+off_t transfer_file(int out_fd, int in_fd, off_t offset, off_t length);
+off_t copy_range(int in_fd, off_t in_offset, int out_fd, off_t out_offset, off_t length);
+long long xfer_clock_ns(void);
+void xfer_stats_start(struct xfer_stats * s);
+void xfer_stats_count(struct xfer_stats * s, ssize_t moved);
+void xfer_stats_end(struct xfer_stats * s);
+void xfer_stats_summary(struct xfer_stats * s, char * buf, size_t size);
+void xfer_totals_add(struct xfer_totals * t, struct xfer_stats * s);
+void xfer_totals_summary(struct xfer_totals * t, char * buf, size_t size);
+
+#endif